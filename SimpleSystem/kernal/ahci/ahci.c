@@ -0,0 +1,711 @@
+﻿#include "ahci.h"
+
+#include "../cpu/cpu.h"
+#include "../memory/frame.h"
+#include "../memory/paging.h"
+#include "../pci/pci.h"
+#include "../pic/pic.h"
+#include "../serial/serial.h"
+
+static PciDevice* controller = nullptr;
+static HbaMemory* hba = nullptr;
+static u8 irq = 0xFF;
+
+static AhciDisk disks[AHCI_MAX_DISKS];
+static u32 disk_count = 0;
+
+static u8 ahci_probe(PciDevice* dev) {
+    controller = dev;
+    pci_enable(dev);
+    
+    return 1;
+}
+
+static PciDriver ahci_driver = {
+    .name = "ahci",
+    .vendor = PCI_ANY,
+    .device = PCI_ANY,
+    .class = PCI_CLASS_STORAGE,
+    .subclass = PCI_SUBCLASS_SATA,
+    .prog_if = AHCI_PROG_IF,
+    .probe = ahci_probe,
+};
+
+static u8 ahci_wait_clear(volatile u32* reg, u32 bits) {
+    for (u32 i = 0; i < AHCI_TIMEOUT; i++) {
+        if (!(*reg & bits))
+            return 1;
+        
+        asm volatile ("pause");
+    }
+    
+    return 0;
+}
+
+// Also drops everything in PxCI/PxSACT
+static void ahci_port_stop(HbaPort* port) {
+    port->cmd &= ~AHCI_PXCMD_ST;
+    ahci_wait_clear(&port->cmd, AHCI_PXCMD_CR);
+    
+    port->cmd &= ~AHCI_PXCMD_FRE;
+    ahci_wait_clear(&port->cmd, AHCI_PXCMD_FR);
+}
+
+static void ahci_port_start(HbaPort* port) {
+    ahci_wait_clear(&port->tfd, AHCI_TFD_BSY | AHCI_TFD_DRQ);
+    
+    port->cmd |= AHCI_PXCMD_FRE;
+    port->cmd |= AHCI_PXCMD_ST;
+}
+
+// One region per physically contiguous run, returns how many
+static u32 ahci_build_prdt(HbaCommandTable* table, u8* buffer, u32 bytes) {
+    u32 count = 0;
+    u32 virt = (u32)buffer;
+    u32 end = virt + bytes;
+    
+    while (virt < end) {
+        u32 phys = dma_phys((void*)virt);
+        u32 length = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        
+        if (length > end - virt)
+            length = end - virt;
+        
+        HbaPrd* last = count ? &table->prdt[count - 1] : nullptr;
+        
+        if (last && last->dba + last->dbc + 1 == phys && last->dbc + 1 + length <= AHCI_PRD_MAX_BYTES) {
+            last->dbc += length;
+        } else {
+            HbaPrd* prd = &table->prdt[count++];
+            
+            prd->dba = phys;
+            prd->dbau = 0;
+            prd->reserved = 0;
+            prd->dbc = length - 1;
+        }
+        
+        virt += length;
+    }
+    
+    return count;
+}
+
+static void ahci_fill_command(AhciDisk* disk, u32 slot, u8 command, u32 lba, u32 count,
+                              void* buffer, u8 write, u8 fua) {
+    HbaCommandHeader* header = &disk->headers[slot];
+    HbaCommandTable* table = &disk->tables[slot];
+    
+    u8 queued = command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA;
+    u32 bytes = command == ATA_CMD_IDENTIFY ? ATA_SECTOR_SIZE : count * ATA_SECTOR_SIZE;
+    
+    memset(table->cfis, 0, sizeof(table->cfis));
+    
+    header->fis_length = (sizeof(FisRegH2D) / 4) | (write ? AHCI_HEADER_WRITE : 0);
+    header->flags = 0;
+    header->prdt_length = buffer ? ahci_build_prdt(table, buffer, bytes) : 0;
+    header->prdbc = 0;
+    
+    FisRegH2D* fis = (FisRegH2D*)table->cfis;
+    
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    fis->command = command;
+    fis->device = ATA_DEVICE_LBA;
+    
+    fis->lba0 = lba & 0xFF;
+    fis->lba1 = (lba >> 8) & 0xFF;
+    fis->lba2 = (lba >> 16) & 0xFF;
+    fis->lba3 = (lba >> 24) & 0xFF;
+    
+    if (queued) {
+        // NCQ moves the count to the features and the tag into the count
+        fis->feature_low = count & 0xFF;
+        fis->feature_high = (count >> 8) & 0xFF;
+        fis->count_low = slot << 3;
+        
+        if (fua)
+            fis->device |= ATA_DEVICE_FUA;
+    } else {
+        fis->count_low = count & 0xFF;
+        fis->count_high = (count >> 8) & 0xFF;
+    }
+}
+
+static s32 ahci_free_slot(AhciDisk* disk) {
+    for (u32 i = 0; i < disk->slots; i++) {
+        if (!(disk->busy & (1u << i)))
+            return i;
+    }
+    
+    return -1;
+}
+
+static void ahci_claim_slot(AhciDisk* disk, u32 slot, BlockRequest* request, u32 sectors, u8 flush) {
+    disk->busy |= 1u << slot;
+    disk->slot_request[slot] = request;
+    disk->slot_sectors[slot] = sectors;
+    disk->slot_flush[slot] = flush;
+    
+    disk->stats.commands++;
+}
+
+static void ahci_queue_pop(AhciDisk* disk) {
+    disk->queue_head = disk->queue_head->next;
+    disk->head_issued = 0;
+    
+    if (!disk->queue_head)
+        disk->queue_tail = nullptr;
+}
+
+static void ahci_finish(AhciDisk* disk, BlockRequest* request, u8 status) {
+    if (request->status != BLOCK_PENDING && request->status != BLOCK_ACTIVE)
+        return;
+    
+    // A failed request can still be partly queued
+    if (disk->queue_head == request)
+        ahci_queue_pop(disk);
+    
+    if (status == BLOCK_FAILED) {
+        disk->stats.errors++;
+        printf("AHCI error: port %d lba=%x %d/%d sectors error=%x\n",
+               disk->index, request->lba, request->done, request->count, request->error);
+    }
+    
+    request->status = status;
+    
+    if (request->callback)
+        request->callback(request);
+}
+
+static void ahci_issue_flush(AhciDisk* disk, u32 slot, BlockRequest* request);
+
+// A FLUSH CACHE EXT is in flight, it can't share the drive with anything
+static u8 ahci_flushing(AhciDisk* disk) {
+    for (u32 slot = 0; slot < disk->slots; slot++) {
+        if ((disk->busy & (1u << slot)) && disk->slot_flush[slot])
+            return 1;
+    }
+    
+    return 0;
+}
+
+// Fills every free slot from the queue
+static void ahci_issue(AhciDisk* disk) {
+    u32 issued = 0;
+    
+    while (disk->queue_head && !ahci_flushing(disk)) {
+        s32 slot = ahci_free_slot(disk);
+        
+        if (slot < 0)
+            break;
+        
+        BlockRequest* request = disk->queue_head;
+        
+        // Non-queued, it waits until the slots are empty
+        if (request->flags & BLOCK_FLUSH) {
+            if (disk->busy)
+                break;
+            
+            ahci_queue_pop(disk);
+            request->status = BLOCK_ACTIVE;
+            ahci_issue_flush(disk, slot, request);
+            
+            break;
+        }
+        
+        u32 offset = disk->head_issued;
+        u32 count = request->count - offset;
+        u8 fua = request->write && (request->flags & BLOCK_FUA);
+        
+        if (count > AHCI_MAX_SECTORS)
+            count = AHCI_MAX_SECTORS;
+        
+        u8 command;
+        
+        if (disk->ncq)
+            command = request->write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+        else if (request->write)
+            command = fua && disk->fua ? ATA_CMD_WRITE_DMA_FUA_EXT : ATA_CMD_WRITE_DMA_EXT;
+        else
+            command = ATA_CMD_READ_DMA_EXT;
+        
+        ahci_fill_command(disk, slot, command, request->lba + offset, count,
+                          (u8*)request->buffer + offset * ATA_SECTOR_SIZE, request->write, fua);
+        
+        ahci_claim_slot(disk, slot, request, count, 0);
+        issued |= 1u << slot;
+        
+        request->status = BLOCK_ACTIVE;
+        disk->head_issued += count;
+        
+        if (disk->head_issued == request->count)
+            ahci_queue_pop(disk);
+    }
+    
+    if (!issued)
+        return;
+    
+    // PxSACT has to have the tags before the commands are issued
+    if (disk->ncq)
+        disk->regs->sact = issued;
+    
+    disk->regs->ci = issued;
+    
+    u32 in_flight = 0;
+    
+    for (u32 busy = disk->busy; busy; busy &= busy - 1)
+        in_flight++;
+    
+    if (in_flight > disk->stats.max_in_flight)
+        disk->stats.max_in_flight = in_flight;
+}
+
+/**
+ * Fails everything in flight and restarts the port,
+ * whatever is still queued is issued again afterwards.
+ */
+static void ahci_port_error(AhciDisk* disk, u32 is) {
+    HbaPort* port = disk->regs;
+    u8 error = (port->tfd >> 8) & 0xFF;
+    
+    printf("AHCI port %d: is=%x tfd=%x serr=%x, resetting\n", disk->index, is, port->tfd, port->serr);
+    
+    ahci_port_stop(port);
+    
+    u32 busy = disk->busy;
+    disk->busy = 0;
+    
+    for (u32 slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (!(busy & (1u << slot)))
+            continue;
+        
+        BlockRequest* request = disk->slot_request[slot];
+        disk->slot_request[slot] = nullptr;
+        
+        request->error = error;
+        ahci_finish(disk, request, BLOCK_FAILED);
+    }
+    
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    
+    ahci_port_start(port);
+    ahci_issue(disk);
+}
+
+// Flush requests, and FUA writes on drives that can't do FUA themselves
+static void ahci_issue_flush(AhciDisk* disk, u32 slot, BlockRequest* request) {
+    ahci_fill_command(disk, slot, ATA_CMD_FLUSH_EXT, 0, 0, nullptr, 0, 0);
+    ahci_claim_slot(disk, slot, request, 0, 1);
+    disk->stats.flushes++;
+    
+    disk->regs->ci = 1u << slot;
+}
+
+static void ahci_port_complete(AhciDisk* disk) {
+    HbaPort* port = disk->regs;
+    
+    u32 is = port->is;
+    port->is = is;
+    
+    if (is & AHCI_PXIS_ERRORS) {
+        ahci_port_error(disk, is);
+        return;
+    }
+    
+    u32 finished = disk->busy & ~(port->ci | port->sact);
+    
+    for (u32 slot = 0; finished; slot++) {
+        if (!(finished & (1u << slot)))
+            continue;
+        
+        finished &= ~(1u << slot);
+        
+        BlockRequest* request = disk->slot_request[slot];
+        u32 sectors = disk->slot_sectors[slot];
+        
+        disk->busy &= ~(1u << slot);
+        disk->slot_request[slot] = nullptr;
+        
+        if (disk->slot_flush[slot]) {
+            ahci_finish(disk, request, BLOCK_DONE);
+            continue;
+        }
+        
+        request->done += sectors;
+        disk->stats.sectors += sectors;
+        
+        if (request->done < request->count)
+            continue;
+        
+        // FPDMA and WRITE DMA FUA EXT are FUA themselves, everything else stays in the drive's cache
+        if (request->write && (request->flags & BLOCK_FUA) && !disk->ncq && !disk->fua)
+            ahci_issue_flush(disk, slot, request);
+        else
+            ahci_finish(disk, request, BLOCK_DONE);
+    }
+    
+    ahci_issue(disk);
+}
+
+static void ahci_irq(void) {
+    u32 is = hba->is;
+    
+    for (u32 i = 0; i < disk_count; i++) {
+        if (is & (1u << disks[i].index)) {
+            disks[i].stats.irqs++;
+            ahci_port_complete(&disks[i]);
+        }
+    }
+    
+    hba->is = is;
+}
+
+// Runs a single non-queued command on slot 0, only while nothing else is in flight
+static u8 ahci_command_sync(AhciDisk* disk, u8 command, void* buffer) {
+    HbaPort* port = disk->regs;
+    
+    ahci_fill_command(disk, 0, command, 0, 0, buffer, 0, 0);
+    
+    port->is = 0xFFFFFFFF;
+    port->ci = 1;
+    
+    for (u32 i = 0; i < AHCI_TIMEOUT; i++) {
+        if (port->is & AHCI_PXIS_TFES)
+            break;
+        
+        if (!(port->ci & 1))
+            return !(port->tfd & AHCI_TFD_ERR);
+        
+        asm volatile ("pause");
+    }
+    
+    ahci_port_error(disk, port->is);
+    
+    return 0;
+}
+
+static u8 ahci_identify(AhciDisk* disk) {
+    DmaBuffer buffer;
+    
+    if (!dma_alloc(&buffer, ATA_SECTOR_SIZE, DMA_ZERO))
+        return 0;
+    
+    if (!ahci_command_sync(disk, ATA_CMD_IDENTIFY, buffer.virt)) {
+        dma_free(&buffer);
+        return 0;
+    }
+    
+    u16* id = (u16*)buffer.virt;
+    
+    // TODO; Anything past 2 TiB needs the high words (and 64 bit LBAs everywhere)
+    u32 lba48 = id[ATA_ID_LBA48] | ((u32)id[ATA_ID_LBA48 + 1] << 16);
+    u32 lba28 = id[ATA_ID_LBA28] | ((u32)id[ATA_ID_LBA28 + 1] << 16);
+    disk->sectors = lba48 ? lba48 : lba28;
+    disk->fua = (id[ATA_ID_COMMANDS3] & ATA_ID_VALID_MASK) == ATA_ID_VALID && (id[ATA_ID_COMMANDS3] & ATA_ID_CMD3_FUA);
+    
+    if ((hba->cap & AHCI_CAP_SNCQ) && (id[ATA_ID_SATA_CAPS] & ATA_ID_SATA_NCQ)) {
+        u32 depth = (id[ATA_ID_QUEUE_DEPTH] & 0x1F) + 1;
+        
+        disk->ncq = 1;
+        
+        if (depth < disk->slots)
+            disk->slots = depth;
+    }
+    
+    // The model string has its bytes swapped in every word
+    for (u32 i = 0; i < 20; i++) {
+        disk->model[i * 2] = id[ATA_ID_MODEL + i] >> 8;
+        disk->model[i * 2 + 1] = id[ATA_ID_MODEL + i] & 0xFF;
+    }
+    
+    s32 end = 39;
+    
+    while (end >= 0 && disk->model[end] == ' ')
+        end--;
+    
+    disk->model[end + 1] = '\0';
+    
+    dma_free(&buffer);
+    
+    return 1;
+}
+
+static void ahci_disk_free(AhciDisk* disk) {
+    dma_free(&disk->list_buffer);
+    dma_free(&disk->fis_buffer);
+    dma_free(&disk->table_buffer);
+}
+
+static u8 ahci_disk_setup(AhciDisk* disk, u8 index) {
+    HbaPort* port = &hba->ports[index];
+    
+    memset(disk, 0, sizeof(AhciDisk));
+    
+    disk->regs = port;
+    disk->index = index;
+    disk->slots = AHCI_CAP_NCS(hba->cap);
+    
+    // Class sized DMA buffers are aligned to their size, more than the HBA needs
+    if (!dma_alloc(&disk->list_buffer, sizeof(HbaCommandHeader) * AHCI_MAX_SLOTS, DMA_ZERO) ||
+        !dma_alloc(&disk->fis_buffer, 256, DMA_ZERO) ||
+        !dma_alloc(&disk->table_buffer, sizeof(HbaCommandTable) * disk->slots, DMA_ZERO)) {
+        printf("AHCI port %d: no DMA memory\n", index);
+        ahci_disk_free(disk);
+        
+        return 0;
+    }
+    
+    disk->headers = (HbaCommandHeader*)disk->list_buffer.virt;
+    disk->tables = (HbaCommandTable*)disk->table_buffer.virt;
+    
+    for (u32 i = 0; i < disk->slots; i++) {
+        disk->headers[i].ctba = disk->table_buffer.phys + i * sizeof(HbaCommandTable);
+        disk->headers[i].ctbau = 0;
+    }
+    
+    ahci_port_stop(port);
+    
+    port->clb = disk->list_buffer.phys;
+    port->clbu = 0;
+    port->fb = disk->fis_buffer.phys;
+    port->fbu = 0;
+    
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    port->ie = AHCI_PXIE_DEFAULT;
+    
+    ahci_port_start(port);
+    
+    if (!ahci_identify(disk)) {
+        printf("AHCI port %d: IDENTIFY failed\n", index);
+        
+        ahci_port_stop(port);
+        ahci_disk_free(disk);
+        
+        return 0;
+    }
+    
+    return 1;
+}
+
+static void ahci_block_submit(BlockDevice* dev, BlockRequest* request) {
+    ahci_submit((AhciDisk*)dev->driver_data, request);
+}
+
+static u8 ahci_block_wait(BlockDevice* dev, BlockRequest* request) {
+    return ahci_wait((AhciDisk*)dev->driver_data, request);
+}
+
+static const BlockOps ahci_ops = {
+    .submit = ahci_block_submit,
+    .wait = ahci_block_wait,
+};
+
+void ahci_init(void) {
+    pci_register_driver(&ahci_driver);
+    
+    if (!controller)
+        return;
+    
+    PciBar* abar = &controller->bars[AHCI_ABAR];
+    
+    if (!abar->size || (abar->flags & PCI_BAR_IO)) {
+        printf("AHCI: controller without a memory ABAR\n");
+        return;
+    }
+    
+    // Registers, never cached
+    pager_map_range(pager_kernel(), abar->base, abar->base, abar->size,
+                    PAGE_PRESENT | PAGE_WRITE | PAGE_CACHE_DISABLE);
+    
+    hba = (HbaMemory*)abar->base;
+    hba->ghc |= AHCI_GHC_AE;
+    
+    u32 implemented = hba->pi;
+    
+    for (u32 i = 0; i < AHCI_MAX_PORTS && disk_count < AHCI_MAX_DISKS; i++) {
+        if (!(implemented & (1u << i)))
+            continue;
+        
+        HbaPort* port = &hba->ports[i];
+        u32 ssts = port->ssts;
+        
+        if (AHCI_SSTS_DET(ssts) != AHCI_DET_PRESENT || AHCI_SSTS_IPM(ssts) != AHCI_IPM_ACTIVE)
+            continue;
+        
+        if (port->sig != AHCI_SIG_ATA) {
+            printf("AHCI port %d: signature %x isn't a disk, skipped\n", i, port->sig);
+            continue;
+        }
+        
+        if (ahci_disk_setup(&disks[disk_count], i))
+            disk_count++;
+    }
+    
+    // Without a routed IRQ ahci_wait polls the ports
+    if (controller->irq_line < 16) {
+        irq = controller->irq_line;
+        
+        irq_install_handler(irq, ahci_irq);
+        IRQ_clear_mask(irq);
+    }
+    
+    hba->is = 0xFFFFFFFF;
+    hba->ghc |= AHCI_GHC_IE;
+    
+    printf("AHCI: %d ports, %d slots, ncq %s, irq %d, %d disks\n",
+           hba->pi, AHCI_CAP_NCS(hba->cap), (hba->cap & AHCI_CAP_SNCQ) ? "yes" : "no", irq, disk_count);
+    
+    for (u32 i = 0; i < disk_count; i++) {
+        AhciDisk* disk = &disks[i];
+        
+        printf("  port %d: %s, %d MB, %s with %d slots\n", disk->index, disk->model,
+               disk->sectors / 2048, disk->ncq ? "NCQ" : "no NCQ", disk->slots);
+        
+        char name[] = "ahci0";
+        name[4] = '0' + i;
+        
+        block_register(name, &ahci_ops, disk, disk->sectors, disk->slots);
+    }
+}
+
+u32 ahci_disk_count(void) {
+    return disk_count;
+}
+
+AhciDisk* ahci_disk(u32 index) {
+    return index < disk_count ? &disks[index] : nullptr;
+}
+
+void ahci_submit(AhciDisk* disk, BlockRequest* request) {
+    request->status = BLOCK_PENDING;
+    request->error = 0;
+    request->done = 0;
+    request->next = nullptr;
+    
+    u8 flush = request->flags & BLOCK_FLUSH;
+    
+    if (request->count == 0 && !flush) {
+        request->status = BLOCK_DONE;
+        
+        if (request->callback)
+            request->callback(request);
+        
+        return;
+    }
+    
+    if (!flush && (request->lba + request->count > disk->sectors ||
+                   !dma_reachable(request->buffer, request->count * ATA_SECTOR_SIZE))) {
+        ahci_finish(disk, request, BLOCK_FAILED);
+        return;
+    }
+    
+    if (request->write)
+        disk->stats.writes++;
+    else if (!flush)
+        disk->stats.reads++;
+    
+    if (disk->queue_tail)
+        disk->queue_tail->next = request;
+    else
+        disk->queue_head = request;
+    
+    disk->queue_tail = request;
+    
+    ahci_issue(disk);
+}
+
+u8 ahci_wait(AhciDisk* disk, BlockRequest* request) {
+    u32 idle = 0;
+    u32 total = 0;
+    
+    while (request->status == BLOCK_PENDING || request->status == BLOCK_ACTIVE) {
+        u32 irqs = disk->stats.irqs;
+        
+        handleIrqs();
+        
+        if (disk->stats.irqs != irqs)
+            idle = 0;
+        
+        // The IRQ never showed up (or there isn't one), look at the port directly
+        if (++idle > AHCI_IRQ_TIMEOUT || irq == 0xFF) {
+            disk->stats.polled++;
+            ahci_port_complete(disk);
+            
+            idle = 0;
+        }
+        
+        if (++total > AHCI_TIMEOUT) {
+            printf("AHCI timeout: port %d\n", disk->index);
+            ahci_port_error(disk, 0);
+            
+            total = 0;
+        }
+        
+        asm volatile ("pause");
+    }
+    
+    return request->status == BLOCK_DONE;
+}
+
+void ahci_benchmark(AhciDisk* disk, u32 lba, u32 sectors) {
+    u32 count = sectors / AHCI_MAX_SECTORS;
+    
+    if (count > AHCI_MAX_SLOTS) count = AHCI_MAX_SLOTS;
+    if (count == 0) return;
+    
+    u32 frames = count * AHCI_MAX_SECTORS * ATA_SECTOR_SIZE / FRAME_SIZE;
+    u8* buffer = (u8*)alloc_frames(frames);
+    
+    if (!buffer) {
+        printf("AHCI benchmark: no buffer\n");
+        return;
+    }
+    
+    BlockRequest requests[AHCI_MAX_SLOTS];
+    
+    for (u32 i = 0; i < count; i++) {
+        requests[i].lba = lba + i * AHCI_MAX_SECTORS;
+        requests[i].count = AHCI_MAX_SECTORS;
+        requests[i].buffer = buffer + i * AHCI_MAX_SECTORS * ATA_SECTOR_SIZE;
+        requests[i].write = 0;
+        requests[i].callback = nullptr;
+        requests[i].ctx = nullptr;
+    }
+    
+    // Queue depth 1, then everything at once
+    for (u8 queued = 0; queued < 2; queued++) {
+        u64 start = rdtsc();
+        u8 ok = 1;
+        
+        for (u32 i = 0; i < count; i++) {
+            ahci_submit(disk, &requests[i]);
+            
+            if (!queued)
+                ok &= ahci_wait(disk, &requests[i]);
+        }
+        
+        for (u32 i = 0; queued && i < count; i++)
+            ok &= ahci_wait(disk, &requests[i]);
+        
+        u32 us = cpu_tsc_us(rdtsc() - start);
+        u32 kb = count * AHCI_MAX_SECTORS * ATA_SECTOR_SIZE / 1024;
+        u32 kb_per_s = us ? udiv64((u64)kb * 1000000, us) : 0;
+        
+        printf("AHCI benchmark queue depth %d: %d KB in %d us, %d.%d MB/s%s\n", queued ? count : 1,
+               kb, us, kb_per_s / 1024, (kb_per_s % 1024) * 10 / 1024, ok ? "" : " (failed)");
+    }
+    
+    free_frames(buffer, frames);
+}
+
+void ahci_dump(void) {
+    for (u32 i = 0; i < disk_count; i++) {
+        AhciStats* s = &disks[i].stats;
+        
+        printf("AHCI port %d: reads=%d writes=%d commands=%d sectors=%d flushes=%d irqs=%d polled=%d errors=%d max_in_flight=%d\n",
+               disks[i].index, s->reads, s->writes, s->commands, s->sectors, s->flushes, s->irqs,
+               s->polled, s->errors, s->max_in_flight);
+    }
+}
@@ -0,0 +1,254 @@
+﻿#ifndef AHCI_H
+#define AHCI_H
+
+#include "../io.h"
+#include "../ata/ata.h"
+#include "../memory/dma.h"
+
+/**
+ * AHCI SATA driver.
+ *
+ * The HBA is found through PCI (class 01/06/01), its registers (ABAR, BAR5)
+ * are mapped uncached. Every port with a SATA disk gets a command list,
+ * a received FIS area and one command table per slot, all from the DMA pool.
+ *
+ * Requests use the same BlockRequest as the IDE driver. A request is split
+ * into commands of up to AHCI_MAX_SECTORS, and as many commands as there
+ * are free slots are issued at once. With NCQ (READ/WRITE FPDMA QUEUED)
+ * the drive can reorder and overlap them, without it the HBA runs them
+ * one after another.
+ *
+ * BLOCK_FUA writes set the FUA bit of FPDMA commands, or use WRITE DMA FUA
+ * EXT, or get a FLUSH CACHE EXT after them on drives without FUA. A
+ * BLOCK_FLUSH request is a non-queued command, it waits for the slots to
+ * drain and nothing is issued next to it.
+ *
+ * Every disk is registered as block device "ahci<n>".
+ *
+ * https://wiki.osdev.org/AHCI
+ */
+
+#define AHCI_PROG_IF        0x01
+#define AHCI_ABAR           5
+
+#define AHCI_MAX_PORTS      32
+#define AHCI_MAX_DISKS      4
+#define AHCI_MAX_SLOTS      32
+
+#define AHCI_PRDT_MAX       32  // Entries per command table
+#define AHCI_MAX_SECTORS    128 // Per command, 64 KiB
+
+// Spins without an IRQ before the ports are polled directly
+#define AHCI_IRQ_TIMEOUT    100000
+#define AHCI_TIMEOUT        10000000
+
+// Generic host control
+#define AHCI_CAP_NCS(cap)   ((((cap) >> 8) & 0x1F) + 1) // Command slots
+#define AHCI_CAP_SNCQ       (1u << 30)
+#define AHCI_CAP_S64A       (1u << 31)
+
+#define AHCI_GHC_IE         (1u << 1)
+#define AHCI_GHC_AE         (1u << 31)
+
+// Port command and status
+#define AHCI_PXCMD_ST       (1u << 0)
+#define AHCI_PXCMD_FRE      (1u << 4)
+#define AHCI_PXCMD_FR       (1u << 14)
+#define AHCI_PXCMD_CR       (1u << 15)
+
+// Port interrupts
+#define AHCI_PXIS_DHRS      (1u << 0)  // D2H register FIS
+#define AHCI_PXIS_PSS       (1u << 1)  // PIO setup FIS
+#define AHCI_PXIS_DSS       (1u << 2)  // DMA setup FIS
+#define AHCI_PXIS_SDBS      (1u << 3)  // Set device bits FIS (NCQ completions)
+#define AHCI_PXIS_DPS       (1u << 5)  // Descriptor processed
+#define AHCI_PXIS_TFES      (1u << 30) // Task file error
+#define AHCI_PXIS_ERRORS    0x7DC00050 // Every error bit, all of them need a recovery
+
+#define AHCI_PXIE_DEFAULT   (AHCI_PXIS_DHRS | AHCI_PXIS_PSS | AHCI_PXIS_DSS | \
+                             AHCI_PXIS_SDBS | AHCI_PXIS_DPS | AHCI_PXIS_ERRORS)
+
+#define AHCI_SSTS_DET(s)    ((s) & 0xF)
+#define AHCI_SSTS_IPM(s)    (((s) >> 8) & 0xF)
+#define AHCI_DET_PRESENT    3
+#define AHCI_IPM_ACTIVE     1
+
+#define AHCI_SIG_ATA        0x00000101
+
+#define AHCI_TFD_ERR        0x01
+#define AHCI_TFD_DRQ        0x08
+#define AHCI_TFD_BSY        0x80
+
+#define FIS_TYPE_REG_H2D    0x27
+#define FIS_H2D_COMMAND     0x80 // "C" bit, the FIS carries a command
+
+// The rest of the commands and IDENTIFY words are in ata.h
+#define ATA_CMD_READ_FPDMA     0x60 // READ FPDMA QUEUED
+#define ATA_CMD_WRITE_FPDMA    0x61 // WRITE FPDMA QUEUED
+#define ATA_CMD_FLUSH_EXT      0xEA
+
+#define ATA_DEVICE_FUA      0x80 // FPDMA commands, written through the drive's cache
+
+// IDENTIFY DEVICE words
+#define ATA_ID_QUEUE_DEPTH  75
+#define ATA_ID_SATA_CAPS    76
+#define ATA_ID_SATA_NCQ     (1 << 8)
+
+typedef volatile struct {
+    u32 clb;        // Command list base, 1 KiB aligned
+    u32 clbu;
+    u32 fb;         // Received FIS base, 256 byte aligned
+    u32 fbu;
+    u32 is;
+    u32 ie;
+    u32 cmd;
+    u32 reserved0;
+    u32 tfd;
+    u32 sig;
+    u32 ssts;
+    u32 sctl;
+    u32 serr;
+    u32 sact;       // NCQ tags still outstanding
+    u32 ci;         // Commands issued and not yet accepted/done
+    u32 sntf;
+    u32 fbs;
+    u32 reserved1[11];
+    u32 vendor[4];
+} HbaPort;
+
+typedef volatile struct {
+    u32 cap;
+    u32 ghc;
+    u32 is;
+    u32 pi;         // Ports implemented
+    u32 vs;
+    u32 ccc_ctl;
+    u32 ccc_ports;
+    u32 em_loc;
+    u32 em_ctl;
+    u32 cap2;
+    u32 bohc;
+    
+    u8 reserved[0xA0 - 0x2C];
+    u8 vendor[0x100 - 0xA0];
+    
+    HbaPort ports[AHCI_MAX_PORTS];
+} HbaMemory;
+
+typedef struct {
+    u8 fis_length;  // In dwords, bits 4:0, bit 6 is "write"
+    u8 flags;
+    u16 prdt_length;
+    
+    volatile u32 prdbc; // Bytes transferred
+    
+    u32 ctba;       // Command table base, 128 byte aligned
+    u32 ctbau;
+    u32 reserved[4];
+} __attribute__((packed)) HbaCommandHeader;
+
+#define AHCI_HEADER_WRITE   0x40
+
+typedef struct {
+    u32 dba;
+    u32 dbau;
+    u32 reserved;
+    u32 dbc;        // Bytes - 1, bit 31 is "interrupt on completion"
+} __attribute__((packed)) HbaPrd;
+
+#define AHCI_PRD_MAX_BYTES  (4 * 1024 * 1024)
+
+typedef struct {
+    u8 type;
+    u8 flags;       // Bit 7 (FIS_H2D_COMMAND)
+    u8 command;
+    u8 feature_low;
+    
+    u8 lba0;
+    u8 lba1;
+    u8 lba2;
+    u8 device;
+    
+    u8 lba3;
+    u8 lba4;
+    u8 lba5;
+    u8 feature_high;
+    
+    u8 count_low;   // NCQ: the tag, in bits 7:3
+    u8 count_high;
+    u8 icc;
+    u8 control;
+    
+    u32 reserved;
+} __attribute__((packed)) FisRegH2D;
+
+typedef struct {
+    u8 cfis[64];
+    u8 acmd[16];
+    u8 reserved[48];
+    HbaPrd prdt[AHCI_PRDT_MAX];
+} __attribute__((packed)) HbaCommandTable;
+
+typedef struct {
+    u32 reads;
+    u32 writes;
+    u32 commands;
+    u32 sectors;
+    u32 irqs;
+    u32 polled;
+    u32 errors;
+    u32 flushes;
+    u32 max_in_flight;  // Most commands outstanding at once
+} AhciStats;
+
+typedef struct {
+    HbaPort* regs;
+    u8 index;
+    
+    u8 ncq;             // The drive and the HBA both do NCQ
+    u8 fua;             // WRITE DMA FUA EXT
+    u8 slots;           // Usable command slots
+    u32 sectors;        // Capacity
+    char model[41];
+    
+    HbaCommandHeader* headers;
+    HbaCommandTable* tables;
+    DmaBuffer list_buffer;
+    DmaBuffer fis_buffer;
+    DmaBuffer table_buffer;
+    
+    // Slots in use and what they belong to
+    u32 busy;
+    BlockRequest* slot_request[AHCI_MAX_SLOTS];
+    u32 slot_sectors[AHCI_MAX_SLOTS];
+    u8 slot_flush[AHCI_MAX_SLOTS];
+    
+    // Requests not fully issued yet, the head may be partly issued
+    BlockRequest* queue_head;
+    BlockRequest* queue_tail;
+    u32 head_issued;
+    
+    AhciStats stats;
+} AhciDisk;
+
+/**
+ * Looks for an AHCI controller and sets up every disk on it.
+ * Needs paging (the ABAR gets mapped) and the DMA pool.
+ */
+void ahci_init(void);
+
+u32 ahci_disk_count(void);
+AhciDisk* ahci_disk(u32 index);
+
+void ahci_submit(AhciDisk* disk, BlockRequest* request);
+u8 ahci_wait(AhciDisk* disk, BlockRequest* request);
+
+/**
+ * Reads "sectors" from "lba" in 64 KiB requests, first one at a time,
+ * then all of them queued at once.
+ */
+void ahci_benchmark(AhciDisk* disk, u32 lba, u32 sectors);
+
+void ahci_dump(void);
+
+#endif // AHCI_H
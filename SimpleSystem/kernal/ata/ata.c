@@ -0,0 +1,780 @@
+﻿#include "ata.h"
+
+#include "../cpu/cpu.h"
+#include "../memory/dma.h"
+#include "../memory/paging.h"
+#include "../pci/pci.h"
+#include "../pic/pic.h"
+#include "../serial/serial.h"
+
+static u16 io_base = ATA_PRIMARY_IO;
+static u16 ctrl_base = ATA_PRIMARY_CTRL;
+static u8 irq = ATA_PRIMARY_IRQ;
+
+static PciDevice* controller = nullptr;
+static u8 present = 0;
+static AtaInfo info;
+
+// Bus master DMA, bm_base is 0 if the controller doesn't have it
+static u16 bm_base = 0;
+static u8 use_dma = 1;
+static u8 dma_command = 0;  // The current command is a DMA one
+
+// Aligned to its size, so the table itself never crosses 64 KiB
+static AtaPrd prdt[ATA_PRD_MAX] __attribute__((aligned(sizeof(AtaPrd) * ATA_PRD_MAX)));
+
+static BlockRequest* queue_head = nullptr;
+static BlockRequest* queue_tail = nullptr;
+static u32 queued = 0;
+
+// READ/WRITE MULTIPLE, pio_block is the DRQ block size of the current PIO command
+static u8 use_multiple = 1;
+static u32 pio_block = 1;
+
+static BlockRequest* active = nullptr;
+static u32 chunk_left = 0;  // Sectors left in the current command
+static u8 flushing = 0;     // Waiting for a CACHE FLUSH
+static u8 unflushed = 0;    // Part of a FUA write went out without FUA, it's flushed at the end
+
+static AtaStats stats;
+
+static const BlockOps ata_ops;
+
+// 400ns, every alternate status read takes ~100ns
+static inline void ata_delay(void) {
+    for (int i = 0; i < 4; i++)
+        inb(ctrl_base + ATA_ALT_STATUS);
+}
+
+static u8 ata_wait_not_busy(void) {
+    for (u32 i = 0; i < ATA_TIMEOUT; i++) {
+        if (!(inb(ctrl_base + ATA_ALT_STATUS) & ATA_SR_BSY))
+            return 1;
+        
+        asm volatile ("pause");
+    }
+    
+    return 0;
+}
+
+static u8 ata_wait_drq(void) {
+    for (u32 i = 0; i < ATA_TIMEOUT; i++) {
+        u8 status = inb(ctrl_base + ATA_ALT_STATUS);
+        
+        if (status & (ATA_SR_ERR | ATA_SR_DF))
+            return 0;
+        
+        if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRQ))
+            return 1;
+        
+        asm volatile ("pause");
+    }
+    
+    return 0;
+}
+
+// IDENTIFY DEVICE (with the IRQ off), fills "info". Returns 0 if there's no ATA drive
+static u8 ata_identify(void) {
+    u16 id[256];
+    
+    outb(ctrl_base + ATA_CONTROL, ATA_CTRL_NIEN);
+    outb(io_base + ATA_DRIVE, ATA_DEVICE_MASTER);
+    ata_delay();
+    
+    // A floating bus (no drive) reads 0xFF
+    if (inb(io_base + ATA_STATUS) == 0xFF)
+        return 0;
+    
+    outb(io_base + ATA_SECTOR_COUNT, 0);
+    outb(io_base + ATA_LBA_LOW, 0);
+    outb(io_base + ATA_LBA_MID, 0);
+    outb(io_base + ATA_LBA_HIGH, 0);
+    outb(io_base + ATA_COMMAND, ATA_CMD_IDENTIFY);
+    ata_delay();
+    
+    if (inb(io_base + ATA_STATUS) == 0 || !ata_wait_not_busy())
+        return 0;
+    
+    // ATAPI and SATA devices leave their signature here instead of answering
+    if (inb(io_base + ATA_LBA_MID) || inb(io_base + ATA_LBA_HIGH))
+        return 0;
+    
+    if (!ata_wait_drq())
+        return 0;
+    
+    insw(io_base + ATA_DATA, id, 256);
+    
+    if (!(id[ATA_ID_CAPABILITIES] & ATA_ID_CAP_LBA)) {
+        printf("ATA: the drive can't do LBA\n");
+        return 0;
+    }
+    
+    u8 valid = (id[ATA_ID_COMMANDS2] & ATA_ID_VALID_MASK) == ATA_ID_VALID;
+    
+    info.lba48 = valid && (id[ATA_ID_COMMANDS2] & ATA_ID_CMD2_LBA48);
+    info.fua = info.lba48 && (id[ATA_ID_COMMANDS3] & ATA_ID_VALID_MASK) == ATA_ID_VALID &&
+               (id[ATA_ID_COMMANDS3] & ATA_ID_CMD3_FUA);
+    
+    // TODO; Anything past 2 TiB needs the high words (and 64 bit LBAs everywhere)
+    u32 lba48 = id[ATA_ID_LBA48] | ((u32)id[ATA_ID_LBA48 + 1] << 16);
+    u32 lba28 = id[ATA_ID_LBA28] | ((u32)id[ATA_ID_LBA28 + 1] << 16);
+    
+    if (id[ATA_ID_LBA48 + 2] || id[ATA_ID_LBA48 + 3])
+        lba48 = 0xFFFFFFFF;
+    
+    info.sectors = info.lba48 && lba48 ? lba48 : lba28;
+    
+    // The biggest power of two READ/WRITE MULTIPLE can do
+    u32 max_multiple = id[ATA_ID_MAX_MULTIPLE] & 0xFF;
+    info.multiple = 1;
+    
+    while (info.multiple * 2 <= max_multiple)
+        info.multiple *= 2;
+    
+    // The model string has its bytes swapped in every word
+    for (u32 i = 0; i < 20; i++) {
+        info.model[i * 2] = id[ATA_ID_MODEL + i] >> 8;
+        info.model[i * 2 + 1] = id[ATA_ID_MODEL + i] & 0xFF;
+    }
+    
+    s32 end = 39;
+    
+    while (end >= 0 && info.model[end] == ' ')
+        end--;
+    
+    info.model[end + 1] = '\0';
+    
+    return 1;
+}
+
+// SET MULTIPLE MODE, a sector per DRQ block stays if the drive refuses it
+static void ata_set_multiple(void) {
+    if (info.multiple <= 1)
+        return;
+    
+    outb(io_base + ATA_DRIVE, ATA_DEVICE_MASTER | ATA_DEVICE_LBA);
+    outb(io_base + ATA_SECTOR_COUNT, info.multiple & 0xFF);
+    outb(io_base + ATA_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_delay();
+    
+    if (!ata_wait_not_busy() || (inb(io_base + ATA_STATUS) & (ATA_SR_ERR | ATA_SR_DF))) {
+        printf("ATA: SET MULTIPLE %d failed\n", info.multiple);
+        info.multiple = 1;
+    }
+}
+
+static u8 ata_probe(PciDevice* dev) {
+    controller = dev;
+    
+    if ((dev->prog_if & ATA_PROG_IF_NATIVE) && dev->bars[0].size && dev->bars[1].size &&
+        dev->irq_line < 16) {
+        io_base = dev->bars[0].base;
+        ctrl_base = dev->bars[1].base + 2;
+        irq = dev->irq_line;
+    }
+    
+    PciBar* bm = &dev->bars[ATA_BM_BAR];
+    
+    if (bm->size && (bm->flags & PCI_BAR_IO))
+        bm_base = bm->base;
+    
+    pci_enable(dev);
+    
+    return 1;
+}
+
+static PciDriver ata_driver = {
+    .name = "ata",
+    .vendor = PCI_ANY,
+    .device = PCI_ANY,
+    .class = PCI_CLASS_STORAGE,
+    .subclass = PCI_SUBCLASS_IDE,
+    .prog_if = PCI_ANY,
+    .probe = ata_probe,
+};
+
+void ata_init(void) {
+    memset(&stats, 0, sizeof(stats));
+    
+    pci_register_driver(&ata_driver);
+    
+    printf("ATA: ports %x/%x irq %d%s, %s\n", io_base, ctrl_base, irq,
+           controller ? "" : " (no PCI IDE controller)", bm_base ? "bus master DMA" : "PIO only");
+    
+    memset(&info, 0, sizeof(info));
+    present = ata_identify();
+    
+    if (present) {
+        ata_set_multiple();
+        
+        printf("ATA: %s, %d MB, %s%s, %d sectors per DRQ block\n", info.model,
+               info.sectors / (1024 * 1024 / ATA_SECTOR_SIZE), info.lba48 ? "LBA48" : "LBA28",
+               info.fua ? ", FUA" : "", info.multiple);
+    } else {
+        printf("ATA: no drive on the primary master\n");
+    }
+    
+    // Select the master and let it raise IRQs (nIEN clear)
+    outb(io_base + ATA_DRIVE, ATA_DEVICE_MASTER | ATA_DEVICE_LBA);
+    ata_delay();
+    outb(ctrl_base + ATA_CONTROL, 0);
+    
+    irq_install_handler(irq, ata_irq);
+    IRQ_clear_mask(irq);
+    
+    if (present)
+        block_register("ata0", &ata_ops, nullptr, info.sectors, 1);
+}
+
+u8 ata_present(void) {
+    return present;
+}
+
+const AtaInfo* ata_info(void) {
+    return &info;
+}
+
+static void ata_start_next(void);
+
+static void ata_complete(BlockRequest* request, u8 status) {
+    if (dma_command) {
+        outb(bm_base + ATA_BM_COMMAND, 0);
+        dma_command = 0;
+    }
+    
+    active = nullptr;
+    chunk_left = 0;
+    flushing = 0;
+    unflushed = 0;
+    
+    if (status == BLOCK_FAILED) {
+        stats.errors++;
+        printf("ATA error: lba=%x sector %d/%d error=%x\n",
+               request->lba, request->done, request->count, request->error);
+    }
+    
+    request->status = status;
+    
+    if (request->callback)
+        request->callback(request);
+    
+    ata_start_next();
+}
+
+// Sectors in the next DRQ block of the current PIO command
+static inline u32 ata_drq_sectors(void) {
+    return chunk_left < pio_block ? chunk_left : pio_block;
+}
+
+static void ata_write_block(BlockRequest* request) {
+    outsw(io_base + ATA_DATA, (u8*)request->buffer + request->done * ATA_SECTOR_SIZE,
+          ata_drq_sectors() * ATA_SECTOR_SIZE / 2);
+    
+    stats.drq_blocks++;
+}
+
+/**
+ * Describes as much of [buffer, buffer + bytes) as the PRD table holds,
+ * one region per physically contiguous run (split at 64 KiB boundaries).
+ * Returns how many bytes (whole sectors) it covers, 0 if the controller
+ * can't reach the buffer.
+ */
+static u32 ata_build_prdt(u8* buffer, u32 bytes) {
+    if ((u32)buffer & 1)
+        return 0;
+    
+    u32 count = 0;
+    u32 virt = (u32)buffer;
+    u32 end = virt + bytes;
+    
+    while (virt < end) {
+        u32 phys = dma_phys((void*)virt);
+        
+        if (!phys)
+            return 0;
+        
+        // Up to the end of the page, the next boundary, or the end of the buffer
+        u32 length = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        u32 boundary = ATA_PRD_BOUNDARY - (phys & (ATA_PRD_BOUNDARY - 1));
+        
+        if (length > boundary) length = boundary;
+        if (length > end - virt) length = end - virt;
+        
+        AtaPrd* last = count ? &prdt[count - 1] : nullptr;
+        u32 last_bytes = last ? (last->bytes ? last->bytes : ATA_PRD_BOUNDARY) : 0;
+        
+        if (last && last->phys + last_bytes == phys &&
+            (last->phys & ~(ATA_PRD_BOUNDARY - 1)) == (phys & ~(ATA_PRD_BOUNDARY - 1))) {
+            last->bytes = (last_bytes + length) & 0xFFFF;
+        } else {
+            if (count == ATA_PRD_MAX)
+                break;
+            
+            prdt[count].phys = phys;
+            prdt[count].bytes = length & 0xFFFF;
+            prdt[count].flags = 0;
+            count++;
+        }
+        
+        virt += length;
+    }
+    
+    // A full table can end in the middle of a sector, the command stops at the last whole one
+    u32 covered = virt - (u32)buffer;
+    u32 excess = covered % ATA_SECTOR_SIZE;
+    
+    covered -= excess;
+    
+    while (excess) {
+        AtaPrd* last = &prdt[count - 1];
+        u32 last_bytes = last->bytes ? last->bytes : ATA_PRD_BOUNDARY;
+        
+        if (last_bytes <= excess) {
+            count--;
+            excess -= last_bytes;
+        } else {
+            last->bytes = (last_bytes - excess) & 0xFFFF;
+            excess = 0;
+        }
+    }
+    
+    if (!covered)
+        return 0;
+    
+    prdt[count - 1].flags = ATA_PRD_EOT;
+    
+    return covered;
+}
+
+// The command for a transfer, READ/WRITE MULTIPLE whenever a DRQ block is more than a sector
+static u8 ata_command(u8 write, u8 ext, u8 fua) {
+    if (dma_command) {
+        if (fua)
+            return ATA_CMD_WRITE_DMA_FUA_EXT;
+        
+        if (ext)
+            return write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        
+        return write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    }
+    
+    if (pio_block > 1) {
+        if (fua)
+            return ATA_CMD_WRITE_MULTIPLE_FUA_EXT;
+        
+        if (ext)
+            return write ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE_EXT;
+        
+        return write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE;
+    }
+    
+    if (ext)
+        return write ? ATA_CMD_WRITE_EXT : ATA_CMD_READ_EXT;
+    
+    return write ? ATA_CMD_WRITE : ATA_CMD_READ;
+}
+
+// Sends the command for the next part of the request, as much as one command (or the PRD table) takes
+static void ata_issue(BlockRequest* request) {
+    u32 lba = request->lba + request->done;
+    u32 count = request->count - request->done;
+    u32 max = info.lba48 ? ATA_MAX_SECTORS_EXT : ATA_MAX_SECTORS;
+    
+    if (count > max)
+        count = max;
+    
+    if (!ata_wait_not_busy()) {
+        ata_complete(request, BLOCK_FAILED);
+        return;
+    }
+    
+    u8* buffer = (u8*)request->buffer + request->done * ATA_SECTOR_SIZE;
+    u8 direction = request->write ? 0 : ATA_BM_CMD_READ;
+    u32 dma_bytes = bm_base && use_dma ? ata_build_prdt(buffer, count * ATA_SECTOR_SIZE) : 0;
+    
+    dma_command = dma_bytes != 0;
+    pio_block = use_multiple ? info.multiple : 1;
+    
+    if (bm_base && use_dma && !dma_command)
+        stats.dma_fallbacks++;
+    
+    if (dma_command)
+        count = dma_bytes / ATA_SECTOR_SIZE;
+    
+    chunk_left = count;
+    
+    if (dma_command) {
+        // .bss is identity mapped, the table's address is also its physical one
+        outb(bm_base + ATA_BM_COMMAND, 0);
+        outl(bm_base + ATA_BM_PRDT, (u32)prdt);
+        outb(bm_base + ATA_BM_STATUS, inb(bm_base + ATA_BM_STATUS) | ATA_BM_SR_ERROR | ATA_BM_SR_IRQ);
+        outb(bm_base + ATA_BM_COMMAND, direction);
+    }
+    
+    // There's only FUA for DMA and WRITE MULTIPLE, anything else gets flushed once the request is done
+    u8 fua = 0;
+    
+    if (request->write && (request->flags & BLOCK_FUA)) {
+        fua = info.fua && (dma_command || pio_block > 1);
+        unflushed |= !fua;
+    }
+    
+    // EXT commands only when they're needed, the high bytes cost another round of port writes
+    u8 ext = fua || count > ATA_MAX_SECTORS || lba + count > ATA_LBA28_SECTORS;
+    
+    if (ext) {
+        outb(io_base + ATA_DRIVE, ATA_DEVICE_MASTER | ATA_DEVICE_LBA);
+        outb(io_base + ATA_SECTOR_COUNT, (count >> 8) & 0xFF);
+        outb(io_base + ATA_LBA_LOW, (lba >> 24) & 0xFF);
+        outb(io_base + ATA_LBA_MID, 0);
+        outb(io_base + ATA_LBA_HIGH, 0);
+        
+        stats.ext_commands++;
+    } else {
+        outb(io_base + ATA_DRIVE, ATA_DEVICE_MASTER | ATA_DEVICE_LBA | ((lba >> 24) & 0x0F));
+    }
+    
+    outb(io_base + ATA_SECTOR_COUNT, count & 0xFF);
+    outb(io_base + ATA_LBA_LOW, lba & 0xFF);
+    outb(io_base + ATA_LBA_MID, (lba >> 8) & 0xFF);
+    outb(io_base + ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+    
+    outb(io_base + ATA_COMMAND, ata_command(request->write, ext, fua));
+    stats.commands++;
+    stats.fua_commands += fua;
+    
+    if (dma_command) {
+        outb(bm_base + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
+        return;
+    }
+    
+    // Writes send the first block as soon as the drive asks for it, the rest after each IRQ
+    if (request->write) {
+        if (!ata_wait_drq()) {
+            request->error = inb(io_base + ATA_ERROR);
+            ata_complete(request, BLOCK_FAILED);
+            
+            return;
+        }
+        
+        ata_write_block(request);
+    }
+}
+
+// CACHE FLUSH, the IRQ after it completes the active request
+static void ata_flush(void) {
+    flushing = 1;
+    stats.flushes++;
+    
+    outb(io_base + ATA_COMMAND, ATA_CMD_FLUSH);
+}
+
+static void ata_start_next(void) {
+    if (active || !queue_head)
+        return;
+    
+    active = queue_head;
+    queue_head = active->next;
+    
+    if (!queue_head)
+        queue_tail = nullptr;
+    
+    queued--;
+    
+    active->next = nullptr;
+    active->status = BLOCK_ACTIVE;
+    
+    if (active->flags & BLOCK_FLUSH) {
+        if (ata_wait_not_busy())
+            ata_flush();
+        else
+            ata_complete(active, BLOCK_FAILED);
+        
+        return;
+    }
+    
+    if (active->write)
+        stats.writes++;
+    else
+        stats.reads++;
+    
+    ata_issue(active);
+}
+
+// The current command's sectors are all in, issue the next one, flush or finish
+static void ata_command_done(BlockRequest* request) {
+    if (request->done < request->count) {
+        ata_issue(request);
+        return;
+    }
+    
+    // Plain writes stay in the drive's cache until a flush request
+    if (unflushed) {
+        ata_flush();
+        return;
+    }
+    
+    ata_complete(request, BLOCK_DONE);
+}
+
+static void ata_dma_irq(BlockRequest* request) {
+    u8 bm_status = inb(bm_base + ATA_BM_STATUS);
+    
+    // Still moving data
+    if ((bm_status & ATA_BM_SR_ACTIVE) && !(bm_status & ATA_BM_SR_IRQ))
+        return;
+    
+    outb(bm_base + ATA_BM_COMMAND, 0);
+    outb(bm_base + ATA_BM_STATUS, bm_status | ATA_BM_SR_ERROR | ATA_BM_SR_IRQ);
+    dma_command = 0;
+    
+    if (bm_status & ATA_BM_SR_ERROR) {
+        request->error = inb(io_base + ATA_ERROR);
+        ata_complete(request, BLOCK_FAILED);
+        
+        return;
+    }
+    
+    request->done += chunk_left;
+    stats.sectors += chunk_left;
+    stats.dma_sectors += chunk_left;
+    chunk_left = 0;
+    
+    ata_command_done(request);
+}
+
+void ata_irq(void) {
+    u8 status = inb(io_base + ATA_STATUS);
+    BlockRequest* request = active;
+    
+    if (!request) {
+        stats.spurious++;
+        return;
+    }
+    
+    stats.irqs++;
+    
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        request->error = inb(io_base + ATA_ERROR);
+        ata_complete(request, BLOCK_FAILED);
+        
+        return;
+    }
+    
+    if (flushing) {
+        ata_complete(request, BLOCK_DONE);
+        return;
+    }
+    
+    if (dma_command) {
+        ata_dma_irq(request);
+        return;
+    }
+    
+    u32 sectors = ata_drq_sectors();
+    
+    if (!request->write) {
+        // Not ready yet, wait for the next one
+        if (!(status & ATA_SR_DRQ))
+            return;
+        
+        insw(io_base + ATA_DATA, (u8*)request->buffer + request->done * ATA_SECTOR_SIZE,
+             sectors * ATA_SECTOR_SIZE / 2);
+        
+        stats.drq_blocks++;
+    } else if ((status & ATA_SR_BSY) || (chunk_left > sectors && !(status & ATA_SR_DRQ))) {
+        // Not done with the block or not asking for the next one, a late IRQ or poll for the last one
+        return;
+    }
+    
+    // For writes the IRQ means the previous block was taken
+    request->done += sectors;
+    chunk_left -= sectors;
+    stats.sectors += sectors;
+    
+    if (chunk_left) {
+        if (request->write)
+            ata_write_block(request);
+        
+        return;
+    }
+    
+    ata_command_done(request);
+}
+
+void ata_submit(BlockRequest* request) {
+    request->status = BLOCK_PENDING;
+    request->error = 0;
+    request->done = 0;
+    request->next = nullptr;
+    
+    if ((request->count == 0 && !(request->flags & BLOCK_FLUSH)) || !present) {
+        request->status = present ? BLOCK_DONE : BLOCK_FAILED;
+        
+        if (request->callback)
+            request->callback(request);
+        
+        return;
+    }
+    
+    if (queue_tail)
+        queue_tail->next = request;
+    else
+        queue_head = request;
+    
+    queue_tail = request;
+    
+    if (++queued > stats.max_queued)
+        stats.max_queued = queued;
+    
+    ata_start_next();
+}
+
+u8 ata_wait(BlockRequest* request) {
+    u32 idle = 0;
+    u32 total = 0;
+    
+    // Whatever is in front of "request" has to keep moving, not only "request" itself
+    BlockRequest* progress = active;
+    u32 progress_done = active ? active->done : 0;
+    
+    while (request->status == BLOCK_PENDING || request->status == BLOCK_ACTIVE) {
+        u32 irqs = stats.irqs;
+        
+        handleIrqs();
+        
+        if (stats.irqs != irqs)
+            idle = 0;
+        
+        // The IRQ never showed up, look at the drive directly
+        if (++idle > ATA_IRQ_TIMEOUT && active && !(inb(ctrl_base + ATA_ALT_STATUS) & ATA_SR_BSY)) {
+            stats.polled++;
+            ata_irq();
+            
+            idle = 0;
+        }
+        
+        if (active != progress || (active && active->done != progress_done)) {
+            progress = active;
+            progress_done = active ? active->done : 0;
+            total = 0;
+        }
+        
+        if (++total > ATA_TIMEOUT) {
+            total = 0;
+            
+            if (active) {
+                // Hung, the requests queued behind it get their turn
+                printf("ATA timeout: status=%x\n", inb(ctrl_base + ATA_ALT_STATUS));
+                
+                active->error = BLOCK_ERR_TIMEOUT;
+                ata_complete(active, BLOCK_FAILED);
+            } else if (queue_head) {
+                ata_start_next();
+            } else {
+                // Neither queued nor running, its completion got lost
+                printf("ATA timeout: lba=%x was never completed\n", request->lba);
+                
+                request->error = BLOCK_ERR_TIMEOUT;
+                request->status = BLOCK_FAILED;
+                stats.errors++;
+                
+                if (request->callback)
+                    request->callback(request);
+            }
+        }
+        
+        asm volatile ("pause");
+    }
+    
+    return request->status == BLOCK_DONE;
+}
+
+// There's only ever ata0, the driver state is global
+static void ata_block_submit(BlockDevice* dev, BlockRequest* request) {
+    (void)dev;
+    ata_submit(request);
+}
+
+static u8 ata_block_wait(BlockDevice* dev, BlockRequest* request) {
+    (void)dev;
+    return ata_wait(request);
+}
+
+static const BlockOps ata_ops = {
+    .submit = ata_block_submit,
+    .wait = ata_block_wait,
+};
+
+static u8 ata_transfer(u32 lba, u32 count, void* buffer, u8 write) {
+    BlockRequest request;
+    block_request_init(&request, lba, count, buffer, write);
+    
+    ata_submit(&request);
+    
+    return ata_wait(&request);
+}
+
+void ata_benchmark(u32 lba, u32 sectors) {
+    DmaBuffer buffer;
+    
+    if (!present)
+        return;
+    
+    // A command's worth, from the DMA pool so it's contiguous and never crosses 64 KiB
+    if (!dma_alloc(&buffer, DMA_CHUNK_SIZE, 0)) {
+        printf("ATA benchmark: no buffer\n");
+        return;
+    }
+    
+    u32 per_read = DMA_CHUNK_SIZE / ATA_SECTOR_SIZE;
+    u8 saved_dma = use_dma;
+    u8 saved_multiple = use_multiple;
+    
+    // PIO a sector per DRQ block, READ MULTIPLE, DMA
+    static const char* modes[] = { "PIO", "PIO multiple", "DMA" };
+    
+    for (u8 mode = 0; mode < 3; mode++) {
+        if (mode == 1 && info.multiple <= 1) {
+            printf("ATA benchmark: no READ MULTIPLE to compare with\n");
+            continue;
+        }
+        
+        if (mode == 2 && !bm_base) {
+            printf("ATA benchmark: no bus master DMA to compare with\n");
+            break;
+        }
+        
+        use_dma = mode == 2;
+        use_multiple = mode == 1;
+        
+        u64 start = rdtsc();
+        u8 ok = 1;
+        
+        for (u32 done = 0; ok && done < sectors; done += per_read) {
+            u32 count = sectors - done < per_read ? sectors - done : per_read;
+            ok = ata_transfer(lba + done, count, buffer.virt, 0);
+        }
+        
+        u32 us = cpu_tsc_us(rdtsc() - start);
+        u32 kb = sectors * ATA_SECTOR_SIZE / 1024;
+        u32 kb_per_s = us ? udiv64((u64)kb * 1000000, us) : 0;
+        
+        printf("ATA benchmark %s: %d KB in %d us, %d.%d MB/s%s\n", modes[mode], kb, us,
+               kb_per_s / 1024, (kb_per_s % 1024) * 10 / 1024, ok ? "" : " (failed)");
+    }
+    
+    use_dma = saved_dma;
+    use_multiple = saved_multiple;
+    dma_free(&buffer);
+}
+
+void ata_dump(void) {
+    printf("ATA: reads=%d writes=%d sectors=%d (dma %d) irqs=%d spurious=%d polled=%d errors=%d max_queued=%d\n",
+           stats.reads, stats.writes, stats.sectors, stats.dma_sectors, stats.irqs, stats.spurious,
+           stats.polled, stats.errors, stats.max_queued);
+    printf("  %s, %s, commands=%d (%d EXT, %d FUA) flushes=%d drq_blocks=%d of up to %d sectors\n",
+           present ? info.model : "no drive", info.lba48 ? "LBA48" : "LBA28",
+           stats.commands, stats.ext_commands, stats.fua_commands, stats.flushes, stats.drq_blocks, info.multiple);
+    printf("  %s, %d commands fell back to PIO\n", bm_base ? "bus master DMA" : "PIO only", stats.dma_fallbacks);
+}
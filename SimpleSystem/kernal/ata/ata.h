@@ -0,0 +1,205 @@
+﻿#ifndef ATA_H
+#define ATA_H
+
+#include "../io.h"
+#include "../block/block.h"
+
+/**
+ * ATA PIO driver for the primary master, driven by its IRQ (14 in legacy mode).
+ *
+ * The ports come from the PCI IDE controller when there's one, in
+ * compatibility mode its BARs are empty and the legacy ports are used.
+ *
+ * Requests are queued and handled one at a time, every IRQ moves one DRQ
+ * block, so the CPU only spends time on the disk when the drive has data.
+ * IDENTIFY tells the capacity and what the drive can do, when it supports
+ * READ/WRITE MULTIPLE a DRQ block is "multiple" sectors instead of one, and
+ * drives with LBA48 take up to 65536 sectors per command (EXT commands,
+ * only used when the command needs them).
+ *
+ * Writes stay in the drive's cache until a BLOCK_FLUSH request comes,
+ * BLOCK_FUA writes use the FUA EXT commands if the drive has them and are
+ * followed by a CACHE FLUSH if it doesn't.
+ * IRQs are polled through handleIrqs (like every other device), so
+ * whoever waits keeps servicing the keyboard and mouse in the meantime.
+ *
+ * When the IDE controller has a bus master BAR (BAR4) reads and writes
+ * go through DMA instead, the drive moves whole multi-sector runs into
+ * memory and there's only one IRQ per command. Buffers the controller
+ * can't use (odd addresses, unmapped pages) still go through PIO.
+ *
+ * The drive is registered as block device "ata0".
+ *
+ * https://wiki.osdev.org/ATA_PIO_Mode
+ * https://wiki.osdev.org/ATA/ATAPI_using_DMA
+ */
+
+// Build with -DATA_BENCHMARK=1 to time PIO against DMA at boot, it slows every boot down
+#ifndef ATA_BENCHMARK
+#define ATA_BENCHMARK 0
+#endif
+
+// Legacy primary bus, used unless the IDE controller runs it in PCI native mode
+#define ATA_PRIMARY_IO     0x1F0
+#define ATA_PRIMARY_CTRL   0x3F6
+#define ATA_PRIMARY_IRQ    14
+
+// Registers, offsets from the command block
+#define ATA_DATA           0
+#define ATA_ERROR          1
+#define ATA_SECTOR_COUNT   2 // LBA48 writes the high byte first, then the low one
+#define ATA_LBA_LOW        3
+#define ATA_LBA_MID        4
+#define ATA_LBA_HIGH       5
+#define ATA_DRIVE          6
+#define ATA_STATUS         7 // Reading it acknowledges the IRQ
+#define ATA_COMMAND        7
+
+// Offsets from the control block
+#define ATA_ALT_STATUS     0 // Same as ATA_STATUS, without the acknowledge
+#define ATA_CONTROL        0
+
+// IDE controller programming interface, the primary channel is in native mode
+#define ATA_PROG_IF_NATIVE 0x01
+
+// Bus master registers, offsets from BAR4 (primary channel)
+#define ATA_BM_BAR         4
+#define ATA_BM_COMMAND     0
+#define ATA_BM_STATUS      2
+#define ATA_BM_PRDT        4
+
+#define ATA_BM_CMD_START   0x01
+#define ATA_BM_CMD_READ    0x08 // Direction, set when the drive writes to memory
+
+#define ATA_BM_SR_ACTIVE   0x01
+#define ATA_BM_SR_ERROR    0x02 // Write 1 to clear
+#define ATA_BM_SR_IRQ      0x04 // Write 1 to clear
+
+// Physical region descriptors, a region can't cross a 64 KiB boundary
+#define ATA_PRD_MAX        64
+#define ATA_PRD_BOUNDARY   0x10000
+#define ATA_PRD_EOT        0x8000
+
+// Status register
+#define ATA_SR_ERR         0x01
+#define ATA_SR_DRQ         0x08
+#define ATA_SR_DF          0x20
+#define ATA_SR_DRDY        0x40
+#define ATA_SR_BSY         0x80
+
+// Device control register
+#define ATA_CTRL_NIEN      0x02 // Set to disable the IRQ
+
+// Drive register
+#define ATA_DEVICE_MASTER  0xA0
+#define ATA_DEVICE_LBA     0x40
+
+// Commands
+#define ATA_CMD_READ       0x20 // READ SECTOR(S)
+#define ATA_CMD_READ_EXT   0x24
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE      0x30 // WRITE SECTOR(S)
+#define ATA_CMD_WRITE_EXT  0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE 0xC6
+#define ATA_CMD_READ_DMA   0xC8
+#define ATA_CMD_WRITE_DMA  0xCA
+#define ATA_CMD_WRITE_MULTIPLE_FUA_EXT 0xCE
+#define ATA_CMD_FLUSH      0xE7 // CACHE FLUSH
+#define ATA_CMD_IDENTIFY   0xEC
+
+// IDENTIFY DEVICE words
+#define ATA_ID_MODEL       27   // 20 words, two characters each (swapped)
+#define ATA_ID_MAX_MULTIPLE 47  // Low byte, sectors per DRQ block READ/WRITE MULTIPLE can do
+#define ATA_ID_CAPABILITIES 49
+#define ATA_ID_LBA28       60   // 2 words of sectors
+#define ATA_ID_COMMANDS2   83
+#define ATA_ID_COMMANDS3   84
+#define ATA_ID_LBA48       100  // 4 words of sectors
+
+#define ATA_ID_CAP_LBA     (1 << 9)
+#define ATA_ID_CMD2_LBA48  (1 << 10)
+#define ATA_ID_CMD3_FUA    (1 << 6)
+#define ATA_ID_VALID_MASK  0xC000 // Words 83 and 84 only mean something if their top bits are 01
+#define ATA_ID_VALID       0x4000
+
+#define ATA_SECTOR_SIZE    512
+#define ATA_LBA28_SECTORS  0x10000000   // What a 28 bit LBA reaches
+#define ATA_MAX_SECTORS    256          // Per command, a count of 0 means 256
+#define ATA_MAX_SECTORS_EXT 65536       // Per EXT command, a count of 0 means 65536
+
+// Spins without an IRQ before the drive gets polled directly (lost IRQ)
+#define ATA_IRQ_TIMEOUT    100000
+// Spins without progress before the running request is given up on
+#define ATA_TIMEOUT        10000000
+
+typedef struct {
+    char model[41];
+    u32 sectors;        // Capped to what a u32 LBA reaches
+    u8 lba48;
+    u8 fua;             // WRITE DMA/MULTIPLE FUA EXT
+    u16 multiple;       // Sectors per DRQ block with READ/WRITE MULTIPLE, 1 without it
+} AtaInfo;
+
+typedef struct {
+    u32 phys;
+    u16 bytes;          // 0 means 64 KiB
+    u16 flags;
+} __attribute__((packed)) AtaPrd;
+
+typedef struct {
+    u32 reads;
+    u32 writes;
+    u32 commands;       // A request bigger than one command needs several
+    u32 ext_commands;   // LBA48 ones
+    u32 drq_blocks;     // PIO transfers, a sector each or "multiple" of them
+    u32 fua_commands;
+    u32 flushes;        // BLOCK_FLUSH requests and FUA writes the drive couldn't do itself
+    u32 sectors;
+    u32 dma_sectors;    // Part of "sectors" that went through bus master DMA
+    u32 dma_fallbacks;  // Commands that could have used DMA but the buffer couldn't
+    u32 irqs;
+    u32 spurious;       // IRQs without an active request
+    u32 polled;         // Times the drive had to be polled (IRQ didn't come)
+    u32 errors;
+    u32 max_queued;
+} AtaStats;
+
+// Has to run after pci_init
+void ata_init(void);
+
+// Whether a drive answered IDENTIFY on the primary master
+u8 ata_present(void);
+
+// What IDENTIFY said about the drive
+const AtaInfo* ata_info(void);
+
+// IRQ handler
+void ata_irq(void);
+
+/**
+ * Queues "request", it starts right away if the drive is idle.
+ * The request (and its buffer) has to stay around until it's done.
+ */
+void ata_submit(BlockRequest* request);
+
+/**
+ * Services IRQs until "request" is done, returns 0 if it failed.
+ * Don't call from a completion callback.
+ */
+u8 ata_wait(BlockRequest* request);
+
+/**
+ * Reads "sectors" from "lba" with PIO a sector per DRQ block, with
+ * READ MULTIPLE and with DMA, and prints the throughput of each.
+ */
+void ata_benchmark(u32 lba, u32 sectors);
+
+void ata_dump(void);
+
+#endif // ATA_H
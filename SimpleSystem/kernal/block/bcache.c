@@ -0,0 +1,311 @@
+﻿#include "bcache.h"
+
+#include "../memory/slab.h"
+#include "../serial/serial.h"
+
+static Buffer* buffers = nullptr;
+static u8* buffer_data = nullptr;
+
+static Buffer* hash_table[BCACHE_HASH_SIZE];
+
+static Buffer* lru_head = nullptr;
+static Buffer* lru_tail = nullptr;
+
+static BcacheStats stats;
+
+static inline u32 bcache_hash(BlockDevice* disk, u32 lba) {
+    return (((u32)disk >> 4) ^ lba ^ (lba >> 8)) & (BCACHE_HASH_SIZE - 1);
+}
+
+static void lru_remove(Buffer* buffer) {
+    if (buffer->lru_prev)
+        buffer->lru_prev->lru_next = buffer->lru_next;
+    else
+        lru_head = buffer->lru_next;
+    
+    if (buffer->lru_next)
+        buffer->lru_next->lru_prev = buffer->lru_prev;
+    else
+        lru_tail = buffer->lru_prev;
+    
+    buffer->lru_prev = buffer->lru_next = nullptr;
+}
+
+static void lru_push(Buffer* buffer) {
+    buffer->lru_prev = nullptr;
+    buffer->lru_next = lru_head;
+    
+    if (lru_head)
+        lru_head->lru_prev = buffer;
+    else
+        lru_tail = buffer;
+    
+    lru_head = buffer;
+}
+
+static void hash_remove(Buffer* buffer) {
+    Buffer** link = &hash_table[bcache_hash(buffer->disk, buffer->lba)];
+    
+    while (*link && *link != buffer)
+        link = &(*link)->hash_next;
+    
+    if (*link)
+        *link = buffer->hash_next;
+    
+    buffer->hash_next = nullptr;
+}
+
+static void hash_add(Buffer* buffer) {
+    u32 bucket = bcache_hash(buffer->disk, buffer->lba);
+    
+    buffer->hash_next = hash_table[bucket];
+    hash_table[bucket] = buffer;
+}
+
+static Buffer* hash_find(BlockDevice* disk, u32 lba) {
+    for (Buffer* buffer = hash_table[bcache_hash(disk, lba)]; buffer; buffer = buffer->hash_next) {
+        if (buffer->disk == disk && buffer->lba == lba)
+            return buffer;
+    }
+    
+    return nullptr;
+}
+
+static u8 bcache_writeback(Buffer* buffer) {
+    if (!buffer->dirty)
+        return 1;
+    
+    if (!block_write(buffer->disk, buffer->lba, 1, buffer->data)) {
+        stats.write_errors++;
+        printf("bcache: write back of %s sector %d failed\n", buffer->disk->name, buffer->lba);
+        
+        return 0;
+    }
+    
+    buffer->dirty = 0;
+    stats.writebacks++;
+    
+    return 1;
+}
+
+u8 bcache_init(u32 count) {
+    if (buffers || count == 0)
+        return buffers != nullptr;
+    
+    buffers = (Buffer*)kzalloc(count * sizeof(Buffer));
+    buffer_data = (u8*)kmalloc(count * BLOCK_SECTOR_SIZE);
+    
+    if (!buffers || !buffer_data) {
+        printf("bcache: no memory for %d buffers\n", count);
+        
+        kfree(buffers);
+        kfree(buffer_data);
+        buffers = nullptr;
+        buffer_data = nullptr;
+        
+        return 0;
+    }
+    
+    memset(hash_table, 0, sizeof(hash_table));
+    memset(&stats, 0, sizeof(stats));
+    
+    stats.buffers = count;
+    
+    // Every buffer starts out on the LRU list, unused ones are just invalid
+    for (u32 i = 0; i < count; i++) {
+        buffers[i].data = buffer_data + i * BLOCK_SECTOR_SIZE;
+        lru_push(&buffers[i]);
+    }
+    
+    return 1;
+}
+
+// The least recently used buffer that isn't pinned, written back first if it's dirty
+static Buffer* bcache_evict(void) {
+    for (Buffer* buffer = lru_tail; buffer; buffer = buffer->lru_prev) {
+        if (buffer->refs)
+            continue;
+        
+        if (buffer->valid) {
+            if (!bcache_writeback(buffer))
+                continue;
+            
+            hash_remove(buffer);
+            stats.evictions++;
+        }
+        
+        buffer->valid = 0;
+        
+        return buffer;
+    }
+    
+    return nullptr;
+}
+
+Buffer* bread(BlockDevice* dev, u32 lba) {
+    if (!buffers && !bcache_init(BCACHE_BUFFERS))
+        return nullptr;
+    
+    if (lba >= dev->sectors)
+        return nullptr;
+    
+    BlockDevice* disk = block_disk(dev, &lba);
+    Buffer* buffer = hash_find(disk, lba);
+    
+    if (buffer) {
+        stats.hits++;
+    } else {
+        buffer = bcache_evict();
+        
+        if (!buffer) {
+            printf("bcache: every buffer is pinned\n");
+            return nullptr;
+        }
+        
+        stats.misses++;
+        
+        if (!block_read(disk, lba, 1, buffer->data)) {
+            stats.read_errors++;
+            return nullptr;
+        }
+        
+        buffer->disk = disk;
+        buffer->lba = lba;
+        buffer->valid = 1;
+        buffer->dirty = 0;
+        
+        hash_add(buffer);
+    }
+    
+    buffer->refs++;
+    
+    lru_remove(buffer);
+    lru_push(buffer);
+    
+    return buffer;
+}
+
+void brelse(Buffer* buffer) {
+    if (!buffer) return;
+    
+    if (buffer->refs == 0) {
+        printf("brelse: %s sector %d isn't pinned\n", buffer->disk->name, buffer->lba);
+        return;
+    }
+    
+    buffer->refs--;
+}
+
+void bdirty(Buffer* buffer) {
+    buffer->dirty = 1;
+}
+
+u8 bcache_sync(BlockDevice* dev) {
+    if (!buffers)
+        return 1;
+    
+    u32 lba = 0;
+    BlockDevice* disk = dev ? block_disk(dev, &lba) : nullptr;
+    u8 ok = 1;
+    
+    // Disks that were written to, each one is flushed once at the end
+    BlockDevice* written[BLOCK_MAX_DEVICES];
+    u32 written_count = 0;
+    
+    // Everything is queued before anything goes out, so neighbouring sectors are written as one command
+    for (u32 i = 0; i < block_count(); i++) {
+        BlockDevice* other = block_get(i);
+        
+        if (!other->parent && (!disk || other == disk))
+            block_plug(other);
+    }
+    
+    for (u32 i = 0; i < stats.buffers; i++) {
+        Buffer* buffer = &buffers[i];
+        
+        if (!buffer->valid || !buffer->dirty || (disk && buffer->disk != disk))
+            continue;
+        
+        block_request_init(&buffer->request, buffer->lba, 1, buffer->data, 1);
+        block_submit(buffer->disk, &buffer->request);
+        
+        u32 j = 0;
+        
+        while (j < written_count && written[j] != buffer->disk)
+            j++;
+        
+        if (j == written_count)
+            written[written_count++] = buffer->disk;
+    }
+    
+    for (u32 i = 0; i < block_count(); i++) {
+        BlockDevice* other = block_get(i);
+        
+        if (!other->parent && (!disk || other == disk))
+            block_unplug(other);
+    }
+    
+    for (u32 i = 0; i < stats.buffers; i++) {
+        Buffer* buffer = &buffers[i];
+        
+        if (!buffer->valid || !buffer->dirty || (disk && buffer->disk != disk))
+            continue;
+        
+        if (!block_wait(buffer->disk, &buffer->request)) {
+            stats.write_errors++;
+            printf("bcache: write back of %s sector %d failed\n", buffer->disk->name, buffer->lba);
+            
+            ok = 0;
+            continue;
+        }
+        
+        buffer->dirty = 0;
+        stats.writebacks++;
+    }
+    
+    for (u32 i = 0; i < written_count; i++) {
+        if (!block_flush(written[i])) {
+            printf("bcache: flushing %s failed\n", written[i]->name);
+            ok = 0;
+        }
+    }
+    
+    return ok;
+}
+
+u8 bcache_read(BlockDevice* dev, u32 lba, u32 count, void* buffer) {
+    for (u32 i = 0; i < count; i++) {
+        Buffer* cached = bread(dev, lba + i);
+        
+        if (!cached)
+            return 0;
+        
+        memcpy((u8*)buffer + i * BLOCK_SECTOR_SIZE, cached->data, BLOCK_SECTOR_SIZE);
+        brelse(cached);
+    }
+    
+    return 1;
+}
+
+const BcacheStats* bcache_stats(void) {
+    return &stats;
+}
+
+void bcache_dump(void) {
+    u32 used = 0;
+    u32 dirty = 0;
+    u32 pinned = 0;
+    
+    for (u32 i = 0; i < stats.buffers; i++) {
+        used += buffers[i].valid;
+        dirty += buffers[i].dirty;
+        pinned += buffers[i].refs != 0;
+    }
+    
+    u32 lookups = stats.hits + stats.misses;
+    
+    printf("Buffer cache: %d/%d buffers used, %d dirty, %d pinned\n", used, stats.buffers, dirty, pinned);
+    printf("  hits=%d misses=%d (%d%% hit) evictions=%d writebacks=%d read_errors=%d write_errors=%d\n",
+           stats.hits, stats.misses, lookups ? stats.hits * 100 / lookups : 0,
+           stats.evictions, stats.writebacks, stats.read_errors, stats.write_errors);
+}
@@ -0,0 +1,91 @@
+﻿#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "block.h"
+
+/**
+ * Sector buffer cache.
+ *
+ * Keeps recently used sectors in memory, found through a hash table on
+ * (disk, LBA) and recycled least recently used first. Partitions share
+ * the buffers of their disk, a sector is cached once whatever device it
+ * was read through.
+ *
+ * Buffers are handed out pinned (bread) and have to be given back (brelse),
+ * a pinned buffer is never evicted. Writes are write-back, bdirty marks a
+ * buffer and it only goes to the disk when it's evicted or on bcache_sync.
+ * Only bcache_sync flushes the disk's write cache, once for every buffer.
+ *
+ * Meant for metadata (FAT sectors, directories), file contents should go
+ * straight to the device so they don't push the metadata out.
+ */
+
+// Build with -DBCACHE_BUFFERS=<n> to change the default size
+#ifndef BCACHE_BUFFERS
+#define BCACHE_BUFFERS     128
+#endif
+
+#define BCACHE_HASH_SIZE   64  // Buckets, power of two
+
+typedef struct Buffer {
+    BlockDevice* disk;  // Always the whole disk
+    u32 lba;            // On "disk"
+    u8* data;           // BLOCK_SECTOR_SIZE bytes
+    
+    u8 valid;           // "data" holds the sector
+    u8 dirty;           // "data" is newer than the disk
+    u32 refs;           // Pinned while not 0
+    
+    BlockRequest request;   // Write back by bcache_sync
+    
+    struct Buffer* hash_next;
+    
+    // Most recently used at the head
+    struct Buffer* lru_prev;
+    struct Buffer* lru_next;
+} Buffer;
+
+typedef struct {
+    u32 buffers;
+    u32 hits;
+    u32 misses;
+    u32 evictions;
+    u32 writebacks;     // Dirty buffers written to the disk
+    u32 read_errors;
+    u32 write_errors;
+} BcacheStats;
+
+/**
+ * Allocates "buffers" sector buffers, has to run after kmem is up.
+ * Returns 0 if there wasn't memory for them.
+ */
+u8 bcache_init(u32 buffers);
+
+/**
+ * The buffer of "lba" on "dev", read from the disk on a miss.
+ * Returns nullptr if the read failed or every buffer is pinned.
+ */
+Buffer* bread(BlockDevice* dev, u32 lba);
+
+// Unpins a buffer from bread
+void brelse(Buffer* buffer);
+
+// The buffer's data was changed, it gets written back later
+void bdirty(Buffer* buffer);
+
+/**
+ * Writes every dirty buffer of "dev" (of every device for nullptr) back
+ * to the disk and flushes it, returns 0 if any write (or flush) failed.
+ */
+u8 bcache_sync(BlockDevice* dev);
+
+/**
+ * Copies "count" sectors through the cache into "buffer",
+ * returns 0 if any of them couldn't be read.
+ */
+u8 bcache_read(BlockDevice* dev, u32 lba, u32 count, void* buffer);
+
+const BcacheStats* bcache_stats(void);
+void bcache_dump(void);
+
+#endif // BCACHE_H
@@ -0,0 +1,770 @@
+﻿#include "block.h"
+
+#include "../cpu/cpu.h"
+#include "../memory/dma.h"
+#include "../memory/slab.h"
+#include "../serial/serial.h"
+
+// What the elevator hands to a driver, one or more merged requests
+typedef struct {
+    BlockDevice* disk;  // nullptr while unused
+    BlockRequest request;
+    
+    BlockRequest* members;  // In LBA order, linked through next
+    DmaBuffer bounce;       // Only if the members' buffers aren't back to back
+    
+    u32 lba;
+    u32 count;
+    u8 write;
+    u8 flags;
+} BlockCommand;
+
+static BlockDevice devices[BLOCK_MAX_DEVICES];
+static u32 device_count = 0;
+
+static BlockCommand commands[BLOCK_MAX_COMMANDS];
+static u32 next_command = 0;
+
+static void block_dispatch(BlockDevice* disk);
+
+static u32 block_name_copy(char* dest, const char* src, u32 at) {
+    for (; *src && at < BLOCK_NAME_LENGTH - 1; src++)
+        dest[at++] = *src;
+    
+    dest[at] = '\0';
+    
+    return at;
+}
+
+static u8 block_name_equal(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    
+    return *a == *b;
+}
+
+static BlockDevice* block_alloc(void) {
+    if (device_count >= BLOCK_MAX_DEVICES) {
+        printf("Block: too many devices\n");
+        return nullptr;
+    }
+    
+    BlockDevice* dev = &devices[device_count++];
+    memset(dev, 0, sizeof(BlockDevice));
+    
+    dev->sector_size = BLOCK_SECTOR_SIZE;
+    
+    return dev;
+}
+
+BlockDevice* block_register(const char* name, const BlockOps* ops, void* driver_data,
+                            u32 sectors, u32 queue_depth) {
+    BlockDevice* dev = block_alloc();
+    
+    if (!dev)
+        return nullptr;
+    
+    block_name_copy(dev->name, name, 0);
+    
+    dev->ops = ops;
+    dev->driver_data = driver_data;
+    dev->sectors = sectors;
+    dev->queue_depth = queue_depth ? queue_depth : 1;
+    dev->max_sectors = BLOCK_MAX_MERGE;
+    
+    return dev;
+}
+
+BlockDevice* block_add_partition(BlockDevice* disk, u32 number, u32 start, u32 sectors) {
+    if (start >= disk->sectors || sectors > disk->sectors - start) {
+        printf("Block: partition %d doesn't fit on %s\n", number, disk->name);
+        return nullptr;
+    }
+    
+    BlockDevice* dev = block_alloc();
+    
+    if (!dev)
+        return nullptr;
+    
+    u32 at = block_name_copy(dev->name, disk->name, 0);
+    
+    if (at < BLOCK_NAME_LENGTH - 3) {
+        dev->name[at++] = 'p';
+        
+        if (number >= 10)
+            dev->name[at++] = '0' + number / 10 % 10;
+        
+        dev->name[at++] = '0' + number % 10;
+        dev->name[at] = '\0';
+    }
+    
+    dev->ops = disk->ops;
+    dev->driver_data = disk->driver_data;
+    dev->sectors = sectors;
+    dev->queue_depth = disk->queue_depth;
+    dev->max_sectors = disk->max_sectors;
+    dev->read_only = disk->read_only;
+    dev->parent = disk;
+    dev->start = start;
+    
+    return dev;
+}
+
+// A jump, 512 byte sectors and the signature, what every FAT (or NTFS) volume starts with
+static u8 block_is_vbr(const u8* sector) {
+    return (sector[0] == 0xEB || sector[0] == 0xE9) &&
+           *(u16*)(sector + 11) == BLOCK_SECTOR_SIZE &&
+           *(u16*)(sector + 510) == MBR_SIGNATURE;
+}
+
+// Entries that can't be a partition of "disk", boot code where the table would be usually fails this
+static u8 block_mbr_entry_valid(BlockDevice* disk, MbrEntry* entry) {
+    if (entry->status != 0x00 && entry->status != 0x80)
+        return 0;
+    
+    if (entry->type == MBR_TYPE_EMPTY || entry->lba == 0 || entry->sectors == 0)
+        return 0;
+    
+    return entry->lba < disk->sectors && entry->sectors <= disk->sectors - entry->lba;
+}
+
+u32 block_scan_partitions(BlockDevice* disk) {
+    if (disk->parent)
+        return 0;
+    
+    u8* sector = (u8*)kmalloc(BLOCK_SECTOR_SIZE);
+    
+    if (!sector)
+        return 0;
+    
+    if (!block_read(disk, 0, 1, sector) || block_is_vbr(sector) ||
+        *(u16*)(sector + 510) != MBR_SIGNATURE) {
+        kfree(sector);
+        return 0;
+    }
+    
+    MbrEntry entries[MBR_ENTRIES];
+    memcpy(entries, sector + MBR_TABLE_OFFSET, sizeof(entries));
+    
+    // Our own boot disk (boot loader, kernel, then the volume at a fixed LBA) has code where
+    // the table would be, a real table would have an entry for the volume
+    u8 boot_layout = disk->sectors > BLOCK_BOOT_FS_LBA &&
+                     block_read(disk, BLOCK_BOOT_FS_LBA, 1, sector) && block_is_vbr(sector);
+    
+    for (u32 i = 0; i < MBR_ENTRIES && boot_layout; i++) {
+        if (block_mbr_entry_valid(disk, &entries[i]) && entries[i].lba == BLOCK_BOOT_FS_LBA)
+            boot_layout = 0;
+    }
+    
+    kfree(sector);
+    
+    if (boot_layout)
+        return block_add_partition(disk, 1, BLOCK_BOOT_FS_LBA, disk->sectors - BLOCK_BOOT_FS_LBA) != nullptr;
+    
+    u32 found = 0;
+    
+    for (u32 i = 0; i < MBR_ENTRIES; i++) {
+        MbrEntry* entry = &entries[i];
+        
+        if (!block_mbr_entry_valid(disk, entry))
+            continue;
+        
+        // TODO; Logical partitions inside of extended ones
+        if (entry->type == MBR_TYPE_EXTENDED || entry->type == MBR_TYPE_EXTENDED_LBA)
+            continue;
+        
+        if (block_add_partition(disk, i + 1, entry->lba, entry->sectors))
+            found++;
+    }
+    
+    return found;
+}
+
+u32 block_count(void) {
+    return device_count;
+}
+
+BlockDevice* block_get(u32 index) {
+    return index < device_count ? &devices[index] : nullptr;
+}
+
+BlockDevice* block_find(const char* name) {
+    for (u32 i = 0; i < device_count; i++) {
+        if (block_name_equal(devices[i].name, name))
+            return &devices[i];
+    }
+    
+    return nullptr;
+}
+
+BlockDevice* block_disk(BlockDevice* dev, u32* lba) {
+    while (dev->parent) {
+        *lba += dev->start;
+        dev = dev->parent;
+    }
+    
+    return dev;
+}
+
+void block_request_init(BlockRequest* request, u32 lba, u32 count, void* buffer, u8 write) {
+    memset(request, 0, sizeof(BlockRequest));
+    
+    request->lba = lba;
+    request->count = count;
+    request->buffer = buffer;
+    request->write = write;
+}
+
+static inline u8 block_overlap(u32 lba_a, u32 count_a, u32 lba_b, u32 count_b) {
+    return lba_a < lba_b + count_b && lba_b < lba_a + count_a;
+}
+
+/**
+ * "request" has to wait for an older request it overlaps if either of them writes.
+ * A flush waits for everything older, and everything younger waits for it.
+ */
+static u8 block_blocked(BlockDevice* disk, BlockRequest* request) {
+    u8 flush = request->flags & BLOCK_FLUSH;
+    
+    for (BlockRequest* other = disk->queue; other; other = other->next) {
+        if ((s32)(other->seq - request->seq) >= 0)
+            continue;
+        
+        if (flush || (other->flags & BLOCK_FLUSH))
+            return 1;
+        
+        if ((other->write || request->write) &&
+            block_overlap(other->lba, other->count, request->lba, request->count))
+            return 1;
+    }
+    
+    for (u32 i = 0; i < BLOCK_MAX_COMMANDS; i++) {
+        BlockCommand* command = &commands[i];
+        
+        if (command->disk != disk)
+            continue;
+        
+        if (flush || (command->flags & BLOCK_FLUSH))
+            return 1;
+        
+        if ((command->write || request->write) &&
+            block_overlap(command->lba, command->count, request->lba, request->count))
+            return 1;
+    }
+    
+    return 0;
+}
+
+static void block_enqueue(BlockDevice* disk, BlockRequest* request) {
+    BlockRequest** link = &disk->queue;
+    
+    while (*link && (*link)->lba <= request->lba)
+        link = &(*link)->next;
+    
+    request->next = *link;
+    *link = request;
+    
+    if (++disk->queued > disk->sched.max_queued)
+        disk->sched.max_queued = disk->queued;
+}
+
+static void block_dequeue(BlockDevice* disk, BlockRequest* request) {
+    BlockRequest** link = &disk->queue;
+    
+    while (*link != request)
+        link = &(*link)->next;
+    
+    *link = request->next;
+    request->next = nullptr;
+    
+    disk->queued--;
+}
+
+// C-LOOK, the first request at or after the head, or the lowest one once nothing is left above it
+static BlockRequest* block_pick(BlockDevice* disk) {
+    BlockRequest* wrapped = nullptr;
+    
+    for (BlockRequest* request = disk->queue; request; request = request->next) {
+        if (block_blocked(disk, request))
+            continue;
+        
+        if (request->lba >= disk->head_lba)
+            return request;
+        
+        if (!wrapped)
+            wrapped = request;
+    }
+    
+    return wrapped;
+}
+
+// A queued request that continues [lba, lba + count) the same way (direction, FUA) and fits in the command
+static BlockRequest* block_find_next(BlockDevice* disk, u32 lba, u32 count, u8 write, u8 flags) {
+    for (BlockRequest* request = disk->queue; request && request->lba <= lba + count; request = request->next) {
+        if (request->lba == lba + count && request->write == write && request->flags == flags &&
+            request->count <= disk->max_sectors - count && !block_blocked(disk, request))
+            return request;
+    }
+    
+    return nullptr;
+}
+
+static BlockCommand* block_command_alloc(void) {
+    for (u32 i = 0; i < BLOCK_MAX_COMMANDS; i++) {
+        BlockCommand* command = &commands[(next_command + i) % BLOCK_MAX_COMMANDS];
+        
+        if (!command->disk) {
+            next_command = (next_command + i + 1) % BLOCK_MAX_COMMANDS;
+            return command;
+        }
+    }
+    
+    return nullptr;
+}
+
+static void block_command_done(BlockRequest* request) {
+    BlockCommand* command = (BlockCommand*)request->ctx;
+    BlockDevice* disk = command->disk;
+    BlockRequest* member = command->members;
+    
+    if (command->bounce.virt) {
+        if (!command->write && request->status == BLOCK_DONE) {
+            u8* data = (u8*)command->bounce.virt;
+            
+            for (BlockRequest* at = member; at; at = at->next) {
+                memcpy(at->buffer, data, at->count * BLOCK_SECTOR_SIZE);
+                data += at->count * BLOCK_SECTOR_SIZE;
+            }
+        }
+        
+        dma_free(&command->bounce);
+    }
+    
+    if (request->status == BLOCK_FAILED) {
+        disk->stats.errors++;
+        
+        printf("Block: %s %s of %d sectors at %d failed, error %x\n", disk->name,
+               (command->flags & BLOCK_FLUSH) ? "flush" : command->write ? "write" : "read",
+               command->count, command->lba, request->error);
+    }
+    
+    command->disk = nullptr;
+    command->members = nullptr;
+    disk->in_flight--;
+    
+    // A callback may submit the request again, so next is read first
+    while (member) {
+        BlockRequest* next = member->next;
+        
+        member->next = nullptr;
+        member->error = request->error;
+        member->done = request->status == BLOCK_DONE ? member->count : 0;
+        member->status = request->status;
+        
+        if (member->callback)
+            member->callback(member);
+        
+        member = next;
+    }
+    
+    // The freed command may be what another disk was waiting for
+    block_dispatch(disk);
+    
+    for (u32 i = 0; i < device_count; i++) {
+        if (devices[i].queue && &devices[i] != disk)
+            block_dispatch(&devices[i]);
+    }
+}
+
+// Takes "first" and everything queued that continues it off the queue, into "command"
+static void block_build(BlockDevice* disk, BlockCommand* command, BlockRequest* first) {
+    block_dequeue(disk, first);
+    
+    BlockRequest* last = first;
+    BlockRequest* split = nullptr;  // First member that isn't back to back with the one before it
+    u32 count = first->count;
+    
+    // A flush has nothing to merge with
+    while (count < disk->max_sectors && !(first->flags & BLOCK_FLUSH)) {
+        BlockRequest* next = block_find_next(disk, first->lba, count, first->write, first->flags);
+        
+        if (!next)
+            break;
+        
+        if (!split && next->buffer != (u8*)last->buffer + last->count * BLOCK_SECTOR_SIZE)
+            split = next;
+        
+        block_dequeue(disk, next);
+        
+        last->next = next;
+        last = next;
+        count += next->count;
+        
+        disk->sched.merged++;
+    }
+    
+    void* buffer = first->buffer;
+    
+    if (split && !dma_alloc(&command->bounce, count * BLOCK_SECTOR_SIZE, 0)) {
+        // No bounce buffer, only the part that is back to back goes out
+        BlockRequest* request = first;
+        
+        while (request->next != split)
+            request = request->next;
+        
+        request->next = nullptr;
+        count = 0;
+        
+        for (request = first; request; request = request->next)
+            count += request->count;
+        
+        while (split) {
+            BlockRequest* next = split->next;
+            
+            block_enqueue(disk, split);
+            disk->sched.merged--;
+            
+            split = next;
+        }
+    } else if (split) {
+        buffer = command->bounce.virt;
+        disk->sched.bounced++;
+        
+        if (first->write) {
+            u8* data = (u8*)buffer;
+            
+            for (BlockRequest* request = first; request; request = request->next) {
+                memcpy(data, request->buffer, request->count * BLOCK_SECTOR_SIZE);
+                data += request->count * BLOCK_SECTOR_SIZE;
+            }
+        }
+    }
+    
+    for (BlockRequest* request = first; request; request = request->next)
+        request->status = BLOCK_ACTIVE;
+    
+    command->members = first;
+    command->lba = first->lba;
+    command->count = count;
+    command->write = first->write;
+    command->flags = first->flags;
+    command->disk = disk;
+    
+    block_request_init(&command->request, command->lba, count, buffer, command->write);
+    command->request.flags = command->flags;
+    command->request.callback = block_command_done;
+    command->request.ctx = command;
+}
+
+// Hands queued requests to the driver while it has room for them
+static void block_dispatch(BlockDevice* disk) {
+    // A synchronous driver completes commands (and their callbacks submit more) from inside submit
+    if (disk->dispatching || disk->plugged)
+        return;
+    
+    disk->dispatching = 1;
+    
+    while (disk->queue && disk->in_flight < disk->queue_depth) {
+        BlockRequest* first = block_pick(disk);
+        
+        if (!first)
+            break;
+        
+        BlockCommand* command = block_command_alloc();
+        
+        if (!command)
+            break;
+        
+        block_build(disk, command, first);
+        
+        disk->in_flight++;
+        
+        if (!(command->flags & BLOCK_FLUSH))
+            disk->head_lba = command->lba + command->count;
+        
+        disk->sched.commands++;
+        disk->sched.sectors += command->count;
+        
+        disk->ops->submit(disk, &command->request);
+    }
+    
+    disk->dispatching = 0;
+}
+
+void block_submit(BlockDevice* dev, BlockRequest* request) {
+    request->error = 0;
+    request->done = 0;
+    request->next = nullptr;
+    
+    if (request->lba >= dev->sectors || request->count > dev->sectors - request->lba ||
+        (request->write && dev->read_only)) {
+        dev->stats.rejected++;
+        
+        request->status = BLOCK_FAILED;
+        request->error = BLOCK_ERR_REJECTED;
+        
+        if (request->callback)
+            request->callback(request);
+        
+        return;
+    }
+    
+    if (request->flags & BLOCK_FLUSH) {
+        dev->stats.flushes++;
+    } else if (request->write) {
+        dev->stats.writes++;
+        dev->stats.write_sectors += request->count;
+        
+        if (request->flags & BLOCK_FUA)
+            dev->stats.fua_writes++;
+    } else {
+        dev->stats.reads++;
+        dev->stats.read_sectors += request->count;
+    }
+    
+    if (request->count == 0 && !(request->flags & BLOCK_FLUSH)) {
+        request->status = BLOCK_DONE;
+        
+        if (request->callback)
+            request->callback(request);
+        
+        return;
+    }
+    
+    // Partitions hand the request to their disk, shifted to its LBAs
+    BlockDevice* disk = block_disk(dev, &request->lba);
+    
+    request->status = BLOCK_PENDING;
+    request->seq = disk->next_seq++;
+    
+    block_enqueue(disk, request);
+    block_dispatch(disk);
+}
+
+// The command "request" went out in
+static BlockCommand* block_command_of(BlockRequest* request) {
+    for (u32 i = 0; i < BLOCK_MAX_COMMANDS; i++) {
+        if (!commands[i].disk)
+            continue;
+        
+        for (BlockRequest* member = commands[i].members; member; member = member->next) {
+            if (member == request)
+                return &commands[i];
+        }
+    }
+    
+    return nullptr;
+}
+
+static BlockCommand* block_command_any(BlockDevice* disk) {
+    BlockCommand* any = nullptr;
+    
+    for (u32 i = 0; i < BLOCK_MAX_COMMANDS; i++) {
+        if (commands[i].disk == disk)
+            return &commands[i];
+        
+        if (commands[i].disk && !any)
+            any = &commands[i];
+    }
+    
+    return any;
+}
+
+u8 block_wait(BlockDevice* dev, BlockRequest* request) {
+    u32 lba = 0;
+    BlockDevice* disk = block_disk(dev, &lba);
+    
+    // Nothing would ever take it off a plugged queue
+    if (disk->plugged) {
+        disk->plugged = 0;
+        block_dispatch(disk);
+    }
+    
+    while (request->status == BLOCK_PENDING || request->status == BLOCK_ACTIVE) {
+        BlockCommand* command = block_command_of(request);
+        
+        if (!command) {
+            // Still queued, a command may have freed up since it was submitted
+            block_dispatch(disk);
+            
+            if (request->status != BLOCK_PENDING || block_command_of(request))
+                continue;
+            
+            // Some command has to finish first (one of this disk's if it has any)
+            command = block_command_any(disk);
+        }
+        
+        if (!command) {
+            // Nothing is in flight anywhere and it still didn't go out, so it never will
+            // (waited on from a callback while its disk was dispatching)
+            printf("Block: %s request at %d can't be sent\n", disk->name, request->lba);
+            
+            block_dequeue(disk, request);
+            
+            request->status = BLOCK_FAILED;
+            request->error = BLOCK_ERR_REJECTED;
+            
+            if (request->callback)
+                request->callback(request);
+            
+            break;
+        }
+        
+        command->disk->ops->wait(command->disk, &command->request);
+    }
+    
+    return request->status == BLOCK_DONE;
+}
+
+void block_plug(BlockDevice* dev) {
+    u32 lba = 0;
+    block_disk(dev, &lba)->plugged = 1;
+}
+
+void block_unplug(BlockDevice* dev) {
+    u32 lba = 0;
+    BlockDevice* disk = block_disk(dev, &lba);
+    
+    disk->plugged = 0;
+    block_dispatch(disk);
+}
+
+u8 block_read(BlockDevice* dev, u32 lba, u32 count, void* buffer) {
+    BlockRequest request;
+    block_request_init(&request, lba, count, buffer, 0);
+    
+    block_submit(dev, &request);
+    
+    return block_wait(dev, &request);
+}
+
+u8 block_write(BlockDevice* dev, u32 lba, u32 count, const void* buffer) {
+    BlockRequest request;
+    block_request_init(&request, lba, count, (void*)buffer, 1);
+    
+    block_submit(dev, &request);
+    
+    return block_wait(dev, &request);
+}
+
+u8 block_write_fua(BlockDevice* dev, u32 lba, u32 count, const void* buffer) {
+    BlockRequest request;
+    block_request_init(&request, lba, count, (void*)buffer, 1);
+    request.flags = BLOCK_FUA;
+    
+    block_submit(dev, &request);
+    
+    return block_wait(dev, &request);
+}
+
+u8 block_flush(BlockDevice* dev) {
+    BlockRequest request;
+    block_request_init(&request, 0, 0, nullptr, 0);
+    request.flags = BLOCK_FLUSH;
+    
+    block_submit(dev, &request);
+    
+    return block_wait(dev, &request);
+}
+
+#define BLOCK_BENCHMARK_CHUNK 8 // Sectors per write, a page
+
+void block_write_benchmark(BlockDevice* dev, u32 lba, u32 sectors) {
+    DmaBuffer buffer;
+    
+    if (sectors > BLOCK_MAX_MERGE)
+        sectors = BLOCK_MAX_MERGE;
+    
+    if (dev->read_only || lba >= dev->sectors || sectors > dev->sectors - lba)
+        return;
+    
+    if (!dma_alloc(&buffer, sectors * BLOCK_SECTOR_SIZE, 0)) {
+        printf("Write benchmark: no buffer\n");
+        return;
+    }
+    
+    // Whatever is there gets written back as it is
+    if (!block_read(dev, lba, sectors, buffer.virt)) {
+        printf("Write benchmark: reading %s failed\n", dev->name);
+        dma_free(&buffer);
+        
+        return;
+    }
+    
+    static BlockRequest requests[BLOCK_MAX_MERGE / BLOCK_BENCHMARK_CHUNK];
+    static const char* modes[] = { "flush after every write", "FUA writes", "one flush at the end" };
+    
+    u32 count = (sectors + BLOCK_BENCHMARK_CHUNK - 1) / BLOCK_BENCHMARK_CHUNK;
+    
+    for (u32 mode = 0; mode < 3; mode++) {
+        u32 flushes = dev->stats.flushes;
+        u64 start = rdtsc();
+        u8 ok = 1;
+        
+        for (u32 i = 0; i < count; i++) {
+            u32 offset = i * BLOCK_BENCHMARK_CHUNK;
+            u32 n = sectors - offset < BLOCK_BENCHMARK_CHUNK ? sectors - offset : BLOCK_BENCHMARK_CHUNK;
+            
+            block_request_init(&requests[i], lba + offset, n, (u8*)buffer.virt + offset * BLOCK_SECTOR_SIZE, 1);
+            
+            if (mode == 1)
+                requests[i].flags = BLOCK_FUA;
+            
+            block_submit(dev, &requests[i]);
+            
+            // What every write used to cost, it waits for the write and then for the cache
+            if (mode == 0)
+                ok &= block_wait(dev, &requests[i]) && block_flush(dev);
+        }
+        
+        for (u32 i = 0; i < count; i++)
+            ok &= block_wait(dev, &requests[i]);
+        
+        if (mode == 2)
+            ok &= block_flush(dev);
+        
+        u32 us = cpu_tsc_us(rdtsc() - start);
+        u32 kb = sectors * BLOCK_SECTOR_SIZE / 1024;
+        u32 kb_per_s = us ? udiv64((u64)kb * 1000000, us) : 0;
+        
+        printf("Write benchmark %s, %s: %d KB in %d us, %d.%d MB/s, %d flushes%s\n", dev->name, modes[mode],
+               kb, us, kb_per_s / 1024, (kb_per_s % 1024) * 10 / 1024, dev->stats.flushes - flushes,
+               ok ? "" : " (failed)");
+    }
+    
+    dma_free(&buffer);
+}
+
+void block_dump(void) {
+    printf("Block devices:\n");
+    
+    for (u32 i = 0; i < device_count; i++) {
+        BlockDevice* dev = &devices[i];
+        BlockStats* s = &dev->stats;
+        
+        printf("  %s: %d MB, queue depth %d%s", dev->name, dev->sectors / (1024 * 1024 / dev->sector_size),
+               dev->queue_depth, dev->read_only ? ", read only" : "");
+        
+        if (dev->parent)
+            printf(", %s from sector %d", dev->parent->name, dev->start);
+        
+        printf("\n    reads=%d (%d sectors) writes=%d (%d sectors, %d FUA) flushes=%d rejected=%d errors=%d\n",
+               s->reads, s->read_sectors, s->writes, s->write_sectors, s->fua_writes, s->flushes,
+               s->rejected, s->errors);
+        
+        BlockSchedStats* q = &dev->sched;
+        
+        if (dev->parent || !q->commands)
+            continue;
+        
+        // Requests per command and sectors per command, in tenths
+        u32 ratio = (q->commands + q->merged) * 10 / q->commands;
+        u32 average = q->sectors * 10 / q->commands;
+        
+        printf("    commands=%d merged=%d bounced=%d max_queued=%d, %d.%d requests and %d.%d sectors per command\n",
+               q->commands, q->merged, q->bounced, q->max_queued,
+               ratio / 10, ratio % 10, average / 10, average % 10);
+    }
+}
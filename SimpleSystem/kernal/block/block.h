@@ -0,0 +1,243 @@
+﻿#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "../io.h"
+
+/**
+ * Block devices.
+ *
+ * Every disk driver registers its disks here with an ops table, everything
+ * above the drivers (the FAT code) only ever talks to a BlockDevice, so disks
+ * from different drivers can coexist and a faster backend can be swapped in
+ * without the filesystem knowing.
+ *
+ * Partitions are block devices too, they point at their disk and a start
+ * sector. Requests on them are bounds checked, shifted to the disk's LBAs
+ * and handed to the disk's ops.
+ *
+ * Requests are asynchronous, submit queues them and the driver completes
+ * them (status + callback) from its IRQ handler, wait services IRQs until
+ * one is done. block_read/block_write are the synchronous versions.
+ *
+ * Requests don't go to the driver as they are, every disk has an elevator
+ * queue sorted by LBA. While the driver is busy (queue_depth commands in
+ * flight) requests wait there, and when a slot frees up the next one in
+ * LBA order (C-LOOK, sweeping up and wrapping around) goes out together with
+ * every queued request that continues it, as one command of up to
+ * max_sectors. Requests whose buffers aren't back to back in memory go
+ * through a bounce buffer. A request never passes an older one it overlaps
+ * if either of them writes.
+ *
+ * Plugging a disk holds its queue back, so a batch of requests can be
+ * queued (and merged) before any of them goes out.
+ *
+ * A finished write may still be in the drive's write cache. A BLOCK_FLUSH
+ * request (no data) is a barrier, it goes out once everything submitted
+ * before it is done, nothing submitted after it passes it, and it's done
+ * once the cache is empty. A BLOCK_FUA write is only done once its own data
+ * is on the medium (native FUA where the drive has it, a flush after the
+ * write where it doesn't). Plain writes are neither, whoever needs them to
+ * stick flushes once at the end (i.e. bcache_sync) instead of every time.
+ */
+
+#define BLOCK_MAX_DEVICES  16
+#define BLOCK_NAME_LENGTH  16
+#define BLOCK_SECTOR_SIZE  512
+
+/**
+ * Build with -DBLOCK_BENCHMARK=1 to run the write benchmark at boot.
+ * It rewrites sectors of the boot disk, so it's off by default.
+ */
+#ifndef BLOCK_BENCHMARK
+#define BLOCK_BENCHMARK 0
+#endif
+
+// Between the kernel and BLOCK_BOOT_FS_LBA on the boot disk, what the benchmark writes (back)
+#define BLOCK_BENCHMARK_LBA 1024
+
+#define BLOCK_MAX_COMMANDS 64   // Merged commands in flight, every disk together
+#define BLOCK_MAX_MERGE    128  // Sectors, 64 KiB is the biggest bounce buffer the DMA pool has
+
+// Where make_image.py puts the FAT volume on the boot disk, the boot sector has no partition table
+#define BLOCK_BOOT_FS_LBA  2048
+
+// Request status
+#define BLOCK_PENDING      0
+#define BLOCK_ACTIVE       1
+#define BLOCK_DONE         2
+#define BLOCK_FAILED       3
+
+// Request flags
+#define BLOCK_FUA          0x01 // Writes, done once the data is on the medium
+#define BLOCK_FLUSH        0x02 // No data, empties the write cache, a barrier for the disk's queue
+
+// Errors the block layer (not the drive) gives requests
+#define BLOCK_ERR_REJECTED 0xFF // Never reached the disk
+#define BLOCK_ERR_TIMEOUT  0xFE // The drive never finished it
+
+// MBR partition table
+#define MBR_TABLE_OFFSET   0x1BE
+#define MBR_ENTRIES        4
+#define MBR_SIGNATURE      0xAA55
+#define MBR_TYPE_EMPTY     0x00
+#define MBR_TYPE_EXTENDED  0x05
+#define MBR_TYPE_EXTENDED_LBA 0x0F
+
+struct BlockRequest;
+
+// Called from the IRQ handler once the request is done (or failed)
+typedef void (*block_callback_t)(struct BlockRequest* request);
+
+typedef struct BlockRequest {
+    u32 lba;            // On a partition, submitting shifts it to the disk's LBA
+    u32 count;          // Sectors
+    void* buffer;
+    u8 write;
+    u8 flags;           // BLOCK_FUA, BLOCK_FLUSH
+    
+    volatile u8 status;
+    u8 error;           // Driver specific, or one of BLOCK_ERR_*
+    u32 done;           // Sectors transferred so far
+    
+    block_callback_t callback;
+    void* ctx;
+    
+    // Owned by whoever has the request (the elevator queue, a merged command, the driver)
+    struct BlockRequest* next;
+    u32 seq;            // Submission order on the disk
+} BlockRequest;
+
+typedef struct {
+    u8 status;          // 0x80 = bootable
+    u8 chs_first[3];
+    u8 type;
+    u8 chs_last[3];
+    u32 lba;
+    u32 sectors;
+} __attribute__((packed)) MbrEntry;
+
+struct BlockDevice;
+
+typedef struct {
+    /**
+     * Queues "request", the driver owns it (and its buffer) until
+     * its status is BLOCK_DONE or BLOCK_FAILED.
+     */
+    void (*submit)(struct BlockDevice* dev, BlockRequest* request);
+    
+    // Services IRQs until "request" is done, returns 0 if it failed
+    u8 (*wait)(struct BlockDevice* dev, BlockRequest* request);
+} BlockOps;
+
+typedef struct {
+    u32 reads;
+    u32 writes;
+    u32 read_sectors;
+    u32 write_sectors;
+    u32 rejected;       // Out of range, or a write to a read only device
+    u32 errors;         // Failed on the disk
+    u32 flushes;
+    u32 fua_writes;
+} BlockStats;
+
+typedef struct {
+    u32 commands;       // Sent to the driver
+    u32 sectors;        // In those commands
+    u32 merged;         // Requests that went out as part of another one's command
+    u32 bounced;        // Commands that needed a bounce buffer
+    u32 max_queued;
+} BlockSchedStats;
+
+typedef struct BlockDevice {
+    char name[BLOCK_NAME_LENGTH];
+    
+    u32 sector_size;
+    u32 sectors;        // Capacity
+    u32 queue_depth;    // Requests the driver can have in flight at once
+    u8 read_only;
+    
+    const BlockOps* ops;
+    void* driver_data;
+    
+    // Partitions only, nullptr for whole disks
+    struct BlockDevice* parent;
+    u32 start;          // First sector on the parent
+    
+    // Elevator, whole disks only
+    BlockRequest* queue;    // Sorted by LBA, then by seq
+    u32 queued;
+    u32 in_flight;      // Commands the driver has
+    u32 head_lba;       // Where the last command ended
+    u32 next_seq;
+    u32 max_sectors;    // Biggest command merging builds
+    u8 plugged;
+    u8 dispatching;
+    
+    BlockStats stats;
+    BlockSchedStats sched;
+} BlockDevice;
+
+/**
+ * Adds a whole disk (of BLOCK_SECTOR_SIZE sectors),
+ * returns nullptr if the table is full.
+ */
+BlockDevice* block_register(const char* name, const BlockOps* ops, void* driver_data,
+                            u32 sectors, u32 queue_depth);
+
+/**
+ * Adds "sectors" starting at "start" of "disk" as its own device,
+ * named after the disk with "p<number>" appended.
+ */
+BlockDevice* block_add_partition(BlockDevice* disk, u32 number, u32 start, u32 sectors);
+
+/**
+ * Registers the partitions of "disk", returns how many were found.
+ *
+ * Nothing is added if LBA 0 is a volume boot record (a bare filesystem
+ * image). The boot disk has no partition table, when there's a volume at
+ * BLOCK_BOOT_FS_LBA that no MBR entry points to it becomes partition 1.
+ */
+u32 block_scan_partitions(BlockDevice* disk);
+
+u32 block_count(void);
+BlockDevice* block_get(u32 index);
+BlockDevice* block_find(const char* name);
+
+// The whole disk under "dev" (itself for a disk), "lba" is shifted to the disk's LBAs
+BlockDevice* block_disk(BlockDevice* dev, u32* lba);
+
+void block_request_init(BlockRequest* request, u32 lba, u32 count, void* buffer, u8 write);
+
+void block_submit(BlockDevice* dev, BlockRequest* request);
+
+// Services IRQs until "request" is done, unplugs its disk first. Returns 0 if it failed
+u8 block_wait(BlockDevice* dev, BlockRequest* request);
+
+/**
+ * Holds back (plug) and releases (unplug) the queue of the disk under "dev",
+ * requests submitted in between go out merged once it's unplugged.
+ */
+void block_plug(BlockDevice* dev);
+void block_unplug(BlockDevice* dev);
+
+// Synchronous helpers, submit + wait
+u8 block_read(BlockDevice* dev, u32 lba, u32 count, void* buffer);
+u8 block_write(BlockDevice* dev, u32 lba, u32 count, const void* buffer);
+
+// Like block_write, but only returns once the data is on the medium
+u8 block_write_fua(BlockDevice* dev, u32 lba, u32 count, const void* buffer);
+
+// Empties the write cache of the disk under "dev", once every write submitted before is done
+u8 block_flush(BlockDevice* dev);
+
+/**
+ * Writes "sectors" (up to BLOCK_MAX_MERGE) at "lba" in 4 KiB requests with a
+ * flush after each one, as FUA writes, and with one flush at the end, and
+ * prints the throughput of each. What's there is read first and written
+ * back unchanged.
+ */
+void block_write_benchmark(BlockDevice* dev, u32 lba, u32 sectors);
+
+void block_dump(void);
+
+#endif // BLOCK_H
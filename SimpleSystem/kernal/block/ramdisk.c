@@ -0,0 +1,61 @@
+﻿#include "ramdisk.h"
+
+#include "../memory/lazy.h"
+#include "../memory/slab.h"
+#include "../serial/serial.h"
+
+static void ramdisk_submit(BlockDevice* dev, BlockRequest* request) {
+    Ramdisk* disk = (Ramdisk*)dev->driver_data;
+    
+    u8* data = disk->data + request->lba * BLOCK_SECTOR_SIZE;
+    u32 bytes = request->count * BLOCK_SECTOR_SIZE;
+    
+    if (request->write)
+        memcpy(data, request->buffer, bytes);
+    else
+        memcpy(request->buffer, data, bytes);
+    
+    request->error = 0;
+    request->done = request->count;
+    request->status = BLOCK_DONE;
+    
+    if (request->callback)
+        request->callback(request);
+}
+
+static u8 ramdisk_wait(BlockDevice* dev, BlockRequest* request) {
+    (void)dev;
+    return request->status == BLOCK_DONE;
+}
+
+static const BlockOps ramdisk_ops = {
+    .submit = ramdisk_submit,
+    .wait = ramdisk_wait,
+};
+
+BlockDevice* ramdisk_create(const char* name, u32 sectors) {
+    Ramdisk* disk = (Ramdisk*)kzalloc(sizeof(Ramdisk));
+    
+    if (!disk)
+        return nullptr;
+    
+    disk->sectors = sectors;
+    disk->data = (u8*)lazy_alloc(pager_kernel(), sectors * BLOCK_SECTOR_SIZE, PAGE_PRESENT | PAGE_WRITE,
+                                 nullptr, nullptr);
+    
+    if (!disk->data) {
+        printf("Ramdisk %s: no room for %d sectors\n", name, sectors);
+        
+        kfree(disk);
+        return nullptr;
+    }
+    
+    BlockDevice* dev = block_register(name, &ramdisk_ops, disk, sectors, 1);
+    
+    if (!dev) {
+        lazy_free(pager_kernel(), disk->data);
+        kfree(disk);
+    }
+    
+    return dev;
+}
@@ -0,0 +1,30 @@
+﻿#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include "block.h"
+
+/**
+ * A block device in memory.
+ *
+ * The sectors live in a lazy region, so only the pages that get written
+ * (or read) take frames. Requests complete right away inside of submit,
+ * which makes it the baseline to compare the disk drivers against.
+ */
+
+// Build with -DRAMDISK_SECTORS=<n> to register a ram0 of that many sectors at boot
+#ifndef RAMDISK_SECTORS
+#define RAMDISK_SECTORS 0
+#endif
+
+typedef struct {
+    u8* data;
+    u32 sectors;
+} Ramdisk;
+
+/**
+ * Registers a new zero filled ramdisk of "sectors" sectors,
+ * returns nullptr if there's no room for it.
+ */
+BlockDevice* ramdisk_create(const char* name, u32 sectors);
+
+#endif // RAMDISK_H
@@ -0,0 +1,155 @@
+﻿#include "cpu.h"
+
+#include "../serial/serial.h"
+
+static CpuInfo info;
+static u8 detected = 0;
+
+// Read by isr_stubs.asm
+u8 cpu_fxsave = 0;
+
+static void cpu_detect(void) {
+    u32 eax, ebx, ecx, edx;
+    
+    memset(&info, 0, sizeof(info));
+    
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    info.max_leaf = eax;
+    
+    // Vendor string is EBX, EDX, ECX
+    *(u32*)&info.vendor[0] = ebx;
+    *(u32*)&info.vendor[4] = edx;
+    *(u32*)&info.vendor[8] = ecx;
+    info.vendor[12] = '\0';
+    
+    if (info.max_leaf >= 1) {
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        
+        info.edx = edx;
+        info.ecx = ecx;
+        
+        info.stepping = eax & 0xF;
+        info.model = (eax >> 4) & 0xF;
+        info.family = (eax >> 8) & 0xF;
+        
+        if (info.family == 0xF)
+            info.family += (eax >> 20) & 0xFF;
+        
+        if (info.family == 0x6 || info.family >= 0xF)
+            info.model |= ((eax >> 16) & 0xF) << 4;
+        
+        if (edx & CPUID_EDX_CLFLUSH)
+            info.cache_line = ((ebx >> 8) & 0xFF) * 8;
+    }
+    
+    if (info.max_leaf >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        info.ebx7 = ebx;
+    }
+    
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    info.max_ext_leaf = eax;
+    
+    // Both Intel and AMD report the L2 size here
+    if (info.max_ext_leaf >= 0x80000006) {
+        cpuid(0x80000006, &eax, &ebx, &ecx, &edx);
+        info.l2_kb = ecx >> 16;
+    }
+    
+    detected = 1;
+}
+
+static void cpu_enable_sse(void) {
+    if (!cpu_has_edx(CPUID_EDX_FPU | CPUID_EDX_FXSR | CPUID_EDX_SSE)) {
+        printf("SSE isn't supported\n");
+        return;
+    }
+    
+    u32 cr0, cr4;
+    
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" :: "r"(cr0));
+    
+    asm volatile("fninit");
+    
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    asm volatile("mov %0, %%cr4" :: "r"(cr4));
+    
+    info.sse_enabled = 1;
+    cpu_fxsave = 1;
+}
+
+/**
+ * Counts TSC ticks over a PIT_CALIBRATE_MS one shot of PIT channel 2,
+ * polled through port B since there's no timer IRQ.
+ */
+static void cpu_calibrate_tsc(void) {
+    if (!cpu_has_edx(CPUID_EDX_TSC))
+        return;
+    
+    u32 count = PIT_FREQUENCY * PIT_CALIBRATE_MS / 1000;
+    
+    // Gate off and the speaker disconnected
+    u8 port_b = inb(PIT_PORT_B) & ~0x03;
+    outb(PIT_PORT_B, port_b);
+    
+    // Channel 2, lobyte/hibyte, mode 0 (output goes high at terminal count)
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CH2_DATA, count & 0xFF);
+    outb(PIT_CH2_DATA, count >> 8);
+    
+    outb(PIT_PORT_B, port_b | 0x01);
+    u64 start = rdtsc();
+    
+    for (u32 i = 0; i < TIMEOUT * 100 && !(inb(PIT_PORT_B) & 0x20); i++);
+    
+    u64 ticks = rdtsc() - start;
+    outb(PIT_PORT_B, port_b);
+    
+    info.tsc_khz = udiv64(ticks, PIT_CALIBRATE_MS);
+}
+
+u32 cpu_tsc_us(u64 ticks) {
+    if (!info.tsc_khz)
+        return 0;
+    
+    return udiv64(ticks * 1000, info.tsc_khz);
+}
+
+void cpu_init(void) {
+    cpu_detect();
+    cpu_enable_sse();
+    cpu_calibrate_tsc();
+    
+    cpu_dump();
+}
+
+const CpuInfo* cpu_info(void) {
+    if (!detected)
+        cpu_detect();
+    
+    return &info;
+}
+
+void cpu_dump(void) {
+    printf("CPU: %s family %x model %x stepping %d\n",
+           info.vendor, info.family, info.model, info.stepping);
+    
+    printf("  %s%s%s%s%s%s%s%s%s%s\n",
+           (info.edx & CPUID_EDX_PSE)  ? "pse "  : "",
+           (info.edx & CPUID_EDX_PGE)  ? "pge "  : "",
+           (info.edx & CPUID_EDX_PAT)  ? "pat "  : "",
+           (info.edx & CPUID_EDX_TSC)  ? "tsc "  : "",
+           (info.edx & CPUID_EDX_SSE)  ? "sse "  : "",
+           (info.edx & CPUID_EDX_SSE2) ? "sse2 " : "",
+           (info.ecx & CPUID_ECX_SSE3) ? "sse3 " : "",
+           (info.ecx & CPUID_ECX_SSE41) ? "sse4.1 " : "",
+           (info.ecx & CPUID_ECX_AVX)  ? "avx "  : "",
+           (info.ebx7 & CPUID_7_EBX_ERMS) ? "erms" : "");
+    
+    printf("  cache line %d bytes, L2 %d KB, SSE %s, TSC %d MHz\n",
+           info.cache_line, info.l2_kb, info.sse_enabled ? "enabled" : "off", info.tsc_khz / 1000);
+}
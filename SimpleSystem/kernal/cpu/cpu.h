@@ -0,0 +1,95 @@
+﻿#ifndef CPU_H
+#define CPU_H
+
+#include "../io.h"
+
+/**
+ * CPUID feature detection.
+ *
+ * Everything is read once by cpu_init, which also turns on the FPU
+ * and SSE so the memory functions (memory/mem.h) can use them.
+ */
+
+// CPUID.1:EDX
+#define CPUID_EDX_FPU      (1 << 0)
+#define CPUID_EDX_PSE      (1 << 3)
+#define CPUID_EDX_TSC      (1 << 4)
+#define CPUID_EDX_MSR      (1 << 5)
+#define CPUID_EDX_MTRR     (1 << 12)
+#define CPUID_EDX_PGE      (1 << 13)
+#define CPUID_EDX_PAT      (1 << 16)
+#define CPUID_EDX_CLFLUSH  (1 << 19)
+#define CPUID_EDX_FXSR     (1 << 24)
+#define CPUID_EDX_SSE      (1 << 25)
+#define CPUID_EDX_SSE2     (1 << 26)
+
+// CPUID.1:ECX
+#define CPUID_ECX_SSE3     (1 << 0)
+#define CPUID_ECX_SSSE3    (1 << 9)
+#define CPUID_ECX_SSE41    (1 << 19)
+#define CPUID_ECX_SSE42    (1 << 20)
+#define CPUID_ECX_AVX      (1 << 28)
+
+// CPUID.7.0:EBX
+#define CPUID_7_EBX_ERMS   (1 << 9) // Fast rep movsb/stosb
+
+// PIT channel 2, gated through the keyboard controller's port B
+#define PIT_FREQUENCY      1193182
+#define PIT_CH2_DATA       0x42
+#define PIT_COMMAND        0x43
+#define PIT_PORT_B         0x61
+#define PIT_CALIBRATE_MS   10
+
+// Control register bits
+#define CR0_MP             (1 << 1)
+#define CR0_EM             (1 << 2)
+#define CR0_NE             (1 << 5)
+#define CR4_OSFXSR         (1 << 9)
+#define CR4_OSXMMEXCPT     (1 << 10)
+
+typedef struct {
+    char vendor[13];
+    u32 max_leaf;
+    u32 max_ext_leaf;
+    
+    u32 family;
+    u32 model;
+    u32 stepping;
+    
+    u32 edx;       // CPUID.1:EDX
+    u32 ecx;       // CPUID.1:ECX
+    u32 ebx7;      // CPUID.7.0:EBX
+    
+    u32 cache_line; // clflush line size in bytes
+    u32 l2_kb;      // L2 size, 0 if the CPU doesn't say
+    
+    u32 tsc_khz;    // TSC ticks per millisecond, 0 without a TSC
+    
+    u8 sse_enabled;
+} CpuInfo;
+
+#define cpu_has_edx(bits) ((cpu_info()->edx & (bits)) == (bits))
+#define cpu_has_ecx(bits) ((cpu_info()->ecx & (bits)) == (bits))
+
+/**
+ * Reads the CPUID leaves and enables x87 + SSE
+ * (CR0.EM off, CR0.MP/NE and CR4.OSFXSR/OSXMMEXCPT on).
+ *
+ * Exceptions save the FPU/SSE state around their handler (isr_stubs.asm).
+ * NOTE; Nothing else does yet, that's fine while there's only one thread
+ * and interrupts are polled, not once that changes.
+ */
+void cpu_init(void);
+
+// Set once SSE is on, exceptions FXSAVE/FXRSTOR from then on
+extern u8 cpu_fxsave;
+
+// Detects on the first call if cpu_init hasn't run yet
+const CpuInfo* cpu_info(void);
+
+// TSC ticks to microseconds, 0 if the TSC wasn't calibrated
+u32 cpu_tsc_us(u64 ticks);
+
+void cpu_dump(void);
+
+#endif // CPU_H
@@ -14,6 +14,8 @@ typedef unsigned long      u32;
 typedef signed   long      s32;
 typedef          long      i32;
 
+typedef unsigned long long u64;
+
 #ifdef _WIN64
     typedef unsigned __int64 size_t;
     typedef __int64          ptrdiff_t;
@@ -59,6 +61,10 @@ static inline void outb(unsigned short port, u8 val) {
     __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
+static inline void outw(unsigned short port, u16 val) {
+    __asm__ volatile ("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
 static inline void outl(unsigned short port, u32 val) {
     __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
 }
@@ -79,6 +85,22 @@ static inline u8 inb(unsigned short port) {
     return ret;
 }
 
+static inline u16 inw(unsigned short port) {
+    u16 ret;
+    
+    __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    
+    return ret;
+}
+
+static inline u32 inl(unsigned short port) {
+    u32 ret;
+    
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    
+    return ret;
+}
+
 static inline void insw(u16 port, void* addr, u32 count) {
     asm volatile (
         "rep insw"
@@ -92,132 +114,53 @@ static inline void io_wait(void) {
     outb(0x80, 0);
 }
 
-// TODO; Move these to a memory file?
-
-#include "serial/serial.h"
-#include <stdbool.h>
-
-static inline bool lba_read(u32 lba, u32 count, void* buffer) {
-    if (count <= 255) {
-        outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-        outb(0x1F2, count & 0xFF);
-        outb(0x1F3, lba & 0xFF);
-        outb(0x1F4, (lba >> 8) & 0xFF);
-        outb(0x1F5, (lba >> 16) & 0xFF);
-        outb(0x1F7, 0x20);  // READ SECTORS
-        
-        for (u32 i = 0; i < count; i++) {
-            u32 wait_count = 0;
-            u8 status;
-            
-            while (1) {
-                status = inb(0x1F7);
-                
-                // Handle errors first
-                if (status & 0x01) {
-                    u8 error = inb(0x1F1);
-                    
-                    printf("ATA error: %x\n", error);
-                    
-                    return false;
-                }
-                
-                // Check ready state
-                if (!(status & 0x80) && (status & 0x08)) {
-                    break; // Ready for transfer
-                }
-                
-                if (++wait_count > 1000000) {
-                    printf("Timeout: status=%x\n", status);
-                    
-                    return false;
-                }
-                
-                asm volatile ("pause");
-            }
-            
-            insw(0x1F0, buffer, 256);
-            buffer = (void*)((u32)buffer + 512);
-        }
-        
-        return true;
-    }
+static inline void cpuid(u32 leaf, u32* eax, u32* ebx, u32* ecx, u32* edx) {
+    asm volatile ("cpuid"
+                  : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                  : "a"(leaf), "c"(0));
+}
+
+static inline u64 rdtsc(void) {
+    u32 lo, hi;
     
-    // Large read handling
-    while (count > 0) {
-        u8 sectors = (count > 255) ? 255 : count;
-        
-        if (!lba_read(lba, sectors, buffer)) {
-            return false;
-        }
-        
-        lba += sectors;
-        count -= sectors;
-        buffer = (void*)((u32)buffer + sectors * 512);
-    }
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
     
-    return true;
+    return ((u64)hi << 32) | lo;
 }
 
-// TODO; Update this too
-static inline void lba_write(u32 lba, u32 count, const void* buffer) {
-    while (count > 0) {
-        u8 sectors_to_write = (count > 255) ? 255 : count & 0xFF;
-        
-        outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-        outb(0x1F2, sectors_to_write);               // Write up to 255 sectors
-        outb(0x1F3, lba & 0xFF);
-        outb(0x1F4, (lba >> 8) & 0xFF);
-        outb(0x1F5, (lba >> 16) & 0xFF);
-        outb(0x1F7, 0x30);                          // WRITE SECTOR(S)
-        
-        for (int i = 0; i < sectors_to_write; i++) {
-            while (!(inb(0x1F7) & 0x08));           // Wait for DRQ
-            outsw(0x1F0, buffer, 256);        // Write 512 bytes (256 words)
-            buffer += 512;
-            lba++;
-            count--;
-        }
-        
-        // Flush the cache
-        outb(0x1F7, 0xE7);                          // CACHE FLUSH
-        while (inb(0x1F7) & 0x80);                  // Wait until not busy
-    }
+/**
+ * 64 by 32 bit division with a single divl, there's no libgcc to do it.
+ * Saturates if the quotient doesn't fit in 32 bits.
+ */
+static inline u32 udiv64(u64 n, u32 d) {
+    u32 hi = n >> 32;
+    u32 q, r;
+    
+    if (hi >= d)
+        return 0xFFFFFFFF;
+    
+    asm ("divl %4" : "=a"(q), "=d"(r) : "a"((u32)n), "d"(hi), "rm"(d));
+    
+    return q;
 }
 
-static void* memset(void* ptr, int value, size_t num) {
-    u8* p = (u8*)ptr;
-    while(num--) *p++ = (u8)value;
-    return ptr;
+static inline void rdmsr(u32 msr, u32* lo, u32* hi) {
+    asm volatile ("rdmsr" : "=a"(*lo), "=d"(*hi) : "c"(msr));
 }
 
+static inline void wrmsr(u32 msr, u32 lo, u32 hi) {
+    asm volatile ("wrmsr" : : "a"(lo), "d"(hi), "c"(msr) : "memory");
+}
+
+// memory/mem.c
+void* memset(void* ptr, int value, size_t num);
+void* memcpy(void* dest, const void* src, size_t num);
+void* memmove(void* dest, const void* src, size_t num);
+
+// Assumed amount of RAM if the boot loader couldn't get an E820 memory map
 #define MAX_MEM_SIZE (64 * 1024 * 1024)
 
+// Start of the memory handed to the frame allocator (memory/frame.h)
 #define MEM_BUFFER_BASE 0x300000
-static u8* mem_buffer = (u8*)MEM_BUFFER_BASE;
-static size_t mem_offset = 0;
-
-static void* memalign(size_t alignment, size_t size) {
-    size_t addr = (size_t)(mem_buffer + mem_offset);
-    size_t aligned_addr = (addr + alignment - 1) & ~(alignment - 1);
-    size_t offset_diff = aligned_addr - addr;
-    
-    if (mem_offset + offset_diff + size > MAX_MEM_SIZE) {
-        printf("Out of memory! Needed %d more bytes\n",
-               (mem_offset + offset_diff + size) - MAX_MEM_SIZE);
-        return NULL;
-    }
-    
-    mem_offset += offset_diff;
-    void* ptr = (void*)(mem_buffer + mem_offset);
-    mem_offset += size;
-    
-    //printf("Allocated %d bytes at %x (total used: %d/%d MB)\n", 
-    //   size, ptr, 
-    //   mem_offset/(1024*1024), 
-    //   MAX_MEM_SIZE/(1024*1024));
-    
-    return ptr;
-}
 
 #endif
\ No newline at end of file
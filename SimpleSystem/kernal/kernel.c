@@ -1,12 +1,29 @@
+#include "ahci/ahci.h"
+#include "ata/ata.h"
+#include "block/bcache.h"
+#include "block/block.h"
+#include "block/ramdisk.h"
 #include "idt/idt.h"
 #include "keyboard/keyboard.h"
 #include "mouse/mouse.h"
+#include "pci/pci.h"
 #include "serial/serial.h"
+#include "virtio/virtio_blk.h"
 #include "pic/pic.h"
 #include "decoding/pictures/bmp.h"
 #include "memory/filesystem/filesystem.h"
 
+#include "cpu/cpu.h"
+
+#include "memory/dma.h"
+#include "memory/e820.h"
+#include "memory/frame.h"
+#include "memory/lazy.h"
+#include "memory/mem.h"
+#include "memory/slab.h"
+#include "memory/trace.h"
 #include "memory/paging.h"
+#include "memory/pat.h"
 
 // Explicit declaration before use
 void kernel_main(void) __attribute__((section(".text.main")));
@@ -14,9 +31,38 @@ void _start(void) __attribute__((section(".text.start")));
 
 // TODO; Video memory starts at 0xB8000
 
+// linker.ld
+extern u8 __bss_start[];
+extern u8 __bss_end[];
+
+// Kernel pager, every other address space shares its mappings
 Pager* pager;
 
 void setup_paging(void) {
+    // RAM above LAZY_BASE would collide with the lazy regions, it's just not used for now
+    u32 mem_end = 0;
+    
+    if (e820_init()) {
+        e820_dump();
+        mem_end = e820_usable_end(LAZY_BASE);
+    }
+    
+    if (mem_end == 0) {
+        printf("No usable E820 memory map, assuming %d MB\n", MAX_MEM_SIZE / (1024 * 1024));
+        
+        mem_end = MAX_MEM_SIZE;
+        
+        frame_init(mem_end);
+        frame_add_region(0, mem_end);
+    } else {
+        // Usable regions from MEM_BUFFER_BASE up are given to the frame allocator
+        frame_init(mem_end);
+        e820_add_frames(mem_end);
+    }
+    
+    // Everything allocated from here on is profiled (memory/trace.h)
+    trace_init();
+    
     pager = pager_create();
     
     if (!pager) {
@@ -27,12 +73,15 @@ void setup_paging(void) {
         return;
     }
     
-    // 64MB (0x00000000 - 0x04000000)
-    pager_identity_map(pager, 0, 64 * 1024 * 1024, PAGE_PRESENT | PAGE_WRITE);
+    // All of RAM, rounded up so the whole thing is mapped with large pages
+    pager_identity_map(pager, 0, (mem_end + LARGE_PAGE_SIZE - 1) & ~LARGE_PAGE_MASK, PAGE_PRESENT | PAGE_WRITE);
     
     /*pager_identity_map(pager, 0x04000000, 0x2000000,  // 32MB
                       PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL);*/
     
+    // Has to happen before any PAGE_WC mapping is used
+    pat_init();
+    
     // Enable paging
     pager_enable(pager);
 }
@@ -40,10 +89,17 @@ void setup_paging(void) {
 // Kernel entry point
 __attribute__((section(".text.start")))
 void _start(void) {
+    // The boot loader loads whatever comes after kernel.bin on the disk there
+    memset(__bss_start, 0, __bss_end - __bss_start);
+    
     u32 stack_ptr;
     asm volatile("mov %%esp, %0" : "=r"(stack_ptr));
     printf("Initial ESP: %x\n", stack_ptr);
     
+    // Before anything big gets copied or cleared
+    cpu_init();
+    mem_init();
+    
     isr_install();
     
     // Remap PIC IRQs: master to 0x20, slave to 0x28
@@ -55,9 +111,59 @@ void _start(void) {
     irq_install_handler(2, handleIrq);
     irq_install_handler(12, mouse_irq);
     
+    // Before any driver, they look their controllers up in the device table
+    pci_init();
+    pci_dump();
+    
+    // Disk requests complete through IRQ 14 (or the controller's native IRQ)
+    ata_init();
+    
     // Enable paging
     setup_paging();
     
+    // Contiguous buffers for devices, taken early while memory isn't fragmented
+    dma_init();
+    
+    // Need the DMA pool and paging, every disk they find becomes a block device
+    ahci_init();
+    virtio_blk_init();
+
+#if RAMDISK_SECTORS
+    // Requests complete inside of submit, something to compare the disks against
+    ramdisk_create("ram0", RAMDISK_SECTORS);
+#endif
+    
+    // Partitions are block devices of their own, they go after every disk
+    u32 disks = block_count();
+    
+    for (u32 i = 0; i < disks; i++)
+        block_scan_partitions(block_get(i));
+    
+    block_dump();
+    
+    // Sectors the filesystem keeps going back to (FAT, directories)
+    bcache_init(BCACHE_BUFFERS);
+
+#if ATA_BENCHMARK
+    // 1 MiB from the start of the disk, through PIO, READ MULTIPLE and DMA
+    ata_benchmark(0, 2048);
+    
+    if (ahci_disk_count())
+        ahci_benchmark(ahci_disk(0), 0, 2048);
+#endif
+
+#if BLOCK_BENCHMARK
+    // On the disk the volume is on (boot layout), between the kernel and the volume
+    for (u32 i = 0; i < block_count(); i++) {
+        BlockDevice* dev = block_get(i);
+        
+        if (dev->parent && dev->start == BLOCK_BOOT_FS_LBA) {
+            block_write_benchmark(dev->parent, BLOCK_BENCHMARK_LBA, BLOCK_MAX_MERGE);
+            break;
+        }
+    }
+#endif
+    
     kernel_main();
     
     // Infinite loop to prevent exit
@@ -100,6 +206,15 @@ void print_stack_trace(uintptr_t ebp) {
 }
 
 void isr_handler_c(registers_t* regs) {
+    // Not present faults inside of a lazy region just need a frame
+    if (regs->int_no == 14) {
+        u32 fault_addr;
+        asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
+        
+        if (lazy_handle_fault(pager_active(), fault_addr, regs->err_code))
+            return;
+    }
+    
     const char* exception_messages[] = {
         "Division By Zero", "Debug", "Non Maskable Interrupt", "Breakpoint",
         "Into Detected Overflow", "Out of Bounds", "Invalid Opcode", "No Coprocessor",
@@ -246,7 +361,23 @@ void kernel_main(void) {
     u32* vesa_info = (u32*)0x7E00;
     printf("Framebuffer at %x\n", vesa_info[6]);
     
-    pager_map_range(pager, fb_addr, fb_addr, fb_size, PAGE_PRESENT | PAGE_WRITE);
+    // The LFB sits in a 4 MiB aligned BAR that's bigger than the mode (16 MiB on QEMU's VGA),
+    // so rounding up lets it be mapped with 4 MiB pages instead of ~1000 PTEs
+    u32 fb_map_size = fb_size;
+    u32 fb_rounded = (fb_size + LARGE_PAGE_MASK) & ~LARGE_PAGE_MASK;
+    PciBar* fb_bar = pci_find_bar(fb_addr);
+    
+    if (fb_bar)
+        printf("Framebuffer BAR: %x size %x\n", fb_bar->base, fb_bar->size);
+    
+    // Without the BAR to check against, assume it's big enough
+    if (!(fb_addr & LARGE_PAGE_MASK) &&
+        (!fb_bar || fb_bar->base + fb_bar->size - fb_addr >= fb_rounded))
+        fb_map_size = fb_rounded;
+    
+    // Writes to the framebuffer are never read back, WC lets them be batched into bursts
+    cache_set_wc(fb_addr, fb_map_size);
+    pager_map_range(pager, fb_addr, fb_addr, fb_map_size, PAGE_PRESENT | PAGE_WRITE | PAGE_WC);
     
     init_graphics(fb_width, fb_height, fb_bpp, (u8*)fb_addr);
     pitch = VESA_X_RES * pixelwidth;
@@ -256,8 +387,30 @@ void kernel_main(void) {
     
     fillrect(100, 100, 255, 0, 0, 200, 200);
     
-    FATSystem* system = fs_createSystem(34);
-    fs_open(system, &system->entries[1]);
+    // The first FAT volume there is, on the boot disk it's the partition after the kernel
+    FATSystem* system = nullptr;
+    
+    for (u32 i = 0; i < block_count() && !system; i++) {
+        if (fs_probe(block_get(i)))
+            system = fs_createSystem(block_get(i));
+    }
+    
+    if (system && system->entriesLength > 0) {
+        u8* file = fs_open(system, system->entries[0]);
+        fs_close(system->entries[0], file);
+        
+        frame_dump();
+        kmem_dump();
+        dma_dump();
+        trace_dump();
+        block_dump();
+        bcache_dump();
+        fs_dump(system);
+        ata_dump();
+        ahci_dump();
+        virtio_blk_dump();
+        lazy_dump(pager);
+    }
     
     // Draws a .bmp test image
     /*{
@@ -350,6 +503,9 @@ void kernel_main(void) {
     while(1) {
         handleIrqs();
         
+        // Idle time, keep the zero pool topped up
+        frame_zero_refill(FRAME_ZERO_BATCH);
+        
         //draw_cursor(mouse_state.x, mouse_state.y);
         fillrect((u32)mouse_state.x, (u32)mouse_state.y, 255, 0, 0, 100, 100);
     }
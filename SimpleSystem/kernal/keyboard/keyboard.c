@@ -1,5 +1,6 @@
 ﻿#include "keyboard.h"
 
+#include "../memory/trace.h"
 #include "../serial/serial.h"
 
 char scancodes[3][128] = {
@@ -60,9 +61,14 @@ char scancodes[3][128] = {
 };
 
 void handleIrq(void) {
-	while (!(inb(KEYBOARD_COMMAND_PORT) & 0x01));
 	u8 status = inb(KEYBOARD_COMMAND_PORT);
 	
+	// IRQ 2 is the cascade, it's pending for any slave IRQ (i.e. the disk),
+	// not only when there's something to read
+	if (!(status & 0x01)) {
+		return;
+	}
+	
 	// If data is from mouse
 	if (status & 0x20) {
 		return;
@@ -79,6 +85,10 @@ void handleIrq(void) {
 		//writeHex(pressedKey);
 		//writeSerial('\n');
 		printf("You released: %c = %d\n", pressedKey, scancode);
+		
+		// Allocation profile on demand
+		if (pressedKey == 'm')
+			trace_dump();
 	} else {
 		// Pressed
 		printf("You pressed : %c = %d\n", pressedKey, scancode);
@@ -0,0 +1,244 @@
+﻿#include "dma.h"
+
+#include "frame.h"
+#include "lazy.h"
+#include "paging.h"
+#include "trace.h"
+#include "../serial/serial.h"
+
+static u8* pool = nullptr;
+static DmaChunk chunks[DMA_CHUNKS];
+
+static DmaStats class_stats[DMA_CLASSES];
+static DmaStats large_stats;
+
+static inline u32 class_size(u32 class) {
+    return DMA_MIN_SIZE << class;
+}
+
+static inline u32 class_slots(u32 class) {
+    return DMA_CHUNK_SIZE / class_size(class);
+}
+
+void dma_init(void) {
+    // Blocks are aligned to their size, so the chunks are 64 KiB aligned too
+    pool = (u8*)alloc_frames(DMA_POOL_SIZE / FRAME_SIZE);
+    
+    if (!pool) {
+        printf("DMA pool couldn't be allocated\n");
+        return;
+    }
+    
+    for (u32 i = 0; i < DMA_CHUNKS; i++) {
+        chunks[i].class = DMA_CHUNK_FREE;
+        chunks[i].used = 0;
+    }
+    
+    printf("DMA pool: %d KB at %x\n", DMA_POOL_SIZE / 1024, pool);
+}
+
+static s32 dma_find_slot(DmaChunk* chunk, u32 class) {
+    u32 slots = class_slots(class);
+    
+    for (u32 i = 0; i < slots; i += 32) {
+        u32 word = chunk->slots[i / 32];
+        
+        if (word == 0xFFFFFFFF)
+            continue;
+        
+        for (u32 bit = 0; bit < 32 && i + bit < slots; bit++) {
+            if (!(word & (1u << bit)))
+                return i + bit;
+        }
+    }
+    
+    return -1;
+}
+
+static u8 dma_alloc_large(DmaBuffer* buffer, u32 size) {
+    u32 frames = (size + FRAME_SIZE - 1) / FRAME_SIZE;
+    void* frame = alloc_frames(frames);
+    
+    if (!frame) {
+        large_stats.failed++;
+        return 0;
+    }
+    
+    buffer->virt = frame;
+    buffer->size = frames * FRAME_SIZE;
+    
+    large_stats.allocs++;
+    large_stats.in_use++;
+    
+    return 1;
+}
+
+u8 dma_alloc(DmaBuffer* buffer, u32 size, u32 flags) {
+    buffer->virt = nullptr;
+    buffer->phys = 0;
+    buffer->size = 0;
+    
+    if (size == 0) return 0;
+    
+    if (size > DMA_CHUNK_SIZE) {
+        if (!(flags & DMA_ANY_BOUNDARY)) {
+            printf("dma_alloc: %d bytes would cross a 64 KiB boundary\n", size);
+            return 0;
+        }
+        
+        if (!dma_alloc_large(buffer, size))
+            return 0;
+    } else {
+        if (!pool) return 0;
+        
+        u32 class = 0;
+        while (class_size(class) < size)
+            class++;
+        
+        DmaChunk* chunk = nullptr;
+        DmaChunk* empty = nullptr;
+        
+        for (u32 i = 0; i < DMA_CHUNKS; i++) {
+            if (chunks[i].class == class && chunks[i].used < class_slots(class)) {
+                chunk = &chunks[i];
+                break;
+            }
+            
+            if (!empty && chunks[i].class == DMA_CHUNK_FREE)
+                empty = &chunks[i];
+        }
+        
+        if (!chunk) {
+            if (!empty) {
+                class_stats[class].failed++;
+                return 0;
+            }
+            
+            chunk = empty;
+            chunk->class = class;
+            memset(chunk->slots, 0, sizeof(chunk->slots));
+        }
+        
+        s32 slot = dma_find_slot(chunk, class);
+        
+        chunk->slots[slot / 32] |= 1u << (slot % 32);
+        chunk->used++;
+        
+        buffer->virt = pool + (chunk - chunks) * DMA_CHUNK_SIZE + slot * class_size(class);
+        buffer->size = class_size(class);
+        
+        class_stats[class].allocs++;
+        class_stats[class].in_use++;
+    }
+    
+    // Frame allocator memory is identity mapped (memory/frame.h)
+    buffer->phys = (u32)buffer->virt;
+    
+    if (flags & DMA_ZERO)
+        memset(buffer->virt, 0, buffer->size);
+    
+    TRACE_ALLOC(TRACE_DMA, TRACE_CALLER(), buffer->virt, size, buffer->size);
+    
+    return 1;
+}
+
+void dma_free(DmaBuffer* buffer) {
+    if (!buffer || !buffer->virt) return;
+    
+    u8* addr = (u8*)buffer->virt;
+    
+    TRACE_FREE(TRACE_DMA, addr);
+    
+    if (addr < pool || addr >= pool + DMA_POOL_SIZE) {
+        free_frames(addr, buffer->size / FRAME_SIZE);
+        
+        large_stats.frees++;
+        large_stats.in_use--;
+    } else {
+        u32 offset = addr - pool;
+        DmaChunk* chunk = &chunks[offset / DMA_CHUNK_SIZE];
+        
+        if (chunk->class == DMA_CHUNK_FREE) {
+            printf("dma_free: %x isn't allocated\n", addr);
+            return;
+        }
+        
+        u32 slot = (offset % DMA_CHUNK_SIZE) / class_size(chunk->class);
+        
+        if (!(chunk->slots[slot / 32] & (1u << (slot % 32)))) {
+            printf("dma_free: double free of %x\n", addr);
+            return;
+        }
+        
+        chunk->slots[slot / 32] &= ~(1u << (slot % 32));
+        
+        class_stats[chunk->class].frees++;
+        class_stats[chunk->class].in_use--;
+        
+        // Empty chunks can be used by any class again
+        if (--chunk->used == 0)
+            chunk->class = DMA_CHUNK_FREE;
+    }
+    
+    buffer->virt = nullptr;
+    buffer->phys = 0;
+    buffer->size = 0;
+}
+
+u32 dma_phys(const void* virt) {
+    Pager* pager = pager_active();
+    u32 addr = (u32)virt;
+    
+    if (!pager)
+        return addr;
+    
+    u32 phys = pager_translate(pager, addr);
+    
+    // Lazy regions only get their frames on the first touch
+    if (!phys && addr >= LAZY_BASE && addr < LAZY_END) {
+        (void)*(volatile u8*)addr;
+        phys = pager_translate(pager, addr);
+    }
+    
+    return phys;
+}
+
+u8 dma_reachable(const void* buffer, u32 bytes) {
+    if ((u32)buffer & 1)
+        return 0;
+    
+    u32 addr = (u32)buffer;
+    u32 end = addr + bytes;
+    
+    while (addr < end) {
+        if (!dma_phys((void*)addr))
+            return 0;
+        
+        addr = (addr & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+    }
+    
+    return 1;
+}
+
+void dma_dump(void) {
+    u32 free_chunks = 0;
+    
+    for (u32 i = 0; i < DMA_CHUNKS; i++) {
+        if (chunks[i].class == DMA_CHUNK_FREE)
+            free_chunks++;
+    }
+    
+    printf("DMA pool: %d/%d chunks free\n", free_chunks, DMA_CHUNKS);
+    
+    for (u32 i = 0; i < DMA_CLASSES; i++) {
+        DmaStats* s = &class_stats[i];
+        
+        if (s->allocs || s->failed)
+            printf("  %d bytes: allocs=%d frees=%d in_use=%d failed=%d\n",
+                   class_size(i), s->allocs, s->frees, s->in_use, s->failed);
+    }
+    
+    if (large_stats.allocs || large_stats.failed)
+        printf("  large: allocs=%d frees=%d in_use=%d failed=%d\n",
+               large_stats.allocs, large_stats.frees, large_stats.in_use, large_stats.failed);
+}
@@ -0,0 +1,72 @@
+﻿#ifndef DMA_H
+#define DMA_H
+
+#include "../io.h"
+
+/**
+ * Physically contiguous buffers for devices.
+ *
+ * A pool is taken from the frame allocator at boot and cut into 64 KiB
+ * chunks. Every chunk serves one size class (512 bytes - 64 KiB), and
+ * buffers are aligned to their class size, so a buffer never crosses a
+ * 64 KiB boundary (which ISA and IDE bus master DMA can't do).
+ *
+ * Bigger buffers (i.e. graphics back buffers) come straight from the frame
+ * allocator, they are contiguous but can cross 64 KiB boundaries.
+ */
+
+#define DMA_POOL_SIZE     (1024 * 1024)
+#define DMA_CHUNK_SIZE    (64 * 1024)
+#define DMA_CHUNKS        (DMA_POOL_SIZE / DMA_CHUNK_SIZE)
+
+#define DMA_MIN_SIZE      512
+#define DMA_CLASSES       8 // 512, 1K, 2K, 4K, 8K, 16K, 32K, 64K
+#define DMA_SLOTS_MAX     (DMA_CHUNK_SIZE / DMA_MIN_SIZE)
+
+#define DMA_CHUNK_FREE    0xFF
+
+// dma_alloc flags
+#define DMA_ZERO          0x1
+#define DMA_ANY_BOUNDARY  0x2 // Allows buffers bigger than DMA_CHUNK_SIZE
+
+typedef struct {
+    void* virt;
+    u32 phys;
+    u32 size;
+} DmaBuffer;
+
+typedef struct {
+    u8 class;       // Size class, DMA_CHUNK_FREE if the chunk is unused
+    u16 used;       // Slots handed out
+    u32 slots[DMA_SLOTS_MAX / 32];
+} DmaChunk;
+
+typedef struct {
+    u32 allocs;
+    u32 frees;
+    u32 in_use;
+    u32 failed;
+} DmaStats;
+
+void dma_init(void);
+
+/**
+ * Fills "buffer" with a physically contiguous buffer of at least "size" bytes,
+ * returns 0 if there's no room (or the size needs DMA_ANY_BOUNDARY).
+ */
+u8 dma_alloc(DmaBuffer* buffer, u32 size, u32 flags);
+void dma_free(DmaBuffer* buffer);
+
+/**
+ * Physical address of any kernel buffer (not only dma_alloc ones), through
+ * the active address space. Lazy pages are touched first so they have a frame.
+ * Returns 0 if "virt" isn't mapped.
+ */
+u32 dma_phys(const void* virt);
+
+// Every page of the buffer has a frame, and it's 2 byte aligned (what PRDs need)
+u8 dma_reachable(const void* buffer, u32 bytes);
+
+void dma_dump(void);
+
+#endif // DMA_H
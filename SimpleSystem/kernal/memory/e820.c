@@ -0,0 +1,151 @@
+﻿#include "e820.h"
+
+#include "frame.h"
+#include "../serial/serial.h"
+
+static E820Entry* entries = nullptr;
+static u32 entry_count = 0;
+
+static const char* type_names[] = {
+    "unknown", "usable", "reserved", "ACPI", "ACPI NVS", "bad"
+};
+
+u32 e820_init(void) {
+    entry_count = *(u32*)E820_MAP;
+    entries = (E820Entry*)(E820_MAP + 4);
+    
+    // Garbage (or no map at all), the boot loader never stores more than this
+    if (entry_count > E820_MAX_ENTRIES)
+        entry_count = 0;
+    
+    return entry_count;
+}
+
+u32 e820_count(void) {
+    return entry_count;
+}
+
+const E820Entry* e820_entry(u32 index) {
+    if (index >= entry_count)
+        return nullptr;
+    
+    return &entries[index];
+}
+
+u8 e820_usable(const E820Entry* entry) {
+    if (entry->type != E820_USABLE || entry->length == 0)
+        return 0;
+    
+    return (entry->attributes & E820_ATTR_VALID) != 0;
+}
+
+/**
+ * Clips an entry to [0, limit), returns 0 if nothing is left.
+ */
+static u8 e820_clip(const E820Entry* entry, u32 limit, u32* start, u32* end) {
+    if (entry->base >= limit)
+        return 0;
+    
+    u64 top = entry->base + entry->length;
+    
+    *start = (u32)entry->base;
+    *end = top > limit ? limit : (u32)top;
+    
+    return *end > *start;
+}
+
+u32 e820_usable_end(u32 limit) {
+    u32 highest = 0;
+    
+    for (u32 i = 0; i < entry_count; i++) {
+        u32 start, end;
+        
+        if (!e820_usable(&entries[i]) || !e820_clip(&entries[i], limit, &start, &end))
+            continue;
+        
+        if (end > highest)
+            highest = end;
+    }
+    
+    return highest;
+}
+
+/**
+ * Entries are allowed to overlap. Anything that isn't usable wins over a
+ * usable entry, and of two usable ones only the first counts, so a frame
+ * is never added twice.
+ */
+static u8 e820_blocks(u32 usable, u32 other) {
+    const E820Entry* entry = &entries[other];
+    
+    if (other == usable || entry->length == 0 || !(entry->attributes & E820_ATTR_VALID))
+        return 0;
+    
+    return entry->type != E820_USABLE || other < usable;
+}
+
+// Adds what's left of [start, end) after the entries from "from" on cut their parts out of it
+static u32 e820_add_range(u32 usable, u32 from, u32 start, u32 end) {
+    for (u32 i = from; i < entry_count; i++) {
+        const E820Entry* entry = &entries[i];
+        
+        if (!e820_blocks(usable, i))
+            continue;
+        
+        u64 top = entry->base + entry->length;
+        
+        if (entry->base >= end || top <= start)
+            continue;
+        
+        // The parts before and after it can still overlap later entries
+        u32 added = 0;
+        
+        if (entry->base > start)
+            added += e820_add_range(usable, i + 1, start, (u32)entry->base);
+        
+        if (top < end)
+            added += e820_add_range(usable, i + 1, (u32)top, end);
+        
+        return added;
+    }
+    
+    frame_add_region(start, end);
+    
+    return end - start;
+}
+
+u32 e820_add_frames(u32 limit) {
+    u32 added = 0;
+    
+    for (u32 i = 0; i < entry_count; i++) {
+        u32 start, end;
+        
+        if (!e820_usable(&entries[i]) || !e820_clip(&entries[i], limit, &start, &end))
+            continue;
+        
+        added += e820_add_range(i, 0, start, end);
+    }
+    
+    return added;
+}
+
+void e820_dump(void) {
+    printf("E820 memory map (%d entries):\n", entry_count);
+    
+    for (u32 i = 0; i < entry_count; i++) {
+        E820Entry* entry = &entries[i];
+        u32 type = entry->type <= E820_BAD ? entry->type : 0;
+        const char* ignored = (entry->attributes & E820_ATTR_VALID) ? "" : " (ignored)";
+        
+        // printf only does 32 bits
+        if (entry->base >> 32) {
+            printf("  above 4 GiB, %d MB %s%s\n", (u32)(entry->length >> 20), type_names[type], ignored);
+            continue;
+        }
+        
+        u64 end = entry->base + entry->length;
+        
+        printf("  %x - %x %s%s\n", (u32)entry->base,
+               (end >> 32) ? 0xFFFFFFFF : (u32)end, type_names[type], ignored);
+    }
+}
@@ -0,0 +1,62 @@
+﻿#ifndef E820_H
+#define E820_H
+
+#include "../io.h"
+
+/**
+ * BIOS memory map (INT 0x15, EAX=0xE820).
+ *
+ * The boot loader collects the entries before switching to protected mode
+ * and leaves them at E820_MAP, a u32 count followed by the entries.
+ */
+
+#define E820_MAP         0x8000
+#define E820_MAX_ENTRIES 32
+
+// Region types
+#define E820_USABLE      1
+#define E820_RESERVED    2
+#define E820_ACPI        3 // ACPI tables, reclaimable after they are parsed
+#define E820_NVS         4
+#define E820_BAD         5
+
+// ACPI 3.0 extended attributes
+#define E820_ATTR_VALID  0x1 // Entry should be ignored if this is clear
+
+typedef struct {
+    u64 base;
+    u64 length;
+    u32 type;
+    u32 attributes;
+} __attribute__((packed)) E820Entry;
+
+/**
+ * Validates the map left by the boot loader.
+ * Returns the number of entries, 0 if the BIOS didn't give us one.
+ */
+u32 e820_init(void);
+
+u32 e820_count(void);
+const E820Entry* e820_entry(u32 index);
+
+/**
+ * Is the entry RAM the kernel can use.
+ */
+u8 e820_usable(const E820Entry* entry);
+
+/**
+ * Highest usable address below "limit" (the end of the last usable region),
+ * used to size the frame allocator and the identity map.
+ */
+u32 e820_usable_end(u32 limit);
+
+/**
+ * Hands every usable region below "limit" to the frame allocator, without
+ * the parts that a reserved (or any other non usable) entry overlaps.
+ * Returns the number of bytes that were added.
+ */
+u32 e820_add_frames(u32 limit);
+
+void e820_dump(void);
+
+#endif // E820_H
@@ -1,14 +1,277 @@
 ﻿#include "filesystem.h"
 
-// 28
-FATSystem* fs_createSystem(u8 partition_start) {
+#include "../lazy.h"
+#include "../slab.h"
+#include "../../block/bcache.h"
+#include "../../serial/serial.h"
+
+// Root directory entries, only the used slots get one
+static KmemCache* dir_entry_cache = nullptr;
+
+static void fat_cache_free(FATSystem* fs) {
+    for (u32 copy = 0; copy < FAT_MAX_COPIES; copy++) {
+        if (fs->fat[copy])
+            lazy_free(pager_kernel(), fs->fat[copy]);
+        
+        kfree(fs->fat_loaded[copy]);
+        
+        fs->fat[copy] = nullptr;
+        fs->fat_loaded[copy] = nullptr;
+    }
+}
+
+static u8 fat_cache_init(FATSystem* fs) {
+    FAT_BootSector* bs = fs->bs;
+    
+    fs->fat_start = bs->common.reserved_sector_count;
+    fs->fat_sectors = bs->common.fat_size_16 ? bs->common.fat_size_16 : bs->ebpb.f32.fat_size_32;
+    fs->fat_copies = bs->common.fat_count < FAT_MAX_COPIES ? bs->common.fat_count : FAT_MAX_COPIES;
+    
+    for (u32 copy = 0; copy < fs->fat_copies; copy++) {
+        // Only the pages of sectors that get loaded ever get a frame
+        fs->fat[copy] = (u8*)lazy_alloc(pager_kernel(), fs->fat_sectors * BLOCK_SECTOR_SIZE,
+                                        PAGE_PRESENT | PAGE_WRITE, nullptr, nullptr);
+        fs->fat_loaded[copy] = (u32*)kzalloc((fs->fat_sectors + 31) / 32 * sizeof(u32));
+        
+        if (!fs->fat[copy] || !fs->fat_loaded[copy]) {
+            printf("Couldn't allocate FAT %d (%d sectors)\n", copy + 1, fs->fat_sectors);
+            fat_cache_free(fs);
+            
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static inline u8 fat_sector_loaded(FATSystem* fs, u32 copy, u32 sector) {
+    return (fs->fat_loaded[copy][sector / 32] >> (sector % 32)) & 1;
+}
+
+// Makes sure "sector" of FAT "copy" is in memory
+static u8 fat_load(FATSystem* fs, u32 copy, u32 sector) {
+    if (sector >= fs->fat_sectors)
+        return 0;
+    
+    if (fat_sector_loaded(fs, copy, sector))
+        return 1;
+    
+    // Chains mostly go forward, the sectors after it are likely next
+    u32 count = 1;
+    
+    while (count < FAT_LOAD_SECTORS && sector + count < fs->fat_sectors &&
+           !fat_sector_loaded(fs, copy, sector + count))
+        count++;
+    
+    u32 lba = fs->fat_start + copy * fs->fat_sectors + sector;
+    
+    if (!block_read(fs->device, lba, count, fs->fat[copy] + sector * BLOCK_SECTOR_SIZE)) {
+        printf("FAT %d read failed at sector %x\n", copy + 1, lba);
+        return 0;
+    }
+    
+    for (u32 i = sector; i < sector + count; i++)
+        fs->fat_loaded[copy][i / 32] |= 1u << (i % 32);
+    
+    fs->fat_stats.loads++;
+    fs->fat_stats.loaded_sectors += count;
+    
+    return 1;
+}
+
+// The entry of "cluster" in FAT "copy", 0 (free) if it can't be read
+static u32 fat_read_entry(FATSystem* fs, u32 copy, u32 cluster) {
+    u32 offset;
+    
+    if (fs->type == FAT12)
+        offset = cluster + cluster / 2;
+    else if (fs->type == FAT32)
+        offset = cluster * 4;
+    else
+        offset = cluster * 2;
+    
+    u32 sector = offset / BLOCK_SECTOR_SIZE;
+    
+    if (!fat_load(fs, copy, sector))
+        return 0;
+    
+    u8* entry = fs->fat[copy] + offset;
+    
+    if (fs->type == FAT12) {
+        // 12 bit entries can start at the last byte of a sector
+        if ((offset + 1) / BLOCK_SECTOR_SIZE != sector && !fat_load(fs, copy, sector + 1))
+            return 0;
+        
+        u16 value = (u16)entry[0] | (u16)(entry[1] << 8);
+        
+        return (cluster & 1) ? value >> 4 : value & 0x0FFF;
+    }
+    
+    if (fs->type == FAT32)
+        return *(u32*)entry & 0x0FFFFFFF;
+    
+    return *(u16*)entry;
+}
+
+/**
+ * If an entry is greater than or equal to (>=) this,
+ * then there are no more clusters in the chain.
+ * One less is a "bad" cluster, which are prone to errors and should be avoided.
+ */
+static u32 fat_end_of_chain(FATSystem* fs) {
+    if (fs->type == FAT12)
+        return 0xFF8;
+    
+    if (fs->type == FAT32)
+        return 0x0FFFFFF8;
+    
+    return END_OF_CLUSTER_MARKER;
+}
+
+// Anything else is the end, a bad cluster or a broken chain
+static inline u8 fat_cluster_valid(FATSystem* fs, u32 cluster) {
+    return cluster >= 2 && cluster < fs->total_clusters + 2;
+}
+
+static inline u32 fat_cluster_sector(FATSystem* fs, u32 cluster) {
+    return fs->first_data_sector + (cluster - 2) * fs->bs->common.sectors_per_cluster;
+}
+
+u32 fs_fatEntry(FATSystem* fs, u32 cluster) {
+    fs->fat_stats.lookups++;
+    
+    u32 next = fat_read_entry(fs, 0, cluster);
+    
+    // Try secondary FAT if entry is zero
+    // TODO; Test this..
+    if (next == 0 && fs->fat_copies > 1) {
+        next = fat_read_entry(fs, 1, cluster);
+        
+        if (next) {
+            fs->fat_stats.secondary++;
+            printf("Secondary FAT entry: %x -> %x\n", cluster, next);
+        }
+    }
+    
+    return next;
+}
+
+static u8 fat_chain_append(FatChain* chain, u32 cluster) {
+    FatExtent* last = chain->count ? &chain->extents[chain->count - 1] : nullptr;
+    
+    if (last && last->cluster + last->count == cluster) {
+        last->count++;
+        return 1;
+    }
+    
+    if (chain->count == chain->capacity) {
+        u32 capacity = chain->capacity ? chain->capacity * 2 : 8;
+        FatExtent* extents = (FatExtent*)kmalloc(capacity * sizeof(FatExtent));
+        
+        if (!extents)
+            return 0;
+        
+        if (chain->extents) {
+            memcpy(extents, chain->extents, chain->count * sizeof(FatExtent));
+            kfree(chain->extents);
+        }
+        
+        chain->extents = extents;
+        chain->capacity = capacity;
+    }
+    
+    chain->extents[chain->count].cluster = cluster;
+    chain->extents[chain->count].count = 1;
+    chain->count++;
+    
+    return 1;
+}
+
+u8 fs_getChain(FATSystem* fs, u32 cluster, FatChain* chain) {
+    memset(chain, 0, sizeof(FatChain));
+    
+    fs->fat_stats.chains++;
+    
+    while (fat_cluster_valid(fs, cluster)) {
+        // Longer than the volume, it loops
+        if (chain->clusters == fs->total_clusters) {
+            printf("FAT chain loops at cluster %x\n", cluster);
+            return 0;
+        }
+        
+        if (!fat_chain_append(chain, cluster)) {
+            printf("Out of memory for the FAT chain\n");
+            return 0;
+        }
+        
+        chain->clusters++;
+        fs->fat_stats.clusters++;
+        
+        cluster = fs_fatEntry(fs, cluster);
+    }
+    
+    fs->fat_stats.extents += chain->count;
+    
+    // An empty file has no chain at all
+    if (chain->clusters && cluster < fat_end_of_chain(fs)) {
+        printf("FAT chain broken after %d clusters, entry %x\n", chain->clusters, cluster);
+        return 0;
+    }
+    
+    return 1;
+}
+
+void fs_freeChain(FatChain* chain) {
+    kfree(chain->extents);
+    memset(chain, 0, sizeof(FatChain));
+}
+
+u8 fs_probe(BlockDevice* device) {
+    u8* sector = (u8*)kmalloc(512);
+    
+    if (!sector)
+        return 0;
+    
+    FAT_BootSector* bs = (FAT_BootSector*)sector;
+    
+    // FAT16 and FAT32 keep "FAT" at different offsets, one of them has to match
+    u8 fat = block_read(device, 0, 1, sector) &&
+             bs->signature == 0xAA55 &&
+             bs->common.bytes_per_sector == 512 &&
+             bs->common.fat_count >= 1 && bs->common.fat_count <= 2 &&
+             ((sector[54] == 'F' && sector[55] == 'A' && sector[56] == 'T') ||
+              (sector[82] == 'F' && sector[83] == 'A' && sector[84] == 'T'));
+    
+    kfree(sector);
+    
+    return fat;
+}
+
+FATSystem* fs_createSystem(BlockDevice* device) {
+    if (!dir_entry_cache)
+        dir_entry_cache = kmem_cache_create("dir_entry", sizeof(DirEntry), 4);
+    
     // Create new file system
-    FATSystem* system = (FATSystem*)memalign(8, sizeof(FATSystem));
+    FATSystem* system = (FATSystem*)kzalloc(sizeof(FATSystem));
+    
+    if (!system) {
+        printf("Couldn't allocate the file system\n");
+        
+        return nullptr;
+    }
+    
+    system->device = device;
+    
+    // The boot sector has to outlive this function, fs_open reads it
+    u8* buffer = (u8*)kmalloc(512);
     
-    system->partition_start = partition_start;
+    if (!buffer) {
+        kfree(system);
+        
+        return nullptr;
+    }
     
-    u8 buffer[512];
-    lba_read(partition_start, 1, buffer);
+    block_read(device, 0, 1, buffer);
     
     system->bs = (FAT_BootSector*)buffer;
     FAT_BootSector* bs = system->bs;
@@ -16,6 +279,9 @@ FATSystem* fs_createSystem(u8 partition_start) {
     if (bs->signature != 0xAA55) {
         printf("Invalid boot sector signature: %x\n", system->bs->signature);
         
+        kfree(buffer);
+        kfree(system);
+        
         return nullptr;
     }
     
@@ -23,7 +289,7 @@ FATSystem* fs_createSystem(u8 partition_start) {
     // https://drakeor.com/2022/10/12/koizos-writing-a-simple-fat16-filesystem/
     
     system->total_sectors = bs->common.bytes_per_sector;
-    system->root_dir_start = /*partition_start +*/ bs->common.reserved_sector_count +
+    system->root_dir_start = bs->common.reserved_sector_count +
                                 (bs->common.fat_count * bs->common.fat_size_16);
     
     //system->root_dir_sectors = (bs->common.root_entry_count * 32 + 
@@ -74,34 +340,68 @@ FATSystem* fs_createSystem(u8 partition_start) {
         printf("FAT32\n");
     }
     
+    if (!fat_cache_init(system)) {
+        kfree(buffer);
+        kfree(system);
+        
+        return nullptr;
+    }
+    
+    system->entries = (DirEntry**)kzalloc(bs->common.root_entry_count * sizeof(DirEntry*));
+    system->entriesLength = 0;
+    
+    if (!system->entries) {
+        printf("Couldn't allocate %d directory entries\n", bs->common.root_entry_count);
+        
+        fat_cache_free(system);
+        kfree(buffer);
+        kfree(system);
+        
+        return nullptr;
+    }
+    
     fs_refreshEntries(system);
     
     return system;
 }
 
 void fs_refreshEntries(FATSystem* fs) {
+    // Drop the entries from the last refresh
+    for (u32 i = 0; i < fs->entriesLength; i++) {
+        kmem_cache_free(dir_entry_cache, fs->entries[i]);
+        fs->entries[i] = nullptr;
+    }
+    
+    fs->entriesLength = 0;
+    
     // Read data
     // TODO; Is this always '32'?
     //fs->root_dir_sectors = 32;
     
     fs->root_dir_byte = (fs->root_dir_sectors * fs->bs->common.bytes_per_sector);
     
-    // TODO; Unsure how to handle this??
-    u8 RootDirBuffer[fs->root_dir_byte];
-    lba_read(fs->partition_start + fs->root_dir_start, fs->root_dir_sectors, RootDirBuffer);
-    
     printf("Size: %d sectors: %d\n", fs->root_dir_byte, fs->root_dir_sectors);
     
-    // Max possible amount of files (For FAT16)
-    fs->entries[fs->root_dir_byte / fs->root_dir_sectors];
-    fs->entriesLength = fs->root_dir_byte / fs->root_dir_sectors;
-    
     u16 entriesCount = 0;
     
+    // A sector at a time through the buffer cache, refreshing again doesn't touch the disk
+    Buffer* sector = nullptr;
+    
     u32 root_dir_bytes = fs->bs->common.root_entry_count * 32;
     for (u32 i = 0; i < root_dir_bytes; i += 32) {
     //for (u32 i = 0; i < fs->root_dir_byte; i += fs->root_dir_sectors) {
-        DirEntry* entry = (DirEntry*)&RootDirBuffer[i];
+        if (i % BLOCK_SECTOR_SIZE == 0) {
+            brelse(sector);
+            sector = bread(fs->device, fs->root_dir_start + i / BLOCK_SECTOR_SIZE);
+            
+            if (!sector) {
+                printf("Root directory read failed at sector %d\n", fs->root_dir_start + i / BLOCK_SECTOR_SIZE);
+                
+                break;
+            }
+        }
+        
+        DirEntry* entry = (DirEntry*)&sector->data[i % BLOCK_SECTOR_SIZE];
         
         if (entry->name[0] == 0x00) {
             // a null file
@@ -126,11 +426,24 @@ void fs_refreshEntries(FATSystem* fs) {
         printf("Name: %s Attr: %x Size: %x Cluster: %x\n",
                name, entry->attr, entry->size, entry->low_cluster);
         
-        fs->entries[entriesCount++] = *entry;
+        DirEntry* copy = (DirEntry*)kmem_cache_alloc(dir_entry_cache);
+        
+        if (!copy) {
+            printf("Out of memory for directory entries\n");
+            
+            break;
+        }
+        
+        *copy = *entry;
+        fs->entries[entriesCount++] = copy;
     }
+    
+    brelse(sector);
+    
+    fs->entriesLength = entriesCount;
 }
 
-void fs_open(FATSystem* fs, DirEntry* file) {
+u8* fs_open(FATSystem* fs, DirEntry* file) {
     char name[12];
     u8* src = file->name;
     
@@ -145,93 +458,105 @@ void fs_open(FATSystem* fs, DirEntry* file) {
     
     size_t sector_count = (file->size + 511) / 512;
     printf("Sectors to read from file: %x\n", sector_count);
-    u8* fileBuffer = memalign(4096, sector_count * 512);
+    // Frames are only allocated for the pages that actually get touched
+    // (whole clusters are read, so the buffer is rounded up to them)
+    u32 buffer_size = ((file->size + fs->bytes_per_cluster - 1) / fs->bytes_per_cluster) * fs->bytes_per_cluster;
+    u8* fileBuffer = (u8*)lazy_alloc(pager_active(), buffer_size, PAGE_PRESENT | PAGE_WRITE, nullptr, nullptr);
+    
+    if (!fileBuffer) {
+        printf("Couldn't allocate %d bytes for %s\n", file->size, name);
+        
+        return nullptr;
+    }
     
     printf("Reading file...\n");
     
-    // Start reading file
-    u16 cluster = file->low_cluster;
+    // FAT32 keeps the high half of the first cluster too
+    u32 first = file->low_cluster;
+    
+    if (fs->type == FAT32)
+        first |= (u32)file->high_cluster << 16;
+    
+    // The whole chain up front, from the FAT in memory, so only the clusters themselves are read
+    FatChain chain;
+    
+    if (!fs_getChain(fs, first, &chain))
+        printf("Reading the first %d clusters of %s\n", chain.clusters, name);
+    
+    // Every extent is one request, the driver splits it into the biggest commands it can do
+    BlockRequest runs[FAT_MAX_RUNS];
     u32 offset = 0;
+    u8 ok = 1;
     
-    /**
-     * If "table_value" is greater than or equal to (>=) 0xFFF8,
-     * then there are no more clusters in the chain.
-     * This means that the whole file has been read.
-     * If "table_value" equals (==) 0xFFF7 then this,
-     * cluster has been marked as "bad".
-     * "Bad" clusters are prone to errors and should be avoided.
-     * If "table_value" is not one of the above cases then,
-     * it is the cluster number of the next cluster in the file.
-     */
-    while (cluster >= 0x0002 && cluster < 0xFFF0) {
-        //u32 sector = fs->first_data_sector + (cluster - 2) * fs->sectors_per_cluster;
-        u32 sector = fs->partition_start +
-             fs->first_data_sector +
-             (cluster - 2) * fs->bs->common.sectors_per_cluster;
-        
-        printf("first: %d\n", fs->first_data_sector);
-        printf("cluster - 2: %d\n", cluster - 2);
-        printf("sector: %d\n", fs->bs->common.sectors_per_cluster);
-        printf("Reading at: %d %x\n", sector, sector);
-        
-        lba_read(sector, fs->bs->common.sectors_per_cluster,
-            fileBuffer + offset);
-        
-        offset += fs->bytes_per_cluster;
-        
-        // Read next FAT entry
-        u32 fat_offset = cluster * 2;
-        //u32 fat_sector = fs->bs->common.reserved_sector_count + (fat_offset / fs->bytes_per_sector);
-        u32 fat_sector = fs->partition_start +
-                 fs->bs->common.reserved_sector_count + 
-                 (fat_offset / fs->bytes_per_sector);
-        
-        u32 ent_offset = fat_offset % fs->bytes_per_sector;
-        
-        u8 fat_buffer[fs->bytes_per_sector];
-        if (!lba_read(fs->partition_start + fat_sector, 1, fat_buffer)) {
-            printf("FAT read failed at sector %x\n", fat_sector);
-            
-            break;
-        }
+    for (u32 i = 0; i < chain.count && ok && offset < buffer_size; i += FAT_MAX_RUNS) {
+        u32 batch = 0;
         
-        // Check FAT signature
-        // TODO; I'm unsure if this is needed?
-        // TODO; As this completely breaks reading files
-        /*if (fat_buffer[0] != bs->common.media_type) {
-            printf("FAT signature mismatch: expected %x, got %x\n",
-                   bs->common.media_type, fat_buffer[0]);
-            
-            break;
-        }*/
+        // Queued together, so the elevator sees all of them before the first one goes out
+        block_plug(fs->device);
         
-        //u16 next_cluster = *(unsigned short*)&fat_buffer[ent_offset];
-        u16 next_cluster = (u16)fat_buffer[ent_offset] | 
-                           (u16)(fat_buffer[ent_offset + 1] << 8);
-        
-        // Try secondary FAT if entry is zero
-        // TODO; Test this..
-        if (next_cluster == 0 && fs->bs->common.fat_count > 1) {
-            printf("Trying secondary FAT...\n");
+        for (u32 j = i; j < chain.count && batch < FAT_MAX_RUNS && offset < buffer_size; j++) {
+            FatExtent* extent = &chain.extents[j];
             
-            u32 secondary_fat = fat_sector + fs->bs->common.fat_size_16;
-            if (!lba_read(fs->partition_start + secondary_fat, 1, fat_buffer)) {
-                printf("Secondary FAT read failed\n");
-                break;
-            }
+            // A chain longer than the file would run past the buffer
+            u32 bytes = extent->count * fs->bytes_per_cluster;
+            
+            if (bytes > buffer_size - offset)
+                bytes = buffer_size - offset;
+            
+            block_request_init(&runs[batch], fat_cluster_sector(fs, extent->cluster),
+                               bytes / BLOCK_SECTOR_SIZE, fileBuffer + offset, 0);
+            block_submit(fs->device, &runs[batch]);
             
-            next_cluster = (u16)fat_buffer[ent_offset] | 
-                           (u16)(fat_buffer[ent_offset + 1] << 8);
+            fs->fat_stats.runs++;
+            fs->fat_stats.run_sectors += bytes / BLOCK_SECTOR_SIZE;
             
-            printf("Secondary FAT entry: %x -> %x\n", cluster, next_cluster);
+            offset += bytes;
+            batch++;
         }
         
-        cluster = next_cluster;
+        block_unplug(fs->device);
+        
+        // Each one has to be waited on, even after one failed, they're on the stack
+        for (u32 j = 0; j < batch; j++) {
+            if (!block_wait(fs->device, &runs[j])) {
+                printf("Extent read failed at sector %x (%d sectors)\n", runs[j].lba, runs[j].count);
+                ok = 0;
+            }
+        }
     }
     
+    fs_freeChain(&chain);
+    
     printf("byte 0: %c byte 1: %c\n", fileBuffer[0], fileBuffer[1]);
     
     printf("File has been fully read!\n");
+    
+    return fileBuffer;
+}
+
+void fs_close(DirEntry* file, u8* buffer) {
+    // The buffer is its own lazy region, the entry isn't needed to free it
+    (void)file;
+    
+    if (!buffer) return;
+    
+    lazy_free(pager_active(), buffer);
+}
+
+void fs_dump(FATSystem* fs) {
+    FatStats* s = &fs->fat_stats;
+    u32 loaded = 0;
+    
+    for (u32 copy = 0; copy < fs->fat_copies; copy++) {
+        for (u32 sector = 0; sector < fs->fat_sectors; sector++)
+            loaded += fat_sector_loaded(fs, copy, sector);
+    }
+    
+    printf("FAT: %d/%d sectors in memory (%d copies), lookups=%d loads=%d (%d sectors) secondary=%d\n",
+           loaded, fs->fat_sectors * fs->fat_copies, fs->fat_copies, s->lookups, s->loads,
+           s->loaded_sectors, s->secondary);
+    printf("  chains=%d with %d clusters in %d extents, file reads=%d (%d sectors)\n",
+           s->chains, s->clusters, s->extents, s->runs, s->run_sectors);
 }
 
 // TODO; GLHF :D
@@ -1,11 +1,16 @@
 ﻿#pragma once
 
 #include "../../io.h"
+#include "../../block/block.h"
 
 // This should always be the same
 // TODO; Check for other types
 #define END_OF_CLUSTER_MARKER 0xFFF8
 
+#define FAT_MAX_COPIES     2
+#define FAT_LOAD_SECTORS   8    // A miss loads the sectors after it too, as long as they're missing
+#define FAT_MAX_RUNS       16   // Extent reads fs_open has in flight at once
+
 // According to: https://wiki.osdev.org/FAT
 #pragma pack(push, 1)
 
@@ -99,11 +104,38 @@ typedef enum {
     ExFAT
 } FatType;
 
+// Clusters "cluster" to "cluster + count - 1", one after another on the disk
+typedef struct {
+    u32 cluster;
+    u32 count;
+} FatExtent;
+
+// A file's cluster chain as runs of consecutive clusters
+typedef struct {
+    FatExtent* extents;
+    u32 count;
+    u32 capacity;
+    u32 clusters;       // In every extent together
+} FatChain;
+
+typedef struct {
+    u32 lookups;        // FAT entries read
+    u32 loads;          // Reads from the disk
+    u32 loaded_sectors;
+    u32 secondary;      // Entries only the second copy had
+    u32 chains;
+    u32 extents;
+    u32 clusters;
+    u32 runs;           // File data reads, one per extent
+    u32 run_sectors;
+} FatStats;
+
 typedef struct {
     /**
-     * Offset in sectors
+     * The partition (or whole disk) the volume is on,
+     * every sector number below is relative to it
      */
-    u8 partition_start;
+    BlockDevice* device;
     
     u16 bytes_per_sector; // TODO; Remove
     
@@ -120,15 +152,45 @@ typedef struct {
     
     FatType type;
     
+    /**
+     * Every FAT copy in memory, a sector is read from the disk the first
+     * time an entry in it is needed and never again after that
+     */
+    u32 fat_start;
+    u32 fat_sectors;    // Of one copy
+    u8 fat_copies;
+    u8* fat[FAT_MAX_COPIES];
+    u32* fat_loaded[FAT_MAX_COPIES];    // A bit per sector
+    FatStats fat_stats;
+    
     FAT_BootSector* bs;
-    DirEntry* entries;
+    DirEntry** entries;
     
     u32 entriesLength;
 } FATSystem;
 
-// 28
-extern FATSystem* fs_createSystem(u8 partition_start);
+// Whether "device" starts with a FAT boot sector
+extern u8 fs_probe(BlockDevice* device);
+
+extern FATSystem* fs_createSystem(BlockDevice* device);
 extern void fs_refreshEntries(FATSystem* fs);
 
-extern void fs_open(FATSystem* fs, DirEntry* file);
+/**
+ * Reads the whole file into a new buffer,
+ * the buffer must be given back with fs_close.
+ */
+extern u8* fs_open(FATSystem* fs, DirEntry* file);
+extern void fs_close(DirEntry* file, u8* buffer);
 extern void fs_write(FATSystem* fs, const char* name);
+
+// The FAT entry of "cluster" (the next one in its chain), 0 if it can't be read
+extern u32 fs_fatEntry(FATSystem* fs, u32 cluster);
+
+/**
+ * Walks the chain starting at "cluster" into "chain", returns 0 if it's
+ * broken (what was walked is still there). Has to be given back with fs_freeChain.
+ */
+extern u8 fs_getChain(FATSystem* fs, u32 cluster, FatChain* chain);
+extern void fs_freeChain(FatChain* chain);
+
+extern void fs_dump(FATSystem* fs);
@@ -0,0 +1,308 @@
+﻿#include "frame.h"
+
+#include "trace.h"
+#include "../serial/serial.h"
+
+static u8* frame_state = nullptr;
+static u32 frame_count = 0; // Frames covered by frame_state
+static u32 frame_first = 0; // First frame that can be handed out
+
+static FreeBlock* free_lists[FRAME_MAX_ORDER + 1];
+static u32 free_blocks[FRAME_MAX_ORDER + 1];
+
+static FrameStats stats;
+
+static void* zero_pool[FRAME_ZERO_POOL_SIZE];
+
+static inline FreeBlock* pfn_to_block(u32 pfn) {
+    return (FreeBlock*)(pfn * FRAME_SIZE);
+}
+
+static inline u32 block_to_pfn(FreeBlock* block) {
+    return (u32)block / FRAME_SIZE;
+}
+
+static void list_push(u32 order, u32 pfn) {
+    FreeBlock* block = pfn_to_block(pfn);
+    
+    block->prev = nullptr;
+    block->next = free_lists[order];
+    
+    if (block->next)
+        block->next->prev = block;
+    
+    free_lists[order] = block;
+    free_blocks[order]++;
+}
+
+static void list_remove(u32 order, FreeBlock* block) {
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        free_lists[order] = block->next;
+    
+    if (block->next)
+        block->next->prev = block->prev;
+    
+    free_blocks[order]--;
+}
+
+/**
+ * Puts a block back into the free lists,
+ * merging it with its buddy for as long as the buddy is also free.
+ */
+static void free_block(u32 pfn, u32 order) {
+    while (order < FRAME_MAX_ORDER) {
+        u32 buddy = pfn ^ (1u << order);
+        
+        if (buddy + (1u << order) > frame_count)
+            break;
+        
+        if (frame_state[buddy] != (FRAME_FREE | order))
+            break;
+        
+        list_remove(order, pfn_to_block(buddy));
+        frame_state[buddy] = 0;
+        
+        pfn &= ~(1u << order);
+        order++;
+        
+        stats.merges++;
+    }
+    
+    frame_state[pfn] = FRAME_FREE | order;
+    list_push(order, pfn);
+}
+
+void frame_init(u32 mem_end) {
+    frame_count = mem_end / FRAME_SIZE;
+    frame_state = (u8*)MEM_BUFFER_BASE;
+    
+    memset(frame_state, 0, frame_count);
+    
+    // Frames used by the state array itself are never handed out
+    frame_first = (MEM_BUFFER_BASE + frame_count + FRAME_SIZE - 1) / FRAME_SIZE;
+    
+    for (u32 i = 0; i <= FRAME_MAX_ORDER; i++) {
+        free_lists[i] = nullptr;
+        free_blocks[i] = 0;
+    }
+    
+    memset(&stats, 0, sizeof(stats));
+    
+    printf("Frame allocator: %d frames, state at %x, first usable frame %x\n",
+           frame_count, frame_state, frame_first * FRAME_SIZE);
+}
+
+void frame_add_region(u32 start, u32 end) {
+    u32 pfn = (start + FRAME_SIZE - 1) / FRAME_SIZE;
+    u32 end_pfn = end / FRAME_SIZE;
+    
+    if (pfn < frame_first) pfn = frame_first;
+    if (end_pfn > frame_count) end_pfn = frame_count;
+    
+    while (pfn < end_pfn) {
+        // Biggest block that is aligned at "pfn" and still fits
+        u32 order = FRAME_MAX_ORDER;
+        
+        while (order > 0 && ((pfn & ((1u << order) - 1)) || pfn + (1u << order) > end_pfn))
+            order--;
+        
+        free_block(pfn, order);
+        
+        stats.total_frames += 1u << order;
+        stats.free_frames  += 1u << order;
+        
+        pfn += 1u << order;
+    }
+}
+
+u32 frame_order_for(u32 count) {
+    u32 order = 0;
+    
+    while ((1u << order) < count)
+        order++;
+    
+    return order;
+}
+
+// Smallest order >= "order" that has a free block
+static u32 frame_find_order(u32 order) {
+    while (order <= FRAME_MAX_ORDER && !free_lists[order])
+        order++;
+    
+    return order;
+}
+
+static void frame_zero_drain(void) {
+    while (stats.zero_pool) {
+        void* frame = zero_pool[--stats.zero_pool];
+        
+        stats.free_frames++;
+        free_block((u32)frame / FRAME_SIZE, 0);
+    }
+}
+
+static void* frame_alloc(u32 count) {
+    if (count == 0)
+        return nullptr;
+    
+    u32 order = frame_order_for(count);
+    
+    if (order > FRAME_MAX_ORDER) {
+        printf("alloc_frames: %d frames is bigger than the largest block\n", count);
+        return nullptr;
+    }
+    
+    u32 current = frame_find_order(order);
+    
+    // The zero pool is only a cache, it's given back before failing
+    if (current > FRAME_MAX_ORDER && stats.zero_pool) {
+        frame_zero_drain();
+        current = frame_find_order(order);
+    }
+    
+    if (current > FRAME_MAX_ORDER) {
+        printf("Out of memory! Needed %d frames, %d free\n", count, stats.free_frames);
+        return nullptr;
+    }
+    
+    FreeBlock* block = free_lists[current];
+    u32 pfn = block_to_pfn(block);
+    
+    list_remove(current, block);
+    
+    // Split down to the requested size, the upper halves go back to the free lists
+    while (current > order) {
+        current--;
+        
+        u32 buddy = pfn + (1u << current);
+        frame_state[buddy] = FRAME_FREE | current;
+        list_push(current, buddy);
+        
+        stats.splits++;
+    }
+    
+    frame_state[pfn] = 0;
+    
+    stats.free_frames -= 1u << order;
+    stats.allocations++;
+    
+    return pfn_to_block(pfn);
+}
+
+void* alloc_frames(u32 count) {
+    void* frames = frame_alloc(count);
+    
+    TRACE_ALLOC(TRACE_FRAMES, TRACE_CALLER(), frames, count * FRAME_SIZE,
+                FRAME_SIZE << frame_order_for(count));
+    
+    return frames;
+}
+
+void free_frames(void* addr, u32 count) {
+    u32 pfn = (u32)addr / FRAME_SIZE;
+    u32 order = frame_order_for(count);
+    
+    if (!addr || ((u32)addr & (FRAME_SIZE - 1))) {
+        printf("free_frames: bad address %x\n", addr);
+        return;
+    }
+    
+    if (pfn < frame_first || pfn + (1u << order) > frame_count) {
+        printf("free_frames: %x is not managed by the allocator\n", addr);
+        return;
+    }
+    
+    if (frame_state[pfn] & FRAME_FREE) {
+        printf("free_frames: double free of %x\n", addr);
+        return;
+    }
+    
+    stats.free_frames += 1u << order;
+    stats.frees++;
+    
+    TRACE_FREE(TRACE_FRAMES, addr);
+    
+    free_block(pfn, order);
+}
+
+void* alloc_zeroed_frame(void) {
+    void* frame;
+    
+    if (stats.zero_pool) {
+        frame = zero_pool[--stats.zero_pool];
+        stats.zero_hits++;
+    } else {
+        frame = frame_alloc(1);
+        
+        if (frame) {
+            memset(frame, 0, FRAME_SIZE);
+            stats.zero_misses++;
+        }
+    }
+    
+    TRACE_ALLOC(TRACE_FRAMES, TRACE_CALLER(), frame, FRAME_SIZE, FRAME_SIZE);
+    
+    return frame;
+}
+
+void free_zeroed_frame(void* addr) {
+    if (stats.zero_pool < FRAME_ZERO_POOL_SIZE) {
+        TRACE_FREE(TRACE_FRAMES, addr);
+        
+        zero_pool[stats.zero_pool++] = addr;
+        return;
+    }
+    
+    free_frames(addr, 1);
+}
+
+u32 frame_zero_refill(u32 max) {
+    u32 zeroed = 0;
+    
+    while (zeroed < max && stats.zero_pool < FRAME_ZERO_POOL_SIZE &&
+           stats.free_frames > FRAME_ZERO_RESERVE) {
+        void* frame = frame_alloc(1);
+        
+        if (!frame)
+            break;
+        
+        memset(frame, 0, FRAME_SIZE);
+        zero_pool[stats.zero_pool++] = frame;
+        
+        zeroed++;
+    }
+    
+    stats.zero_refills += zeroed;
+    
+    return zeroed;
+}
+
+u32 frame_largest_free(void) {
+    for (s32 order = FRAME_MAX_ORDER; order >= 0; order--) {
+        if (free_lists[order])
+            return 1u << order;
+    }
+    
+    return 0;
+}
+
+const FrameStats* frame_stats(void) {
+    return &stats;
+}
+
+void frame_dump(void) {
+    printf("Frames: %d free / %d total (%d KB free)\n",
+           stats.free_frames, stats.total_frames, stats.free_frames * (FRAME_SIZE / 1024));
+    printf("  allocs=%d frees=%d splits=%d merges=%d\n",
+           stats.allocations, stats.frees, stats.splits, stats.merges);
+    
+    for (u32 i = 0; i <= FRAME_MAX_ORDER; i++) {
+        if (free_blocks[i])
+            printf("  order %d (%d KB): %d blocks\n", i, (FRAME_SIZE << i) / 1024, free_blocks[i]);
+    }
+    
+    printf("  zero pool: %d/%d frames, hits=%d misses=%d refilled=%d\n",
+           stats.zero_pool, FRAME_ZERO_POOL_SIZE, stats.zero_hits, stats.zero_misses, stats.zero_refills);
+}
@@ -0,0 +1,106 @@
+﻿#ifndef FRAME_H
+#define FRAME_H
+
+#include "../io.h"
+
+/**
+ * Physical page frame allocator.
+ *
+ * A binary buddy allocator, blocks go from one 4 KiB frame (order 0),
+ * up to 1024 frames (order 10, 4 MiB). Free blocks are kept in a list
+ * per order, and the list links are stored inside of the free frames,
+ * so the only bookkeeping outside of them is one byte per frame.
+ *
+ * Allocation and freeing are both O(log n), (at most FRAME_MAX_ORDER splits/merges).
+ *
+ * NOTE; Everything here relies on the frames being identity mapped,
+ * the returned pointer is also the physical address.
+ */
+
+#define FRAME_SIZE      4096
+#define FRAME_MAX_ORDER 10
+
+// Per-frame state byte
+#define FRAME_FREE      0x80 // Frame is the first frame of a free block
+#define FRAME_ORDER     0x0F // Order of the block (only valid if FRAME_FREE is set)
+
+/**
+ * Pre-zeroed frames for page tables and zero fill faults,
+ * refilled a few at a time from the idle loop (frame_zero_refill).
+ * Frames in the pool count as allocated.
+ */
+#define FRAME_ZERO_POOL_SIZE 64
+#define FRAME_ZERO_BATCH     8   // Frames zeroed per refill call
+#define FRAME_ZERO_RESERVE   256 // Never refill below this many free frames
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+    struct FreeBlock* prev;
+} FreeBlock;
+
+typedef struct {
+    u32 total_frames;   // Frames handed to the allocator
+    u32 free_frames;    // Frames currently free
+    u32 allocations;
+    u32 frees;
+    u32 splits;
+    u32 merges;
+    
+    u32 zero_pool;      // Frames currently in the zero pool
+    u32 zero_hits;      // Zeroed frames handed out from the pool
+    u32 zero_misses;    // Pool was empty, zeroed on the spot
+    u32 zero_refills;   // Frames zeroed in the background
+} FrameStats;
+
+/**
+ * Sets up the bookkeeping for frames in [0, mem_end).
+ * The frame state array is placed at MEM_BUFFER_BASE,
+ * no memory is free until frame_add_region is called.
+ */
+void frame_init(u32 mem_end);
+
+/**
+ * Gives [start, end) to the allocator.
+ * Anything below the end of the frame state array is skipped.
+ */
+void frame_add_region(u32 start, u32 end);
+
+/**
+ * Allocates "count" physically contiguous frames,
+ * aligned to the block size (count rounded up to a power of two).
+ *
+ * Returns nullptr if there's no block big enough.
+ */
+void* alloc_frames(u32 count);
+
+/**
+ * Frees frames returned by alloc_frames,
+ * "count" must be the same value that was passed to alloc_frames.
+ */
+void free_frames(void* addr, u32 count);
+
+/**
+ * One zeroed frame, from the zero pool if it has any.
+ */
+void* alloc_zeroed_frame(void);
+
+/**
+ * Gives back a frame that is still all zeros (i.e. an emptied page table),
+ * it goes straight back into the zero pool if there's room.
+ */
+void free_zeroed_frame(void* addr);
+
+/**
+ * Zeroes up to "max" frames into the pool, returns how many.
+ * Meant for the idle loop.
+ */
+u32 frame_zero_refill(u32 max);
+
+u32 frame_order_for(u32 count);
+const FrameStats* frame_stats(void);
+
+// Frames in the biggest free block
+u32 frame_largest_free(void);
+void frame_dump(void);
+
+#endif // FRAME_H
@@ -0,0 +1,168 @@
+﻿#include "lazy.h"
+
+#include "frame.h"
+#include "slab.h"
+#include "../serial/serial.h"
+
+#define PF_PRESENT 0x1 // Page fault error code, set for protection faults
+
+static LazyStats stats;
+
+static LazyRegion* lazy_find(Pager* pager, u32 addr) {
+    for (LazyRegion* region = pager->lazy_regions; region; region = region->next) {
+        if (addr >= region->start && addr < region->end)
+            return region;
+    }
+    
+    return nullptr;
+}
+
+void* lazy_alloc(Pager* pager, u32 size, u32 flags, lazy_fill_t fill, void* ctx) {
+    if (size == 0) return nullptr;
+    
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    
+    // The kernel's regions have to be mapped in every address space
+    u8 shared = pager == pager_kernel();
+    u32 end = shared ? LAZY_PRIVATE_BASE : LAZY_END;
+    
+    // First fit, regions are kept sorted by address.
+    // A guard page is left after every region so overruns fault instead of spilling over
+    u32 start = shared ? LAZY_BASE : LAZY_PRIVATE_BASE;
+    LazyRegion** link = &pager->lazy_regions;
+    
+    while (*link) {
+        if (start + size + PAGE_SIZE <= (*link)->start)
+            break;
+        
+        start = (*link)->end + PAGE_SIZE;
+        link = &(*link)->next;
+    }
+    
+    if (start + size > end || start + size < start) {
+        printf("lazy_alloc: no room for %d bytes\n", size);
+        return nullptr;
+    }
+    
+    LazyRegion* region = (LazyRegion*)kmalloc(sizeof(LazyRegion));
+    
+    if (!region)
+        return nullptr;
+    
+    region->start = start;
+    region->end = start + size;
+    region->flags = flags | PAGE_PRESENT;
+    region->fill = fill;
+    region->ctx = ctx;
+    region->resident = 0;
+    
+    region->next = *link;
+    *link = region;
+    
+    return (void*)start;
+}
+
+static void lazy_release(Pager* pager, LazyRegion* region) {
+    if (region->resident) {
+        for (u32 addr = region->start; addr < region->end; addr += PAGE_SIZE) {
+            u32 phys = pager_translate(pager, addr);
+            
+            if (phys) {
+                free_frames((void*)(phys & ~(PAGE_SIZE - 1)), 1);
+                stats.resident--;
+            }
+        }
+        
+        // Also frees the page tables the region used
+        pager_unmap_range(pager, region->start, region->end - region->start);
+    }
+    
+    kfree(region);
+}
+
+void lazy_free(Pager* pager, void* addr) {
+    LazyRegion** link = &pager->lazy_regions;
+    
+    while (*link) {
+        LazyRegion* region = *link;
+        
+        if (region->start == (u32)addr) {
+            *link = region->next;
+            lazy_release(pager, region);
+            
+            return;
+        }
+        
+        link = &region->next;
+    }
+    
+    printf("lazy_free: %x isn't a lazy region\n", addr);
+}
+
+u8 lazy_handle_fault(Pager* pager, u32 fault_addr, u32 err_code) {
+    // Only the kernel pager has regions there, whatever space is active
+    if (fault_addr >= LAZY_BASE && fault_addr < LAZY_PRIVATE_BASE)
+        pager = pager_kernel();
+    
+    if (!pager || (err_code & PF_PRESENT))
+        return 0;
+    
+    LazyRegion* region = lazy_find(pager, fault_addr);
+    
+    if (!region)
+        return 0;
+    
+    u32 page = fault_addr & ~(PAGE_SIZE - 1);
+    
+    // Zero fill pages take a frame that the idle loop already cleared
+    void* frame = region->fill ? alloc_frames(1) : alloc_zeroed_frame();
+    
+    if (!frame) {
+        stats.failed++;
+        return 0;
+    }
+    
+    u8 ok = 1;
+    
+    if (region->fill)
+        ok = region->fill(region, page, frame);
+    
+    if (!ok) {
+        free_frames(frame, 1);
+        stats.failed++;
+        
+        return 0;
+    }
+    
+    pager_map_page(pager, page, (u32)frame, region->flags);
+    
+    region->resident++;
+    
+    stats.faults++;
+    stats.resident++;
+    
+    return 1;
+}
+
+void lazy_destroy_all(Pager* pager) {
+    while (pager->lazy_regions) {
+        LazyRegion* region = pager->lazy_regions;
+        pager->lazy_regions = region->next;
+        
+        lazy_release(pager, region);
+    }
+}
+
+const LazyStats* lazy_stats(void) {
+    return &stats;
+}
+
+void lazy_dump(Pager* pager) {
+    printf("Lazy regions: faults=%d failed=%d resident=%d pages\n",
+           stats.faults, stats.failed, stats.resident);
+    
+    for (LazyRegion* region = pager->lazy_regions; region; region = region->next) {
+        printf("  %x-%x: %d/%d pages resident\n", region->start, region->end,
+               region->resident, (region->end - region->start) / PAGE_SIZE);
+    }
+}
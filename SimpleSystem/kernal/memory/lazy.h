@@ -0,0 +1,72 @@
+﻿#ifndef LAZY_H
+#define LAZY_H
+
+#include "paging.h"
+
+/**
+ * Demand paged regions.
+ *
+ * A lazy region only reserves virtual addresses, the frames behind it are
+ * allocated by the page fault handler the first time a page is touched.
+ * By default a new page is zero filled, a region can also have a "fill"
+ * callback that loads the page contents (i.e. from a file) instead.
+ */
+
+// Virtual addresses handed out for lazy regions (above any identity mapped RAM).
+// Regions of an address space live in its private part, the kernel pager's own
+// regions are used from every space, so they get the shared 512 MiB below it
+#define LAZY_BASE         (SPACE_PRIVATE_START - 0x20000000)
+#define LAZY_PRIVATE_BASE SPACE_PRIVATE_START
+#define LAZY_END          SPACE_PRIVATE_END
+
+struct LazyRegion;
+
+/**
+ * Fills "frame" (identity mapped, PAGE_SIZE bytes) with the
+ * contents of the page at "page_addr", returns 0 on failure.
+ */
+typedef u8 (*lazy_fill_t)(struct LazyRegion* region, u32 page_addr, void* frame);
+
+typedef struct LazyRegion {
+    u32 start;
+    u32 end;
+    u32 flags;
+    
+    lazy_fill_t fill; // nullptr means zero fill
+    void* ctx;
+    
+    u32 resident;     // Pages that have been faulted in
+    
+    struct LazyRegion* next;
+} LazyRegion;
+
+typedef struct {
+    u32 faults;       // Not present faults resolved
+    u32 failed;       // Faults inside of a region that couldn't be resolved
+    u32 resident;     // Frames currently backing lazy pages
+} LazyStats;
+
+/**
+ * Reserves "size" bytes of virtual memory in the lazy area (the shared part for
+ * the kernel pager), returns the start address or nullptr if there's no hole big enough.
+ */
+void* lazy_alloc(Pager* pager, u32 size, u32 flags, lazy_fill_t fill, void* ctx);
+
+/**
+ * Unmaps a region from lazy_alloc and frees every frame that was faulted in.
+ */
+void lazy_free(Pager* pager, void* addr);
+
+/**
+ * Called from the page fault handler with the active pager, faults in the shared
+ * part are looked up in the kernel pager instead.
+ * Returns 1 if the fault was resolved and the instruction can be retried.
+ */
+u8 lazy_handle_fault(Pager* pager, u32 fault_addr, u32 err_code);
+
+void lazy_destroy_all(Pager* pager);
+
+const LazyStats* lazy_stats(void);
+void lazy_dump(Pager* pager);
+
+#endif // LAZY_H
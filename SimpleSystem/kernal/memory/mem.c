@@ -0,0 +1,232 @@
+﻿#include "mem.h"
+
+#include "../cpu/cpu.h"
+#include "../serial/serial.h"
+
+/**
+ * Block functions, "dst" is 16 byte aligned and
+ * "blocks" is the number of 64 byte blocks (at least 1).
+ */
+typedef void (*mem_set_blocks_t)(u8* dst, u32 fill, u32 blocks);
+typedef void (*mem_copy_blocks_t)(u8* dst, const u8* src, u32 blocks);
+
+/**
+ * NOTE; The kernel isn't compiled with SSE, so the compiler never keeps
+ * anything in the XMM registers (and doesn't allow them as clobbers),
+ * the SSE functions below use them freely.
+ */
+
+static inline void rep_set(u8* dst, u32 fill, u32 num) {
+    u32 dwords = num / 4;
+    u32 bytes = num & 3;
+    
+    asm volatile("rep stosl" : "+D"(dst), "+c"(dwords) : "a"(fill) : "memory");
+    asm volatile("rep stosb" : "+D"(dst), "+c"(bytes) : "a"(fill) : "memory");
+}
+
+static inline void rep_copy(u8* dst, const u8* src, u32 num) {
+    u32 dwords = num / 4;
+    u32 bytes = num & 3;
+    
+    asm volatile("rep movsl" : "+D"(dst), "+S"(src), "+c"(dwords) :: "memory");
+    asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(bytes) :: "memory");
+}
+
+static void set_blocks_rep(u8* dst, u32 fill, u32 blocks) {
+    rep_set(dst, fill, blocks * MEM_BLOCK_SIZE);
+}
+
+static void copy_blocks_rep(u8* dst, const u8* src, u32 blocks) {
+    rep_copy(dst, src, blocks * MEM_BLOCK_SIZE);
+}
+
+static void set_blocks_sse2(u8* dst, u32 fill, u32 blocks) {
+    asm volatile("movd %2, %%xmm0\n\t"
+                 "pshufd $0, %%xmm0, %%xmm0\n\t"
+                 "1:\n\t"
+                 "movdqa %%xmm0, (%0)\n\t"
+                 "movdqa %%xmm0, 16(%0)\n\t"
+                 "movdqa %%xmm0, 32(%0)\n\t"
+                 "movdqa %%xmm0, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b"
+                 : "+r"(dst), "+r"(blocks) : "r"(fill) : "memory");
+}
+
+static void set_blocks_stream(u8* dst, u32 fill, u32 blocks) {
+    asm volatile("movd %2, %%xmm0\n\t"
+                 "pshufd $0, %%xmm0, %%xmm0\n\t"
+                 "1:\n\t"
+                 "movntdq %%xmm0, (%0)\n\t"
+                 "movntdq %%xmm0, 16(%0)\n\t"
+                 "movntdq %%xmm0, 32(%0)\n\t"
+                 "movntdq %%xmm0, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b\n\t"
+                 "sfence" // Non-temporal stores are weakly ordered
+                 : "+r"(dst), "+r"(blocks) : "r"(fill) : "memory");
+}
+
+static void copy_blocks_sse2(u8* dst, const u8* src, u32 blocks) {
+    asm volatile("1:\n\t"
+                 "movdqu (%1), %%xmm0\n\t"
+                 "movdqu 16(%1), %%xmm1\n\t"
+                 "movdqu 32(%1), %%xmm2\n\t"
+                 "movdqu 48(%1), %%xmm3\n\t"
+                 "movdqa %%xmm0, (%0)\n\t"
+                 "movdqa %%xmm1, 16(%0)\n\t"
+                 "movdqa %%xmm2, 32(%0)\n\t"
+                 "movdqa %%xmm3, 48(%0)\n\t"
+                 "add $64, %1\n\t"
+                 "add $64, %0\n\t"
+                 "dec %2\n\t"
+                 "jnz 1b"
+                 : "+r"(dst), "+r"(src), "+r"(blocks) :: "memory");
+}
+
+static void copy_blocks_stream(u8* dst, const u8* src, u32 blocks) {
+    asm volatile("1:\n\t"
+                 "prefetchnta 512(%1)\n\t"
+                 "movdqu (%1), %%xmm0\n\t"
+                 "movdqu 16(%1), %%xmm1\n\t"
+                 "movdqu 32(%1), %%xmm2\n\t"
+                 "movdqu 48(%1), %%xmm3\n\t"
+                 "movntdq %%xmm0, (%0)\n\t"
+                 "movntdq %%xmm1, 16(%0)\n\t"
+                 "movntdq %%xmm2, 32(%0)\n\t"
+                 "movntdq %%xmm3, 48(%0)\n\t"
+                 "add $64, %1\n\t"
+                 "add $64, %0\n\t"
+                 "dec %2\n\t"
+                 "jnz 1b\n\t"
+                 "sfence"
+                 : "+r"(dst), "+r"(src), "+r"(blocks) :: "memory");
+}
+
+// rep until mem_init, memset is used before SSE is enabled
+static mem_set_blocks_t set_blocks = set_blocks_rep;
+static mem_set_blocks_t set_blocks_big = set_blocks_rep;
+static mem_copy_blocks_t copy_blocks = copy_blocks_rep;
+static mem_copy_blocks_t copy_blocks_big = copy_blocks_rep;
+
+static u32 stream_threshold = 0xFFFFFFFF;
+static const char* mem_mode = "rep";
+
+void mem_init(void) {
+    const CpuInfo* cpu = cpu_info();
+    
+    if (cpu->sse_enabled && cpu_has_edx(CPUID_EDX_SSE2)) {
+        set_blocks = set_blocks_sse2;
+        copy_blocks = copy_blocks_sse2;
+        
+        set_blocks_big = set_blocks_stream;
+        copy_blocks_big = copy_blocks_stream;
+        
+        stream_threshold = cpu->l2_kb ? cpu->l2_kb * 1024 / 2 : MEM_STREAM_DEFAULT;
+        
+        if (stream_threshold < MEM_STREAM_MIN)
+            stream_threshold = MEM_STREAM_MIN;
+        
+        mem_mode = "sse2";
+    }
+    
+    mem_dump();
+}
+
+void mem_dump(void) {
+    printf("Memory functions: %s, blocks from %d bytes", mem_mode, MEM_BLOCK_THRESHOLD);
+    
+    if (stream_threshold != 0xFFFFFFFF)
+        printf(", non-temporal from %d KB", stream_threshold / 1024);
+    
+    printf("\n");
+}
+
+void* memset(void* ptr, int value, size_t num) {
+    u8* dst = (u8*)ptr;
+    u32 fill = (u8)value * 0x01010101;
+    
+    if (num >= MEM_BLOCK_THRESHOLD) {
+        u32 head = -(u32)dst & 15;
+        
+        rep_set(dst, fill, head);
+        dst += head;
+        num -= head;
+        
+        u32 blocks = num / MEM_BLOCK_SIZE;
+        
+        if (num >= stream_threshold)
+            set_blocks_big(dst, fill, blocks);
+        else
+            set_blocks(dst, fill, blocks);
+        
+        dst += blocks * MEM_BLOCK_SIZE;
+        num -= blocks * MEM_BLOCK_SIZE;
+    }
+    
+    rep_set(dst, fill, num);
+    
+    return ptr;
+}
+
+void* memcpy(void* dest, const void* src, size_t num) {
+    u8* dst = (u8*)dest;
+    const u8* s = (const u8*)src;
+    
+    if (num >= MEM_BLOCK_THRESHOLD) {
+        // Only the stores get aligned, the loads are movdqu
+        u32 head = -(u32)dst & 15;
+        
+        rep_copy(dst, s, head);
+        dst += head;
+        s += head;
+        num -= head;
+        
+        u32 blocks = num / MEM_BLOCK_SIZE;
+        
+        if (num >= stream_threshold)
+            copy_blocks_big(dst, s, blocks);
+        else
+            copy_blocks(dst, s, blocks);
+        
+        dst += blocks * MEM_BLOCK_SIZE;
+        s += blocks * MEM_BLOCK_SIZE;
+        num -= blocks * MEM_BLOCK_SIZE;
+    }
+    
+    rep_copy(dst, s, num);
+    
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t num) {
+    u8* dst = (u8*)dest;
+    const u8* s = (const u8*)src;
+    
+    /**
+     * Copying forwards is fine unless "dst" starts inside of "src",
+     * the block functions load a whole block before storing it.
+     */
+    if (dst <= s || dst >= s + num)
+        return memcpy(dest, src, num);
+    
+    // Backwards from the end, the trailing bytes first and then dwords
+    u8* d = dst + num - 1;
+    s += num - 1;
+    
+    u32 bytes = num & 3;
+    u32 dwords = num / 4;
+    
+    asm volatile("std\n\t"
+                 "rep movsb\n\t"
+                 "sub $3, %%edi\n\t"
+                 "sub $3, %%esi\n\t"
+                 "mov %3, %%ecx\n\t"
+                 "rep movsl\n\t"
+                 "cld"
+                 : "+D"(d), "+S"(s), "+c"(bytes) : "r"(dwords) : "memory");
+    
+    return dest;
+}
@@ -0,0 +1,28 @@
+﻿#ifndef MEM_H
+#define MEM_H
+
+#include "../io.h"
+
+/**
+ * memset/memcpy/memmove (prototypes are in io.h).
+ *
+ * Anything under MEM_BLOCK_THRESHOLD is done with rep stos/movs.
+ * Bigger sizes are aligned to 16 bytes and done in 64 byte blocks
+ * by whatever mem_init picked for the CPU (SSE2 if it has it).
+ * Past the streaming threshold (half of the L2) the blocks are written
+ * with non-temporal stores, so one big copy doesn't evict the whole cache.
+ */
+
+#define MEM_BLOCK_THRESHOLD   256
+#define MEM_BLOCK_SIZE        64
+
+// Used if the CPU doesn't report its L2 size
+#define MEM_STREAM_DEFAULT    (256 * 1024)
+#define MEM_STREAM_MIN        (64 * 1024)
+
+// Picks the block functions, cpu_init has to run first for SSE
+void mem_init(void);
+
+void mem_dump(void);
+
+#endif // MEM_H
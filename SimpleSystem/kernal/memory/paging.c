@@ -1,10 +1,63 @@
 ﻿#include "paging.h"
 
+#include "lazy.h"
+#include "slab.h"
 #include "../io.h"
+#include "../cpu/cpu.h"
 #include "../serial/serial.h"
 
+// Page directories and page tables are both one zeroed frame, from the zero pool
+static KmemCache* page_table_cache = nullptr;
+
+static Pager* active_pager = nullptr;
+
+static Pager* kernel_pager = nullptr;
+static Pager* spaces = nullptr;  // Every pager other than the kernel's
+static u8 global_pages = 0;      // CR4.PGE is set
+
+static inline u8 pager_private(u32 virt_addr) {
+    return virt_addr >= SPACE_PRIVATE_START && virt_addr < SPACE_PRIVATE_END;
+}
+
+/**
+ * Kernel addresses always go through the kernel pager,
+ * whatever address space they were mapped from.
+ */
+static inline Pager* pager_owner(Pager* pager, u32 virt_addr) {
+    if (kernel_pager && !pager_private(virt_addr))
+        return kernel_pager;
+    
+    return pager;
+}
+
+// Kernel mappings are global, so a CR3 switch keeps them in the TLB
+static inline u32 pager_leaf_flags(Pager* pager, u32 virt_addr, u32 flags) {
+    if (pager == kernel_pager && !pager_private(virt_addr))
+        flags |= PAGE_GLOBAL;
+    
+    return flags;
+}
+
+/**
+ * Every change to a kernel PDE is copied into the other address spaces,
+ * the page tables behind them are shared.
+ */
+static void pager_set_pde(Pager* pager, u32 pdi, u32 pde) {
+    pager->page_directory[pdi] = pde;
+    
+    if (pager != kernel_pager || pager_private(pdi << 22))
+        return;
+    
+    for (Pager* space = spaces; space; space = space->next) {
+        space->page_directory[pdi] = pde;
+    }
+}
+
 Pager* pager_create(void) {
-    Pager* pager = (Pager*)memalign(4, sizeof(Pager)); // 4-byte aligned
+    if (!page_table_cache)
+        page_table_cache = kmem_cache_create_zeroed("page_table");
+    
+    Pager* pager = (Pager*)kmalloc(sizeof(Pager));
     
     if (!pager) {
         printf("Pager creation failed");
@@ -12,7 +65,7 @@ Pager* pager_create(void) {
         return 0;
     }
     
-    pager->page_directory = (u32*)memalign(PAGE_SIZE, PAGE_ENTRIES * sizeof(u32));
+    pager->page_directory = (u32*)kmem_cache_zalloc(page_table_cache);
     
     if (!pager->page_directory) {
         printf("Pager directory creation failed");
@@ -20,33 +73,233 @@ Pager* pager_create(void) {
         return 0;
     }
     
-    memset(pager->page_directory, 0, PAGE_ENTRIES * sizeof(u32));
-    
     // Initialize table tracking
     memset(pager->tables_allocated, 0, sizeof(pager->tables_allocated));
     pager->paging_active = 0;
+    pager->lazy_regions = nullptr;
+    pager->next = nullptr;
+    
+    if (!kernel_pager) {
+        kernel_pager = pager;
+        return pager;
+    }
+    
+    // Share the kernel half
+    for (u32 i = 0; i < PAGE_ENTRIES; i++) {
+        if (!pager_private(i << 22))
+            pager->page_directory[i] = kernel_pager->page_directory[i];
+    }
+    
+    pager->next = spaces;
+    spaces = pager;
     
     return pager;
 }
 
+void tlb_gather_init(TlbGather* tlb, Pager* pager) {
+    tlb->pager = pager;
+    tlb->count = 0;
+    tlb->full = 0;
+    tlb->global = 0;
+    tlb->tables = nullptr;
+}
+
+void tlb_gather_add(TlbGather* tlb, u32 virt_addr) {
+    if (!pager_private(virt_addr))
+        tlb->global = 1;
+    
+    if (tlb->full) return;
+    
+    if (tlb->count == TLB_FLUSH_THRESHOLD) {
+        // Past this point reloading CR3 once is cheaper than more invlpgs
+        tlb->full = 1;
+        return;
+    }
+    
+    tlb->pages[tlb->count++] = virt_addr;
+}
+
+/**
+ * Page tables that got emptied can only be reused once nothing,
+ * (TLB or paging structure caches) can still point at them,
+ * so they are freed (and cleared) after the flush.
+ */
+static void tlb_gather_free_table(TlbGather* tlb, u32* table) {
+    *(void**)table = tlb->tables;
+    tlb->tables = table;
+}
+
+void tlb_gather_finish(TlbGather* tlb) {
+    // Kernel mappings are in every address space, private ones only in their own
+    u8 loaded = tlb->pager->paging_active || (tlb->global && active_pager);
+    
+    if (loaded) {
+        if (tlb->full || tlb->tables) {
+            if (tlb->global)
+                pager_flush_global();
+            else
+                pager_flush_all(tlb->pager);
+        } else {
+            for (u32 i = 0; i < tlb->count; i++) {
+                asm volatile("invlpg (%0)" ::"r"(tlb->pages[i]) : "memory");
+            }
+        }
+    }
+    
+    while (tlb->tables) {
+        void* table = tlb->tables;
+        tlb->tables = *(void**)table;
+        
+        // A table replaced by a 4 MiB page still has its entries, the cache only takes zeroed frames
+        memset(table, 0, PAGE_SIZE);
+        kmem_cache_free(page_table_cache, table);
+    }
+    
+    tlb->count = 0;
+    tlb->full = 0;
+    tlb->global = 0;
+}
+
+void pager_flush_all(Pager* pager) {
+    if (!pager->paging_active) return;
+    
+    u32 cr3;
+    asm volatile("mov %%cr3, %0\n\t"
+                 "mov %0, %%cr3" : "=r"(cr3) :: "memory");
+}
+
+void pager_flush_global(void) {
+    if (!active_pager) return;
+    
+    // Without PGE nothing is global, a CR3 reload is enough
+    if (!global_pages) {
+        pager_flush_all(active_pager);
+        return;
+    }
+    
+    u32 cr4;
+    asm volatile("mov %%cr4, %0\n\t"
+                 "and $~0x80, %0\n\t"
+                 "mov %0, %%cr4\n\t"
+                 "or $0x80, %0\n\t"
+                 "mov %0, %%cr4" : "=r"(cr4) :: "memory");
+}
+
+static void pager_map_large_gather(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags, TlbGather* tlb);
+static void pager_map_page_gather(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags, TlbGather* tlb);
+
 void pager_map_range(Pager* pager, u32 virt_start, u32 phys_start, u32 size, u32 flags) {
     u32 virt_end = virt_start + size;
     u32 aligned_start = virt_start & ~(PAGE_SIZE-1);
     u32 aligned_end = (virt_end + PAGE_SIZE-1) & ~(PAGE_SIZE-1);
     
-    for (u32 virt = aligned_start; virt < aligned_end; virt += PAGE_SIZE) {
+    TlbGather tlb;
+    tlb_gather_init(&tlb, pager);
+    
+    u32 virt = aligned_start;
+    
+    while (virt < aligned_end) {
         u32 phys = phys_start + (virt - virt_start);
         
-        pager_map_page(pager, virt, phys, flags);
+        // Whole 4 MiB chunks with matching alignment get a single PDE
+        if (!(virt & LARGE_PAGE_MASK) && !(phys & LARGE_PAGE_MASK) &&
+            aligned_end - virt >= LARGE_PAGE_SIZE) {
+            pager_map_large_gather(pager, virt, phys, flags, &tlb);
+            
+            virt += LARGE_PAGE_SIZE;
+            
+            // Wrapped around the top of the address space
+            if (virt == 0) break;
+            
+            continue;
+        }
+        
+        pager_map_page_gather(pager, virt, phys, flags, &tlb);
+        virt += PAGE_SIZE;
     }
+    
+    tlb_gather_finish(&tlb);
 }
 
-void pager_map_page(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags) {
+static void pager_map_large_gather(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags, TlbGather* tlb) {
+    u32 pdi = virt_addr >> 22;
+    
+    pager = pager_owner(pager, virt_addr);
+    flags = pager_leaf_flags(pager, virt_addr, flags);
+    
+    // The whole table gets replaced, so it isn't needed anymore
+    if (pager->tables_allocated[pdi]) {
+        tlb_gather_free_table(tlb, pager->page_tables[pdi]);
+        
+        pager->page_tables[pdi] = nullptr;
+        pager->tables_allocated[pdi] = 0;
+    }
+    
+    u32 old = pager->page_directory[pdi];
+    
+    pager_set_pde(pager, pdi, (phys_addr & ~LARGE_PAGE_MASK) | (flags & 0xFFF & ~PAGE_PAT) |
+                              PAGE_LARGE | PAGE_PRESENT);
+    
+    if (old & PAGE_PRESENT)
+        tlb_gather_add(tlb, virt_addr);
+}
+
+void pager_map_large(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags) {
+    TlbGather tlb;
+    tlb_gather_init(&tlb, pager);
+    
+    pager_map_large_gather(pager, virt_addr, phys_addr, flags, &tlb);
+    
+    tlb_gather_finish(&tlb);
+}
+
+/**
+ * Turns a 4 MiB mapping back into a page table with the same 1024 mappings,
+ * so a part of it can get different flags.
+ */
+static u32* pager_split_large(Pager* pager, u32 pdi, TlbGather* tlb) {
+    u32 pde = pager->page_directory[pdi];
+    u32* pt = (u32*)kmem_cache_alloc(page_table_cache);
+    
+    if (!pt) {
+        printf("Couldn't split the 4 MiB page at %x\n", pdi << 22);
+        
+        while(1);
+        
+        return nullptr;
+    }
+    
+    u32 base = pde & ~LARGE_PAGE_MASK;
+    u32 flags = pde & 0xFFF & ~PAGE_LARGE;
+    
+    for (u32 i = 0; i < PAGE_ENTRIES; i++) {
+        pt[i] = (base + i * PAGE_SIZE) | flags;
+    }
+    
+    pager->page_tables[pdi] = pt;
+    pager->tables_allocated[pdi] = 1;
+    
+    pager_set_pde(pager, pdi, (u32)pt | PAGE_PRESENT | PAGE_WRITE);
+    
+    // One invlpg drops the whole 4 MiB TLB entry
+    tlb_gather_add(tlb, pdi << 22);
+    
+    return pt;
+}
+
+static void pager_map_page_gather(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags, TlbGather* tlb) {
     u32 pdi = virt_addr >> 22;           // Page directory index
     u32 pti = (virt_addr >> 12) & 0x3FF; // Page table index
     
+    pager = pager_owner(pager, virt_addr);
+    flags = pager_leaf_flags(pager, virt_addr, flags);
+    
+    if (pager->page_directory[pdi] & PAGE_LARGE) {
+        pager_split_large(pager, pdi, tlb);
+    }
+    
     if (!pager->tables_allocated[pdi]) {
-        u32* pt = (u32*)memalign(PAGE_SIZE, PAGE_ENTRIES * sizeof(u32));
+        u32* pt = (u32*)kmem_cache_zalloc(page_table_cache);
         
         if (!pt) {
             printf("ERROR.. ;-;");
@@ -58,22 +311,147 @@ void pager_map_page(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags) {
         
         //printf("Page table allocated at: %x\n", pt);
         
-        memset(pt, 0, PAGE_ENTRIES * sizeof(u32));
         pager->page_tables[pdi] = pt;
         pager->tables_allocated[pdi] = 1;
         
         // Set directory entry
-        pager->page_directory[pdi] = (u32)pt | PAGE_PRESENT | PAGE_WRITE;
+        pager_set_pde(pager, pdi, (u32)pt | PAGE_PRESENT | PAGE_WRITE);
     }
     
     // Set page table entry
     u32* pt = pager->page_tables[pdi];
+    u32 old = pt[pti];
+    
     pt[pti] = (phys_addr & ~0xFFF) | (flags & 0xFFF) | PAGE_PRESENT;
     
-    // Flush TLB if paging active
-    if (pager->paging_active) {
-        asm volatile("invlpg (%0)" ::"r"(virt_addr) : "memory");
+    // Not present entries are never cached, so only a remap needs a flush
+    if (old & PAGE_PRESENT)
+        tlb_gather_add(tlb, virt_addr);
+}
+
+void pager_map_page(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags) {
+    TlbGather tlb;
+    tlb_gather_init(&tlb, pager);
+    
+    pager_map_page_gather(pager, virt_addr, phys_addr, flags, &tlb);
+    
+    tlb_gather_finish(&tlb);
+}
+
+static u8 pager_table_empty(u32* pt) {
+    for (u32 i = 0; i < PAGE_ENTRIES; i++) {
+        if (pt[i] & PAGE_PRESENT)
+            return 0;
+    }
+    
+    return 1;
+}
+
+/**
+ * Walks [virt_start, virt_start + size) and either clears the entries (unmap),
+ * or swaps their flags while keeping the physical address (protect).
+ */
+static void pager_update_range(Pager* space, u32 virt_start, u32 size, u8 unmap, u32 flags) {
+    u32 virt = virt_start & ~(PAGE_SIZE-1);
+    u32 end = (virt_start + size + PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+    
+    TlbGather tlb;
+    tlb_gather_init(&tlb, space);
+    
+    while (virt < end) {
+        Pager* pager = pager_owner(space, virt);
+        u32 leaf_flags = pager_leaf_flags(pager, virt, flags);
+        u32 pdi = virt >> 22;
+        u32 pde = pager->page_directory[pdi];
+        u32 chunk_end = (virt & ~LARGE_PAGE_MASK) + LARGE_PAGE_SIZE;
+        
+        // Range ends inside of this 4 MiB chunk
+        if (chunk_end == 0 || chunk_end > end) chunk_end = end;
+        
+        if (!(pde & PAGE_PRESENT)) {
+            virt = chunk_end;
+            continue;
+        }
+        
+        if (pde & PAGE_LARGE) {
+            if (!(virt & LARGE_PAGE_MASK) && chunk_end - virt == LARGE_PAGE_SIZE) {
+                // The whole large page is covered
+                if (unmap)
+                    pager_set_pde(pager, pdi, 0);
+                else
+                    pager_set_pde(pager, pdi, (pde & ~0xFFF) | (leaf_flags & 0xFFF & ~PAGE_PAT) | PAGE_LARGE | PAGE_PRESENT);
+                
+                tlb_gather_add(&tlb, virt);
+                
+                virt = chunk_end;
+                if (virt == 0) break;
+                
+                continue;
+            }
+            
+            pager_split_large(pager, pdi, &tlb);
+        }
+        
+        u32* pt = pager->page_tables[pdi];
+        
+        for (; virt < chunk_end; virt += PAGE_SIZE) {
+            u32 pti = (virt >> 12) & 0x3FF;
+            
+            if (!(pt[pti] & PAGE_PRESENT))
+                continue;
+            
+            if (unmap)
+                pt[pti] = 0;
+            else
+                pt[pti] = (pt[pti] & ~0xFFF) | (leaf_flags & 0xFFF) | PAGE_PRESENT;
+            
+            tlb_gather_add(&tlb, virt);
+        }
+        
+        // Empty tables go back to the cache once the TLB is clean
+        if (unmap && pager_table_empty(pt)) {
+            pager_set_pde(pager, pdi, 0);
+            pager->page_tables[pdi] = nullptr;
+            pager->tables_allocated[pdi] = 0;
+            
+            tlb_gather_free_table(&tlb, pt);
+        }
+        
+        if (virt == 0) break;
     }
+    
+    tlb_gather_finish(&tlb);
+}
+
+void pager_unmap_range(Pager* pager, u32 virt_start, u32 size) {
+    pager_update_range(pager, virt_start, size, 1, 0);
+}
+
+void pager_unmap_page(Pager* pager, u32 virt_addr) {
+    pager_update_range(pager, virt_addr, PAGE_SIZE, 1, 0);
+}
+
+void pager_protect_range(Pager* pager, u32 virt_start, u32 size, u32 flags) {
+    pager_update_range(pager, virt_start, size, 0, flags);
+}
+
+u32 pager_translate(Pager* pager, u32 virt_addr) {
+    pager = pager_owner(pager, virt_addr);
+    
+    u32 pde = pager->page_directory[virt_addr >> 22];
+    
+    if (!(pde & PAGE_PRESENT))
+        return 0;
+    
+    if (pde & PAGE_LARGE)
+        return (pde & ~LARGE_PAGE_MASK) | (virt_addr & LARGE_PAGE_MASK);
+    
+    u32 pte = pager->page_tables[virt_addr >> 22][(virt_addr >> 12) & 0x3FF];
+    
+    if (!(pte & PAGE_PRESENT))
+        return 0;
+    
+    return (pte & ~0xFFF) | (virt_addr & 0xFFF);
 }
 
 void pager_identity_map(Pager* pager, u32 phys_start, u32 size, u32 flags) {
@@ -100,6 +478,15 @@ void pager_enable(Pager* pager) {
                  "or $0x00000010, %%eax\n\t"  // PSE bit
                  "mov %%eax, %%cr4" ::: "eax");
     
+    // Enable global pages (bit 7 in CR4) if the CPU has them
+    if (cpu_has_edx(CPUID_EDX_PGE)) {
+        asm volatile("mov %%cr4, %%eax\n\t"
+                     "or $0x00000080, %%eax\n\t"  // PGE bit
+                     "mov %%eax, %%cr4" ::: "eax");
+        
+        global_pages = 1;
+    }
+    
     asm volatile(
         "mov %%cr0, %0\n\t"
         "or $0x80000000, %0\n\t"
@@ -112,9 +499,73 @@ void pager_enable(Pager* pager) {
     );
     
     pager->paging_active = 1;
+    active_pager = pager;
+}
+
+void pager_switch(Pager* pager) {
+    if (!active_pager) {
+        printf("pager_switch: paging isn't enabled\n");
+        return;
+    }
+    
+    if (pager == active_pager) return;
+    
+    // Global (kernel) TLB entries survive this
+    asm volatile("mov %0, %%cr3" :: "r"(pager->page_directory) : "memory");
+    
+    active_pager->paging_active = 0;
+    pager->paging_active = 1;
+    active_pager = pager;
+}
+
+Pager* pager_active(void) {
+    return active_pager;
+}
+
+Pager* pager_kernel(void) {
+    return kernel_pager;
 }
 
 void pager_destroy(Pager* pager) {
-    // TODO; free memory here
-    if (pager) pager->paging_active = 0;
+    if (!pager) return;
+    
+    if (pager->paging_active) {
+        printf("Can't destroy the active pager\n");
+        return;
+    }
+    
+    if (pager == kernel_pager && spaces) {
+        printf("Can't destroy the kernel pager while other address spaces use it\n");
+        return;
+    }
+    
+    lazy_destroy_all(pager);
+    
+    // Spaces only own the tables of their private part
+    
+    for (u32 i = 0; i < PAGE_ENTRIES; i++) {
+        if (pager->tables_allocated[i]) {
+            memset(pager->page_tables[i], 0, PAGE_SIZE);
+            kmem_cache_free(page_table_cache, pager->page_tables[i]);
+            
+            pager->page_tables[i] = nullptr;
+            pager->tables_allocated[i] = 0;
+        }
+    }
+    
+    if (pager == kernel_pager) {
+        kernel_pager = nullptr;
+    } else {
+        Pager** link = &spaces;
+        
+        while (*link && *link != pager)
+            link = &(*link)->next;
+        
+        if (*link)
+            *link = pager->next;
+    }
+    
+    memset(pager->page_directory, 0, PAGE_SIZE);
+    kmem_cache_free(page_table_cache, pager->page_directory);
+    kfree(pager);
 }
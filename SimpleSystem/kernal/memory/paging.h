@@ -8,25 +8,106 @@
 #define PAGE_PRESENT 0x1
 #define PAGE_WRITE 0x2
 #define PAGE_USER 0x4
+#define PAGE_WRITE_THROUGH 0x8
+#define PAGE_CACHE_DISABLE 0x10
+#define PAGE_PAT         (1 << 7) // Only in 4 KiB PTEs
+#define PAGE_LARGE       (1 << 7) // Only in PDEs, 4 MiB page (needs CR4.PSE)
 #define PAGE_GLOBAL      (1 << 8)
 
-typedef struct {
+// Write-combining, PAT entry 1 (see memory/pat.h)
+#define PAGE_WC          PAGE_WRITE_THROUGH
+
+#define LARGE_PAGE_SIZE  (4 * 1024 * 1024)
+#define LARGE_PAGE_MASK  (LARGE_PAGE_SIZE - 1)
+
+/**
+ * Address spaces.
+ *
+ * The first pager that gets created is the kernel's, every pager after it
+ * is a separate address space whose page directory points at the kernel's
+ * page tables (and large pages), so kernel mappings only exist once.
+ * Only [SPACE_PRIVATE_START, SPACE_PRIVATE_END) belongs to each space,
+ * mapping anything outside of it through any pager changes the kernel's.
+ *
+ * Kernel mappings are global (CR4.PGE), switching spaces
+ * only drops the TLB entries of the private part.
+ */
+#define SPACE_PRIVATE_START 0xC0000000
+#define SPACE_PRIVATE_END   0xE0000000
+
+struct LazyRegion;
+
+typedef struct Pager {
 	u32* page_directory;
-	u32* page_tables[PAGE_ENTRIES];
+	u32* page_tables[PAGE_ENTRIES];   // Only the tables this pager owns
 	u8 tables_allocated[PAGE_ENTRIES];
-	u8 paging_active;
+	u8 paging_active;                 // Loaded in CR3
+	
+	struct LazyRegion* lazy_regions; // Demand paged regions (memory/lazy.h)
+	
+	struct Pager* next;              // Other address spaces, kept to sync kernel PDEs
 } Pager;
 
+/**
+ * Batches TLB invalidations of one operation ("mmu_gather"),
+ * up to TLB_FLUSH_THRESHOLD pages get their own invlpg,
+ * anything bigger does a single CR3 reload instead.
+ */
+#define TLB_FLUSH_THRESHOLD 32
+
+typedef struct {
+	Pager* pager;
+	u32 pages[TLB_FLUSH_THRESHOLD];
+	u32 count;
+	u8 full;
+	u8 global;    // A kernel (global) mapping changed, visible in every space
+	void* tables; // Emptied page tables, freed after the flush
+} TlbGather;
+
+void tlb_gather_init(TlbGather* tlb, Pager* pager);
+void tlb_gather_add(TlbGather* tlb, u32 virt_addr);
+void tlb_gather_finish(TlbGather* tlb);
+void pager_flush_all(Pager* pager);
+
+// Flushes global entries too (toggles CR4.PGE)
+void pager_flush_global(void);
+
 // Function prototypes
+
+// First call creates the kernel pager, after that a new address space
 Pager* pager_create(void);
 void pager_map_range(Pager* pager, u32 virt_start, u32 phys_start, u32 size, u32 flags);
 void pager_map_page(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags);
+void pager_map_large(Pager* pager, u32 virt_addr, u32 phys_addr, u32 flags);
 void pager_identity_map(Pager* pager, u32 phys_start, u32 size, u32 flags);
+
+/**
+ * Removes mappings, page tables that end up empty are freed.
+ * The mapped frames themselves belong to the caller.
+ */
+void pager_unmap_range(Pager* pager, u32 virt_start, u32 size);
+void pager_unmap_page(Pager* pager, u32 virt_addr);
+
+// Replaces the flags of every present page in the range
+void pager_protect_range(Pager* pager, u32 virt_start, u32 size, u32 flags);
+
+// Physical address "virt_addr" maps to, 0 if it isn't mapped
+u32 pager_translate(Pager* pager, u32 virt_addr);
+
 void pager_enable(Pager* pager);
+
+// Loads another address space, paging has to be enabled already
+void pager_switch(Pager* pager);
+
+// The pager that's currently loaded in CR3
+Pager* pager_active(void);
+Pager* pager_kernel(void);
+
+// The kernel pager can only be destroyed after every other space
 void pager_destroy(Pager* pager);
 
 // Memory management
 //void* memset(void* ptr, int value, size_t num);
-//void* memalign(size_t alignment, size_t size);
+// Frames come from memory/frame.h, small objects from memory/slab.h
 
 #endif // PAGING_H
\ No newline at end of file
@@ -0,0 +1,115 @@
+﻿#include "pat.h"
+
+#include "../cpu/cpu.h"
+#include "../serial/serial.h"
+
+#define MTRRCAP_VCNT   0xFF
+#define MTRRCAP_WC     (1 << 10)
+#define MTRR_ENABLE    (1 << 11) // IA32_MTRR_DEF_TYPE.E
+#define MTRR_VALID     (1 << 11) // PHYSMASKn.V
+
+static u8 pat_enabled = 0;
+
+static u32 physical_address_bits(void) {
+    u32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    
+    if (eax < 0x80000008)
+        return 36;
+    
+    cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+    
+    return eax & 0xFF;
+}
+
+u8 pat_init(void) {
+    if (!cpu_has_edx(CPUID_EDX_PAT)) {
+        printf("PAT isn't supported\n");
+        return 0;
+    }
+    
+    u32 lo, hi;
+    rdmsr(IA32_PAT_MSR, &lo, &hi);
+    
+    // PA1 is bits 8-10 of the low dword
+    lo = (lo & ~(0x7 << 8)) | (MEM_TYPE_WC << 8);
+    
+    asm volatile("wbinvd" ::: "memory");
+    wrmsr(IA32_PAT_MSR, lo, hi);
+    asm volatile("wbinvd" ::: "memory");
+    
+    pat_enabled = 1;
+    
+    printf("PAT: hi=%x lo=%x\n", hi, lo);
+    
+    return 1;
+}
+
+u8 mtrr_set_wc(u32 base, u32 size) {
+    if (!cpu_has_edx(CPUID_EDX_MTRR)) {
+        printf("MTRRs aren't supported\n");
+        return 0;
+    }
+    
+    if (size < 4096 || (size & (size - 1)) || (base & (size - 1))) {
+        printf("MTRR range %x + %x isn't a power of two/aligned\n", base, size);
+        return 0;
+    }
+    
+    u32 lo, hi;
+    rdmsr(IA32_MTRRCAP_MSR, &lo, &hi);
+    
+    if (!(lo & MTRRCAP_WC)) {
+        printf("MTRRs don't support write-combining\n");
+        return 0;
+    }
+    
+    u32 count = lo & MTRRCAP_VCNT;
+    u32 slot = count;
+    
+    for (u32 i = 0; i < count; i++) {
+        rdmsr(IA32_MTRR_PHYSMASK0 + i * 2, &lo, &hi);
+        
+        if (!(lo & MTRR_VALID)) {
+            slot = i;
+            break;
+        }
+    }
+    
+    if (slot == count) {
+        printf("No free variable MTRR for %x\n", base);
+        return 0;
+    }
+    
+    u32 bits = physical_address_bits();
+    u32 mask_hi = bits > 32 ? (1u << (bits - 32)) - 1 : 0;
+    
+    // Intel SDM 11.11.7.2, caches off and MTRRs disabled while changing them
+    u32 cr0, def_lo, def_hi;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"((cr0 | (1 << 30)) & ~(1 << 29)) : "memory"); // CD=1, NW=0
+    asm volatile("wbinvd" ::: "memory");
+    
+    rdmsr(IA32_MTRR_DEF_TYPE, &def_lo, &def_hi);
+    wrmsr(IA32_MTRR_DEF_TYPE, def_lo & ~MTRR_ENABLE, def_hi);
+    
+    wrmsr(IA32_MTRR_PHYSBASE0 + slot * 2, base | MEM_TYPE_WC, 0);
+    wrmsr(IA32_MTRR_PHYSMASK0 + slot * 2, ~(size - 1) | MTRR_VALID, mask_hi);
+    
+    wrmsr(IA32_MTRR_DEF_TYPE, def_lo, def_hi);
+    
+    asm volatile("wbinvd" ::: "memory");
+    asm volatile("mov %0, %%cr0" :: "r"(cr0) : "memory");
+    
+    printf("MTRR %d: %x + %x is now WC\n", slot, base, size);
+    
+    return 1;
+}
+
+u8 cache_set_wc(u32 base, u32 size) {
+    // PAGE_WC already selects WC through PAT
+    if (pat_enabled)
+        return 1;
+    
+    return mtrr_set_wc(base, size);
+}
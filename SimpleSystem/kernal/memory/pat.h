@@ -0,0 +1,43 @@
+﻿#ifndef PAT_H
+#define PAT_H
+
+#include "../io.h"
+
+// https://wiki.osdev.org/Paging#PAT
+#define IA32_PAT_MSR         0x277
+#define IA32_MTRRCAP_MSR     0xFE
+#define IA32_MTRR_DEF_TYPE   0x2FF
+#define IA32_MTRR_PHYSBASE0  0x200 // PHYSBASEn = 0x200 + 2n
+#define IA32_MTRR_PHYSMASK0  0x201 // PHYSMASKn = 0x201 + 2n
+
+// Memory types (same values for PAT entries and MTRRs)
+#define MEM_TYPE_UC          0x00
+#define MEM_TYPE_WC          0x01
+#define MEM_TYPE_WT          0x04
+#define MEM_TYPE_WP          0x05
+#define MEM_TYPE_WB          0x06
+#define MEM_TYPE_UC_MINUS    0x07
+
+/**
+ * Reprograms PAT entry 1 (PWT=1, PCD=0, PAT=0) from WT to WC,
+ * after this PAGE_WC in a PTE/PDE means write-combining.
+ *
+ * Returns 0 if the CPU doesn't have PAT.
+ */
+u8 pat_init(void);
+
+/**
+ * Fallback for CPUs without PAT, marks [base, base + size) as WC in a free variable MTRR.
+ * "size" has to be a power of two (at least 4 KiB) and "base" aligned to it.
+ *
+ * Without PAT the PWT bit of PAGE_WC stays a write-through hint,
+ * which the WC MTRR overrides.
+ */
+u8 mtrr_set_wc(u32 base, u32 size);
+
+/**
+ * Makes [base, base + size) write-combining with whatever the CPU supports.
+ */
+u8 cache_set_wc(u32 base, u32 size);
+
+#endif // PAT_H
@@ -0,0 +1,396 @@
+﻿#include "slab.h"
+
+#include "frame.h"
+#include "trace.h"
+#include "../serial/serial.h"
+
+typedef struct {
+    u32 magic;
+    u32 frames;
+    u32 size;
+    u32 reserved;
+} LargeHeader;
+
+static KmemCache caches[KMEM_MAX_CACHES];
+static u32 cache_count = 0;
+
+static const u32 kmalloc_sizes[] = { 16, 32, 64, 128, 256, 512, 1024 };
+#define KMALLOC_CLASSES (sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]))
+
+static KmemCache* kmalloc_caches[KMALLOC_CLASSES];
+static u8 kmem_ready = 0;
+
+// Large kmalloc counters
+static u32 large_allocs = 0;
+static u32 large_frees = 0;
+static u32 large_frames = 0;
+
+static inline u32 align_up(u32 value, u32 align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static void slab_list_add(Slab** list, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = *list;
+    
+    if (*list)
+        (*list)->prev = slab;
+    
+    *list = slab;
+}
+
+static void slab_list_remove(Slab** list, Slab* slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    
+    slab->next = slab->prev = nullptr;
+}
+
+static Slab* slab_create(KmemCache* cache) {
+    Slab* slab = (Slab*)alloc_frames(1);
+    
+    if (!slab)
+        return nullptr;
+    
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->next = slab->prev = nullptr;
+    slab->in_use = 0;
+    slab->free = nullptr;
+    
+    // Build the free list backwards so objects are handed out in address order
+    u8* base = (u8*)slab + cache->first_offset;
+    
+    for (u32 i = cache->objects_per_slab; i > 0; i--) {
+        void* object = base + (i - 1) * cache->object_size;
+        
+        *(void**)object = slab->free;
+        slab->free = object;
+    }
+    
+    cache->stats.slabs++;
+    
+    return slab;
+}
+
+static void slab_destroy(KmemCache* cache, Slab* slab) {
+    slab->magic = 0;
+    free_frames(slab, 1);
+    
+    cache->stats.slabs--;
+}
+
+static inline u32 object_frames(KmemCache* cache) {
+    return cache->object_size / FRAME_SIZE;
+}
+
+void kmem_init(void) {
+    if (kmem_ready) return;
+    
+    kmem_ready = 1;
+    
+    static const char* names[KMALLOC_CLASSES] = {
+        "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+        "kmalloc-256", "kmalloc-512", "kmalloc-1024"
+    };
+    
+    for (u32 i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(names[i], kmalloc_sizes[i], 16);
+    }
+}
+
+KmemCache* kmem_cache_create(const char* name, u32 size, u32 align) {
+    if (cache_count >= KMEM_MAX_CACHES) {
+        printf("kmem_cache_create: too many caches, can't create %s\n", name);
+        return nullptr;
+    }
+    
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (size < sizeof(void*)) size = sizeof(void*);
+    
+    KmemCache* cache = &caches[cache_count++];
+    memset(cache, 0, sizeof(KmemCache));
+    
+    u32 i = 0;
+    for (; name[i] && i < KMEM_NAME_LENGTH - 1; i++) {
+        cache->name[i] = name[i];
+    }
+    
+    cache->name[i] = '\0';
+    
+    cache->align = align;
+    cache->object_size = align_up(size, align);
+    cache->first_offset = align_up(sizeof(Slab), align);
+    
+    if (cache->first_offset + cache->object_size * 2 > FRAME_SIZE) {
+        // Too big to share a frame, every object gets whole frames
+        cache->object_size = align_up(size, FRAME_SIZE);
+        cache->objects_per_slab = 0;
+    } else {
+        cache->objects_per_slab = (FRAME_SIZE - cache->first_offset) / cache->object_size;
+    }
+    
+    return cache;
+}
+
+KmemCache* kmem_cache_create_zeroed(const char* name) {
+    KmemCache* cache = kmem_cache_create(name, FRAME_SIZE, FRAME_SIZE);
+    
+    if (cache)
+        cache->zeroed = 1;
+    
+    return cache;
+}
+
+static void* cache_alloc(KmemCache* cache) {
+    if (!cache) return nullptr;
+    
+    // Frame sized objects
+    if (cache->objects_per_slab == 0) {
+        void* object = cache->frames;
+        
+        if (object) {
+            cache->frames = *(void**)object;
+            cache->frames_count--;
+            cache->stats.hits++;
+            
+            // The link was the only thing that wasn't zero
+            if (cache->zeroed)
+                *(void**)object = nullptr;
+        } else {
+            object = cache->zeroed ? alloc_zeroed_frame() : alloc_frames(object_frames(cache));
+            
+            if (!object)
+                return nullptr;
+            
+            cache->stats.slabs++;
+            cache->stats.misses++;
+        }
+        
+        cache->stats.allocs++;
+        cache->stats.in_use++;
+        
+        return object;
+    }
+    
+    Slab* slab = cache->partial;
+    
+    if (slab) {
+        cache->stats.hits++;
+    } else if (cache->empty) {
+        slab = cache->empty;
+        cache->empty = nullptr;
+        
+        slab_list_add(&cache->partial, slab);
+        cache->stats.hits++;
+    } else {
+        slab = slab_create(cache);
+        
+        if (!slab)
+            return nullptr;
+        
+        slab_list_add(&cache->partial, slab);
+        cache->stats.misses++;
+    }
+    
+    void* object = slab->free;
+    slab->free = *(void**)object;
+    slab->in_use++;
+    
+    if (!slab->free) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    
+    cache->stats.allocs++;
+    cache->stats.in_use++;
+    
+    return object;
+}
+
+void* kmem_cache_alloc(KmemCache* cache) {
+    if (!cache) return nullptr;
+    
+    void* object = cache_alloc(cache);
+    
+    TRACE_ALLOC(TRACE_CACHE, TRACE_CALLER(), object, cache->object_size, cache->object_size);
+    
+    return object;
+}
+
+void* kmem_cache_zalloc(KmemCache* cache) {
+    if (!cache) return nullptr;
+    
+    void* object = cache_alloc(cache);
+    
+    if (object && !cache->zeroed)
+        memset(object, 0, cache->object_size);
+    
+    TRACE_ALLOC(TRACE_CACHE, TRACE_CALLER(), object, cache->object_size, cache->object_size);
+    
+    return object;
+}
+
+static void cache_free(KmemCache* cache, void* object) {
+    if (!cache || !object) return;
+    
+    if (cache->objects_per_slab == 0) {
+        if (cache->frames_count < KMEM_FRAME_CACHE_MAX) {
+            *(void**)object = cache->frames;
+            cache->frames = object;
+            cache->frames_count++;
+        } else {
+            if (cache->zeroed)
+                free_zeroed_frame(object);
+            else
+                free_frames(object, object_frames(cache));
+            
+            cache->stats.slabs--;
+        }
+        
+        cache->stats.frees++;
+        cache->stats.in_use--;
+        
+        return;
+    }
+    
+    Slab* slab = (Slab*)((u32)object & ~(FRAME_SIZE - 1));
+    
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        printf("kmem_cache_free: %x doesn't belong to %s\n", object, cache->name);
+        return;
+    }
+    
+    u8 was_full = slab->free == nullptr;
+    
+    *(void**)object = slab->free;
+    slab->free = object;
+    slab->in_use--;
+    
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        
+        if (!cache->empty)
+            cache->empty = slab;
+        else
+            slab_destroy(cache, slab);
+    }
+    
+    cache->stats.frees++;
+    cache->stats.in_use--;
+}
+
+void kmem_cache_free(KmemCache* cache, void* object) {
+    TRACE_FREE(TRACE_CACHE, object);
+    
+    cache_free(cache, object);
+}
+
+/**
+ * kmalloc and kzalloc both record their own caller,
+ * not each other.
+ */
+static void* kmalloc_traced(size_t size, u32 caller) {
+    if (size == 0) return nullptr;
+    
+    if (!kmem_ready) kmem_init();
+    
+    for (u32 i = 0; i < KMALLOC_CLASSES; i++) {
+        if (size <= kmalloc_sizes[i]) {
+            void* object = cache_alloc(kmalloc_caches[i]);
+            
+            TRACE_ALLOC(TRACE_KMALLOC, caller, object, size, kmalloc_sizes[i]);
+            
+            return object;
+        }
+    }
+    
+    u32 frames = (size + sizeof(LargeHeader) + FRAME_SIZE - 1) / FRAME_SIZE;
+    LargeHeader* header = (LargeHeader*)alloc_frames(frames);
+    
+    if (!header)
+        return nullptr;
+    
+    header->magic = KMALLOC_LARGE_MAGIC;
+    header->frames = frames;
+    header->size = size;
+    
+    large_allocs++;
+    large_frames += frames;
+    
+    TRACE_ALLOC(TRACE_KMALLOC, caller, header + 1, size, frames * FRAME_SIZE);
+    
+    return header + 1;
+}
+
+void* kmalloc(size_t size) {
+    return kmalloc_traced(size, TRACE_CALLER());
+}
+
+void* kzalloc(size_t size) {
+    void* ptr = kmalloc_traced(size, TRACE_CALLER());
+    
+    if (ptr)
+        memset(ptr, 0, size);
+    
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+    
+    u32 page = (u32)ptr & ~(FRAME_SIZE - 1);
+    
+    if (*(u32*)page == SLAB_MAGIC) {
+        Slab* slab = (Slab*)page;
+        
+        TRACE_FREE(TRACE_KMALLOC, ptr);
+        cache_free(slab->cache, ptr);
+        
+        return;
+    }
+    
+    LargeHeader* header = (LargeHeader*)page;
+    
+    if (header->magic != KMALLOC_LARGE_MAGIC || (void*)(header + 1) != ptr) {
+        printf("kfree: %x wasn't allocated by kmalloc\n", ptr);
+        return;
+    }
+    
+    header->magic = 0;
+    
+    TRACE_FREE(TRACE_KMALLOC, ptr);
+    
+    large_frees++;
+    large_frames -= header->frames;
+    
+    free_frames(header, header->frames);
+}
+
+void kmem_dump(void) {
+    printf("Object caches:\n");
+    
+    for (u32 i = 0; i < cache_count; i++) {
+        KmemCache* cache = &caches[i];
+        KmemStats* s = &cache->stats;
+        
+        u32 owned = s->slabs * FRAME_SIZE;
+        u32 used = s->in_use * cache->object_size;
+        
+        printf("  %s: size=%d per_slab=%d slabs=%d in_use=%d allocs=%d frees=%d hits=%d misses=%d wasted=%d bytes\n",
+               cache->name, cache->object_size, cache->objects_per_slab, s->slabs, s->in_use,
+               s->allocs, s->frees, s->hits, s->misses, owned - used);
+    }
+    
+    printf("  kmalloc-large: allocs=%d frees=%d frames=%d\n", large_allocs, large_frees, large_frames);
+}
@@ -0,0 +1,99 @@
+﻿#ifndef SLAB_H
+#define SLAB_H
+
+#include "../io.h"
+
+/**
+ * Object caches on top of the frame allocator.
+ *
+ * Small objects live in one frame "slabs", the Slab header sits at the
+ * start of the frame and the objects follow it, so finding the slab of
+ * an object is just rounding the address down to the frame.
+ *
+ * Caches with objects of half a frame or more don't use slabs,
+ * every object is a whole (zeroed on request) frame and freed objects
+ * are kept on a small stack before going back to the frame allocator.
+ * Zeroed caches (kmem_cache_create_zeroed) take their frames from the
+ * zero pool and give them back to it, their objects are always zeroed
+ * and have to be all zeros again when they are freed.
+ *
+ * kmalloc/kfree use a set of size class caches (16 - 1024 bytes),
+ * anything bigger gets its own frames with a small header in front.
+ */
+
+#define SLAB_MAGIC          0x51AB51AB
+#define KMALLOC_LARGE_MAGIC 0x4B4D4C47
+
+#define KMEM_MAX_CACHES     16
+#define KMEM_NAME_LENGTH    16
+
+// How many freed frames a frame sized cache keeps around
+#define KMEM_FRAME_CACHE_MAX 16
+
+struct KmemCache;
+
+typedef struct Slab {
+    u32 magic;
+    struct KmemCache* cache;
+    
+    struct Slab* next;
+    struct Slab* prev;
+    
+    void* free;  // Free objects, linked through their first word
+    u32 in_use;
+} Slab;
+
+typedef struct {
+    u32 allocs;
+    u32 frees;
+    u32 hits;    // Served from memory the cache already had
+    u32 misses;  // Needed new frames from the frame allocator
+    u32 slabs;   // Slabs (or frames) currently owned by the cache
+    u32 in_use;  // Objects currently handed out
+} KmemStats;
+
+typedef struct KmemCache {
+    char name[KMEM_NAME_LENGTH];
+    
+    u32 object_size;
+    u32 align;
+    u32 first_offset;     // Offset of the first object inside of a slab
+    u32 objects_per_slab; // 0 for frame sized caches
+    
+    Slab* partial;        // Slabs with at least one free object
+    Slab* full;
+    Slab* empty;          // One spare empty slab, so alloc/free at a boundary doesn't thrash
+    
+    void* frames;         // Free frames (frame sized caches only)
+    u32 frames_count;
+    u8 zeroed;            // Frames come from (and go back to) the zero pool
+    
+    KmemStats stats;
+} KmemCache;
+
+void kmem_init(void);
+
+/**
+ * Creates a new named cache, "size" is rounded up to "align"
+ * (and to at least a pointer, free objects store the free list link).
+ */
+KmemCache* kmem_cache_create(const char* name, u32 size, u32 align);
+
+// A cache of single zeroed frames (i.e. page tables)
+KmemCache* kmem_cache_create_zeroed(const char* name);
+
+void* kmem_cache_alloc(KmemCache* cache);
+void* kmem_cache_zalloc(KmemCache* cache);
+void kmem_cache_free(KmemCache* cache, void* object);
+
+void* kmalloc(size_t size);
+void* kzalloc(size_t size);
+void kfree(void* ptr);
+
+/**
+ * Prints the hit/miss counters and
+ * the wasted space of every cache over serial.
+ */
+void kmem_dump(void);
+
+#endif // SLAB_H
@@ -0,0 +1,196 @@
+﻿#include "trace.h"
+
+#include "frame.h"
+#include "../serial/serial.h"
+
+#define ENTRY_EMPTY    0
+#define ENTRY_USED     1
+
+static TraceEntry* table = nullptr;
+static u32 table_used = 0;     // Live entries, frees shift the table back so there are no tombstones
+
+static TraceSite sites[TRACE_MAX_SITES];
+static u32 site_count = 0;
+
+static TraceLayer layers[TRACE_LAYERS];
+
+// Allocations that couldn't be recorded (table or site list full),
+// and frees of memory that was allocated before tracing started
+static u32 dropped = 0;
+static u32 untracked_frees = 0;
+
+static const char* layer_names[TRACE_LAYERS] = {
+    "kmalloc", "cache", "frames", "dma"
+};
+
+void trace_init(void) {
+    if (table || !ALLOC_TRACE) return;
+    
+    u32 frames = (TRACE_TABLE_SIZE * sizeof(TraceEntry) + FRAME_SIZE - 1) / FRAME_SIZE;
+    
+    // Allocated while "table" is still null, so it doesn't record itself
+    TraceEntry* memory = (TraceEntry*)alloc_frames(frames);
+    
+    if (!memory) {
+        printf("Allocation tracing disabled, no memory for the table\n");
+        return;
+    }
+    
+    memset(memory, 0, TRACE_TABLE_SIZE * sizeof(TraceEntry));
+    table = memory;
+}
+
+static inline u32 trace_hash(u32 addr, u8 layer) {
+    return ((addr >> 4) ^ (addr >> 16) ^ layer) & (TRACE_TABLE_SIZE - 1);
+}
+
+static s32 trace_site(u8 layer, u32 caller) {
+    for (u32 i = 0; i < site_count; i++) {
+        if (sites[i].caller == caller && sites[i].layer == layer)
+            return i;
+    }
+    
+    if (site_count == TRACE_MAX_SITES)
+        return -1;
+    
+    TraceSite* site = &sites[site_count];
+    memset(site, 0, sizeof(TraceSite));
+    
+    site->caller = caller;
+    site->layer = layer;
+    
+    return site_count++;
+}
+
+void trace_alloc(u8 layer, u32 caller, void* addr, u32 requested, u32 size) {
+    if (!table || !addr) return;
+    
+    s32 index = trace_site(layer, caller);
+    
+    // Keep a few slots free so lookups always end on an empty one
+    if (index < 0 || table_used >= TRACE_TABLE_SIZE - 16) {
+        dropped++;
+        return;
+    }
+    
+    u32 slot = trace_hash((u32)addr, layer);
+    
+    while (table[slot].state == ENTRY_USED)
+        slot = (slot + 1) & (TRACE_TABLE_SIZE - 1);
+    
+    table_used++;
+    
+    TraceEntry* entry = &table[slot];
+    entry->addr = (u32)addr;
+    entry->size = size;
+    entry->requested = requested;
+    entry->site = index;
+    entry->layer = layer;
+    entry->state = ENTRY_USED;
+    
+    TraceSite* site = &sites[index];
+    site->allocs++;
+    site->live += size;
+    site->requested += requested;
+    
+    if (site->live > site->peak)
+        site->peak = site->live;
+    
+    TraceLayer* total = &layers[layer];
+    total->live += size;
+    total->requested += requested;
+    
+    if (total->live > total->peak)
+        total->peak = total->live;
+}
+
+/**
+ * Empties "slot" without breaking the probe chains running through it,
+ * the entries after it that hash to it or before it move back into the hole.
+ */
+static void trace_remove(u32 slot) {
+    u32 hole = slot;
+    u32 next = (slot + 1) & (TRACE_TABLE_SIZE - 1);
+    
+    while (table[next].state == ENTRY_USED) {
+        u32 home = trace_hash(table[next].addr, table[next].layer);
+        
+        // Distance from home to next covers the hole, a lookup would pass it
+        if (((next - home) & (TRACE_TABLE_SIZE - 1)) >= ((next - hole) & (TRACE_TABLE_SIZE - 1))) {
+            table[hole] = table[next];
+            hole = next;
+        }
+        
+        next = (next + 1) & (TRACE_TABLE_SIZE - 1);
+    }
+    
+    table[hole].state = ENTRY_EMPTY;
+    table_used--;
+}
+
+void trace_free(u8 layer, void* addr) {
+    if (!table || !addr) return;
+    
+    u32 slot = trace_hash((u32)addr, layer);
+    
+    while (table[slot].state != ENTRY_EMPTY) {
+        TraceEntry* entry = &table[slot];
+        
+        if (entry->state == ENTRY_USED && entry->addr == (u32)addr && entry->layer == layer) {
+            TraceSite* site = &sites[entry->site];
+            
+            site->frees++;
+            site->live -= entry->size;
+            site->requested -= entry->requested;
+            
+            layers[layer].live -= entry->size;
+            layers[layer].requested -= entry->requested;
+            
+            trace_remove(slot);
+            
+            return;
+        }
+        
+        slot = (slot + 1) & (TRACE_TABLE_SIZE - 1);
+    }
+    
+    untracked_frees++;
+}
+
+void trace_dump(void) {
+    if (!table) {
+        printf("Allocation tracing isn't running (build with -DALLOC_TRACE=1)\n");
+        return;
+    }
+    
+    printf("Allocation profile:\n");
+    
+    for (u32 layer = 0; layer < TRACE_LAYERS; layer++) {
+        TraceLayer* total = &layers[layer];
+        
+        printf("[%s] live=%d peak=%d wasted=%d\n", layer_names[layer],
+               total->live, total->peak, total->live - total->requested);
+        
+        for (u32 i = 0; i < site_count; i++) {
+            TraceSite* site = &sites[i];
+            
+            if (site->layer != layer)
+                continue;
+            
+            printf("  site %x allocs=%d frees=%d live=%d peak=%d wasted=%d\n",
+                   site->caller, site->allocs, site->frees, site->live, site->peak,
+                   site->live - site->requested);
+        }
+    }
+    
+    // External fragmentation, how much of the free memory can't be had as one block
+    const FrameStats* stats = frame_stats();
+    u32 largest = frame_largest_free();
+    
+    if (stats->free_frames)
+        printf("Frames: %d free, largest block %d, fragmentation %d%%\n",
+               stats->free_frames, largest, 100 - largest * 100 / stats->free_frames);
+    
+    printf("Table: %d/%d slots, %d dropped, %d untracked frees\n",
+           table_used, TRACE_TABLE_SIZE, dropped, untracked_frees);
+}
@@ -0,0 +1,88 @@
+﻿#ifndef TRACE_H
+#define TRACE_H
+
+#include "../io.h"
+
+/**
+ * Allocation profiler.
+ *
+ * Every allocator records what it hands out against the address it was
+ * called from, so memory can be blamed on whoever asked for it.
+ * Each allocator is its own layer (kmalloc objects, cache objects, frames,
+ * DMA buffers), the frames behind a slab show up as frames allocated by
+ * the slab code, so the layers don't add up to one total.
+ *
+ * trace_dump prints the call sites as raw addresses,
+ * assets/py_scripts/resolve_allocs.py turns them into function names
+ * with build/symbols.txt.
+ *
+ * Build with -DALLOC_TRACE=1 to compile the hooks in,
+ * without it nothing is recorded and the table isn't allocated.
+ */
+
+#ifndef ALLOC_TRACE
+#define ALLOC_TRACE 0
+#endif
+
+#define TRACE_MAX_SITES     128
+#define TRACE_TABLE_SIZE    4096 // Live allocations, has to be a power of two
+
+// Layers
+#define TRACE_KMALLOC       0
+#define TRACE_CACHE         1
+#define TRACE_FRAMES        2
+#define TRACE_DMA           3
+#define TRACE_LAYERS        4
+
+// Where the allocator was called from
+#define TRACE_CALLER()      ((u32)__builtin_return_address(0))
+
+typedef struct {
+    u32 addr;
+    u32 size;       // What the allocator actually used
+    u32 requested;  // What was asked for
+    u16 site;
+    u8 layer;
+    u8 state;
+} TraceEntry;
+
+typedef struct {
+    u32 caller;
+    u8 layer;
+    
+    u32 allocs;
+    u32 frees;
+    u32 live;       // Bytes currently allocated
+    u32 peak;
+    u32 requested;  // Of "live", what was asked for
+} TraceSite;
+
+typedef struct {
+    u32 live;
+    u32 peak;
+    u32 requested;
+} TraceLayer;
+
+/**
+ * Allocates the live allocation table, nothing is recorded before this.
+ * Needs the frame allocator.
+ */
+void trace_init(void);
+
+void trace_alloc(u8 layer, u32 caller, void* addr, u32 requested, u32 size);
+void trace_free(u8 layer, void* addr);
+
+// Prints every call site, the layer totals and the frame fragmentation over serial
+void trace_dump(void);
+
+#if ALLOC_TRACE
+#define TRACE_ALLOC(layer, caller, addr, requested, size) trace_alloc(layer, caller, addr, requested, size)
+#define TRACE_FREE(layer, addr) trace_free(layer, addr)
+#else
+// The arguments are still used, callers pass theirs through without a warning
+#define TRACE_ALLOC(layer, caller, addr, requested, size) \
+    ((void)(layer), (void)(caller), (void)(addr), (void)(requested), (void)(size))
+#define TRACE_FREE(layer, addr) ((void)(layer), (void)(addr))
+#endif
+
+#endif // TRACE_H
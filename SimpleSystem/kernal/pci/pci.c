@@ -0,0 +1,304 @@
+﻿#include "pci.h"
+
+#include "../serial/serial.h"
+
+static PciDevice devices[PCI_MAX_DEVICES];
+static u32 device_count = 0;
+
+static PciDriver* drivers[PCI_MAX_DRIVERS];
+static u32 driver_count = 0;
+
+// Buses already walked, so a bridge loop can't recurse forever
+static u32 scanned_buses[256 / 32];
+
+static const char* class_names[] = {
+    "unclassified", "storage", "network", "display", "multimedia", "memory",
+    "bridge", "communication", "system", "input", "docking", "processor",
+    "serial bus"
+};
+
+#define PCI_CLASS_NAMES (sizeof(class_names) / sizeof(class_names[0]))
+
+static inline u32 pci_address(u8 bus, u8 slot, u8 func, u8 offset) {
+    return 0x80000000 | ((u32)bus << 16) | ((u32)(slot & 0x1F) << 11) |
+           ((u32)(func & 0x07) << 8) | (offset & 0xFC);
+}
+
+u32 pci_read32(u8 bus, u8 slot, u8 func, u8 offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    
+    return inl(PCI_CONFIG_DATA);
+}
+
+u16 pci_read16(u8 bus, u8 slot, u8 func, u8 offset) {
+    return (u16)(pci_read32(bus, slot, func, offset) >> ((offset & 2) * 8));
+}
+
+u8 pci_read8(u8 bus, u8 slot, u8 func, u8 offset) {
+    return (u8)(pci_read32(bus, slot, func, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(u8 bus, u8 slot, u8 func, u8 offset, u32 value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_write16(u8 bus, u8 slot, u8 func, u8 offset, u16 value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    outw(PCI_CONFIG_DATA + (offset & 2), value);
+}
+
+/**
+ * Sizes a BAR by writing all ones and reading back which bits stuck,
+ * returns how many BAR slots it used (2 for 64 bit memory BARs).
+ */
+static u32 pci_decode_bar(PciDevice* dev, u32 index) {
+    u8 offset = PCI_BAR0 + index * 4;
+    PciBar* bar = &dev->bars[index];
+    
+    u32 original = pci_read32(dev->bus, dev->slot, dev->func, offset);
+    
+    pci_write32(dev->bus, dev->slot, dev->func, offset, 0xFFFFFFFF);
+    u32 mask = pci_read32(dev->bus, dev->slot, dev->func, offset);
+    pci_write32(dev->bus, dev->slot, dev->func, offset, original);
+    
+    if (mask == 0 || mask == 0xFFFFFFFF)
+        return 1;
+    
+    if (original & 0x1) {
+        bar->flags = PCI_BAR_IO;
+        bar->base = original & ~0x3;
+        bar->size = (~(mask & ~0x3) + 1) & 0xFFFF;
+        
+        return 1;
+    }
+    
+    bar->base = original & ~0xF;
+    bar->size = ~(mask & ~0xF) + 1;
+    
+    if (original & 0x8)
+        bar->flags |= PCI_BAR_PREFETCH;
+    
+    if (((original >> 1) & 0x3) != 0x2)
+        return 1;
+    
+    bar->flags |= PCI_BAR_64;
+    
+    // TODO; Nothing above 4 GiB can be reached without PAE
+    if (index + 1 < PCI_MAX_BARS &&
+        pci_read32(dev->bus, dev->slot, dev->func, offset + 4) != 0) {
+        printf("PCI %d:%d.%d: BAR%d is above 4 GiB, ignored\n", dev->bus, dev->slot, dev->func, index);
+        
+        bar->base = 0;
+        bar->size = 0;
+    }
+    
+    return 2;
+}
+
+static void pci_decode_bars(PciDevice* dev) {
+    u32 count = dev->header == 0 ? 6 : (dev->header == PCI_HEADER_BRIDGE ? 2 : 0);
+    
+    if (count == 0)
+        return;
+    
+    // Decoding is turned off while the BARs hold the sizing pattern
+    u16 command = pci_read16(dev->bus, dev->slot, dev->func, PCI_COMMAND);
+    pci_write16(dev->bus, dev->slot, dev->func, PCI_COMMAND, command & ~(PCI_CMD_IO | PCI_CMD_MEMORY));
+    
+    for (u32 i = 0; i < count; )
+        i += pci_decode_bar(dev, i);
+    
+    pci_write16(dev->bus, dev->slot, dev->func, PCI_COMMAND, command);
+}
+
+static u8 pci_match(PciDriver* driver, PciDevice* dev) {
+    if (driver->vendor   != PCI_ANY && driver->vendor   != dev->vendor)   return 0;
+    if (driver->device   != PCI_ANY && driver->device   != dev->device)   return 0;
+    if (driver->class    != PCI_ANY && driver->class    != dev->class)    return 0;
+    if (driver->subclass != PCI_ANY && driver->subclass != dev->subclass) return 0;
+    if (driver->prog_if  != PCI_ANY && driver->prog_if  != dev->prog_if)  return 0;
+    
+    return 1;
+}
+
+static void pci_probe(PciDriver* driver, PciDevice* dev) {
+    if (dev->driver || !pci_match(driver, dev))
+        return;
+    
+    if (driver->probe(dev)) {
+        dev->driver = driver;
+        printf("PCI %d:%d.%d: claimed by %s\n", dev->bus, dev->slot, dev->func, driver->name);
+    }
+}
+
+static void pci_scan_bus(u8 bus);
+
+static void pci_add_function(u8 bus, u8 slot, u8 func) {
+    if (device_count >= PCI_MAX_DEVICES) {
+        printf("PCI: device table is full, %d:%d.%d ignored\n", bus, slot, func);
+        return;
+    }
+    
+    PciDevice* dev = &devices[device_count++];
+    memset(dev, 0, sizeof(PciDevice));
+    
+    u32 id = pci_read32(bus, slot, func, PCI_VENDOR_ID);
+    u32 class = pci_read32(bus, slot, func, PCI_REVISION);
+    
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    
+    dev->vendor = id & 0xFFFF;
+    dev->device = id >> 16;
+    
+    dev->revision = class & 0xFF;
+    dev->prog_if = (class >> 8) & 0xFF;
+    dev->subclass = (class >> 16) & 0xFF;
+    dev->class = class >> 24;
+    
+    dev->header = pci_read8(bus, slot, func, PCI_HEADER_TYPE) & PCI_HEADER_MASK;
+    dev->irq_line = pci_read8(bus, slot, func, PCI_INTERRUPT_LINE);
+    dev->irq_pin = pci_read8(bus, slot, func, PCI_INTERRUPT_PIN);
+    
+    pci_decode_bars(dev);
+    
+    for (u32 i = 0; i < driver_count; i++)
+        pci_probe(drivers[i], dev);
+    
+    if (dev->class == PCI_CLASS_BRIDGE && dev->subclass == PCI_SUBCLASS_PCI)
+        pci_scan_bus(pci_read8(bus, slot, func, PCI_SECONDARY_BUS));
+}
+
+static void pci_scan_bus(u8 bus) {
+    if (scanned_buses[bus / 32] & (1u << (bus % 32)))
+        return;
+    
+    scanned_buses[bus / 32] |= 1u << (bus % 32);
+    
+    for (u8 slot = 0; slot < 32; slot++) {
+        if (pci_read16(bus, slot, 0, PCI_VENDOR_ID) == PCI_VENDOR_NONE)
+            continue;
+        
+        u8 functions = (pci_read8(bus, slot, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTI) ? 8 : 1;
+        
+        for (u8 func = 0; func < functions; func++) {
+            if (pci_read16(bus, slot, func, PCI_VENDOR_ID) != PCI_VENDOR_NONE)
+                pci_add_function(bus, slot, func);
+        }
+    }
+}
+
+void pci_init(void) {
+    device_count = 0;
+    memset(scanned_buses, 0, sizeof(scanned_buses));
+    
+    // No host bridge answering means no PCI (or no mechanism #1)
+    if (pci_read16(0, 0, 0, PCI_VENDOR_ID) == PCI_VENDOR_NONE) {
+        printf("PCI: no host bridge found\n");
+        return;
+    }
+    
+    // A multi function host bridge has one function per host controller (and bus)
+    if (pci_read8(0, 0, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTI) {
+        for (u8 func = 0; func < 8; func++) {
+            if (pci_read16(0, 0, func, PCI_VENDOR_ID) != PCI_VENDOR_NONE)
+                pci_scan_bus(func);
+        }
+    } else {
+        pci_scan_bus(0);
+    }
+    
+    printf("PCI: %d devices\n", device_count);
+}
+
+void pci_register_driver(PciDriver* driver) {
+    if (driver_count >= PCI_MAX_DRIVERS) {
+        printf("pci_register_driver: too many drivers, can't add %s\n", driver->name);
+        return;
+    }
+    
+    drivers[driver_count++] = driver;
+    
+    for (u32 i = 0; i < device_count; i++)
+        pci_probe(driver, &devices[i]);
+}
+
+void pci_enable(PciDevice* dev) {
+    u16 command = pci_read16(dev->bus, dev->slot, dev->func, PCI_COMMAND);
+    
+    command |= PCI_CMD_BUS_MASTER;
+    
+    for (u32 i = 0; i < PCI_MAX_BARS; i++) {
+        if (dev->bars[i].size)
+            command |= (dev->bars[i].flags & PCI_BAR_IO) ? PCI_CMD_IO : PCI_CMD_MEMORY;
+    }
+    
+    pci_write16(dev->bus, dev->slot, dev->func, PCI_COMMAND, command);
+}
+
+u32 pci_device_count(void) {
+    return device_count;
+}
+
+PciDevice* pci_device(u32 index) {
+    return index < device_count ? &devices[index] : nullptr;
+}
+
+PciDevice* pci_find(u16 vendor, u16 device) {
+    for (u32 i = 0; i < device_count; i++) {
+        if (devices[i].vendor == vendor && devices[i].device == device)
+            return &devices[i];
+    }
+    
+    return nullptr;
+}
+
+PciDevice* pci_find_class(u8 class, u8 subclass) {
+    for (u32 i = 0; i < device_count; i++) {
+        if (devices[i].class == class && devices[i].subclass == subclass)
+            return &devices[i];
+    }
+    
+    return nullptr;
+}
+
+PciBar* pci_find_bar(u32 addr) {
+    for (u32 i = 0; i < device_count; i++) {
+        for (u32 b = 0; b < PCI_MAX_BARS; b++) {
+            PciBar* bar = &devices[i].bars[b];
+            
+            if (bar->size && !(bar->flags & PCI_BAR_IO) &&
+                addr >= bar->base && addr - bar->base < bar->size)
+                return bar;
+        }
+    }
+    
+    return nullptr;
+}
+
+void pci_dump(void) {
+    printf("PCI devices:\n");
+    
+    for (u32 i = 0; i < device_count; i++) {
+        PciDevice* dev = &devices[i];
+        const char* class = dev->class < PCI_CLASS_NAMES ? class_names[dev->class] : "other";
+        
+        printf("  %d:%d.%d %x:%x %s (%x/%x/%x) irq=%d driver=%s\n",
+               dev->bus, dev->slot, dev->func, dev->vendor, dev->device, class,
+               dev->class, dev->subclass, dev->prog_if, dev->irq_pin ? dev->irq_line : 0,
+               dev->driver ? dev->driver->name : "none");
+        
+        for (u32 b = 0; b < PCI_MAX_BARS; b++) {
+            PciBar* bar = &dev->bars[b];
+            
+            if (!bar->size)
+                continue;
+            
+            printf("    BAR%d: %s %x size %x%s\n", b,
+                   (bar->flags & PCI_BAR_IO) ? "io" : "mem", bar->base, bar->size,
+                   (bar->flags & PCI_BAR_PREFETCH) ? " prefetchable" : "");
+        }
+    }
+}
@@ -0,0 +1,146 @@
+﻿#ifndef PCI_H
+#define PCI_H
+
+#include "../io.h"
+
+/**
+ * PCI bus enumeration through configuration mechanism #1.
+ *
+ * pci_init walks the buses from bus 0 (following PCI-to-PCI bridges),
+ * every function found gets an entry in a fixed device table with its
+ * ids, class and decoded BARs.
+ *
+ * Drivers register a match (vendor/device or class/subclass/prog_if,
+ * PCI_ANY for "don't care"), and their probe is called for every
+ * unclaimed device that matches, both for devices already found and
+ * ones found later.
+ *
+ * https://wiki.osdev.org/PCI
+ */
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// Configuration space (header type 0 unless noted)
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_STATUS          0x06
+#define PCI_REVISION        0x08
+#define PCI_PROG_IF         0x09
+#define PCI_SUBCLASS        0x0A
+#define PCI_CLASS           0x0B
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_SECONDARY_BUS   0x19 // Header type 1
+#define PCI_INTERRUPT_LINE  0x3C
+#define PCI_INTERRUPT_PIN   0x3D
+
+// Command register
+#define PCI_CMD_IO          0x1
+#define PCI_CMD_MEMORY      0x2
+#define PCI_CMD_BUS_MASTER  0x4
+#define PCI_CMD_INTX_OFF    0x400
+
+#define PCI_HEADER_MULTI    0x80 // Header type, device has more than one function
+#define PCI_HEADER_MASK     0x7F
+#define PCI_HEADER_BRIDGE   0x01
+
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+#define PCI_SUBCLASS_SATA   0x06
+#define PCI_CLASS_DISPLAY   0x03
+#define PCI_CLASS_BRIDGE    0x06
+#define PCI_SUBCLASS_PCI    0x04 // PCI-to-PCI bridge
+
+#define PCI_VENDOR_NONE     0xFFFF
+
+#define PCI_MAX_DEVICES     32
+#define PCI_MAX_DRIVERS     8
+#define PCI_MAX_BARS        6
+
+// Matches any value in a PciDriver
+#define PCI_ANY             0xFFFF
+
+// BAR flags
+#define PCI_BAR_IO          0x1
+#define PCI_BAR_64          0x2 // The next BAR holds the high half (and is left empty)
+#define PCI_BAR_PREFETCH    0x4
+
+typedef struct {
+    u32 base;       // 0 if the BAR isn't implemented
+    u32 size;
+    u8 flags;
+} PciBar;
+
+struct PciDriver;
+
+typedef struct {
+    u8 bus;
+    u8 slot;
+    u8 func;
+    
+    u16 vendor;
+    u16 device;
+    
+    u8 class;
+    u8 subclass;
+    u8 prog_if;
+    u8 revision;
+    u8 header;      // Header type, without PCI_HEADER_MULTI
+    
+    u8 irq_line;    // Legacy PIC IRQ the firmware routed the device to
+    u8 irq_pin;     // 0 if the device doesn't use INTx
+    
+    PciBar bars[PCI_MAX_BARS];
+    
+    struct PciDriver* driver;
+    void* driver_data;
+} PciDevice;
+
+typedef struct PciDriver {
+    const char* name;
+    
+    u16 vendor;
+    u16 device;
+    u16 class;
+    u16 subclass;
+    u16 prog_if;
+    
+    /**
+     * Returns 1 if the driver took the device,
+     * 0 leaves it for the next matching driver.
+     */
+    u8 (*probe)(PciDevice* device);
+} PciDriver;
+
+u32 pci_read32(u8 bus, u8 slot, u8 func, u8 offset);
+u16 pci_read16(u8 bus, u8 slot, u8 func, u8 offset);
+u8 pci_read8(u8 bus, u8 slot, u8 func, u8 offset);
+void pci_write32(u8 bus, u8 slot, u8 func, u8 offset, u32 value);
+void pci_write16(u8 bus, u8 slot, u8 func, u8 offset, u16 value);
+
+void pci_init(void);
+
+/**
+ * Adds a driver and probes it against the devices found so far,
+ * "driver" has to stay around (static).
+ */
+void pci_register_driver(PciDriver* driver);
+
+// Sets bus mastering (and memory/io decoding for the BARs it has)
+void pci_enable(PciDevice* device);
+
+u32 pci_device_count(void);
+PciDevice* pci_device(u32 index);
+
+// First device with the ids/class, nullptr if there's none
+PciDevice* pci_find(u16 vendor, u16 device);
+PciDevice* pci_find_class(u8 class, u8 subclass);
+
+// Memory BAR that contains "addr", nullptr if no device decodes it
+PciBar* pci_find_bar(u32 addr);
+
+void pci_dump(void);
+
+#endif // PCI_H
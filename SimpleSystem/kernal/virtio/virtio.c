@@ -0,0 +1,179 @@
+﻿#include "virtio.h"
+
+#include "../memory/slab.h"
+#include "../serial/serial.h"
+
+// Stores before this are visible to the device before the ones after it
+static inline void virtio_wmb(void) {
+    asm volatile ("" ::: "memory");
+}
+
+// Full barrier, the index store has to land before the flags are read
+static inline void virtio_mb(void) {
+    asm volatile ("lock; addl $0, (%%esp)" ::: "memory", "cc");
+}
+
+static inline u32 virtq_align(u32 value) {
+    return (value + VIRTIO_QUEUE_ALIGN - 1) & ~(VIRTIO_QUEUE_ALIGN - 1);
+}
+
+void virtio_reset(u16 io_base) {
+    outb(io_base + VIRTIO_DEVICE_STATUS, 0);
+    
+    virtio_set_status(io_base, VIRTIO_STATUS_ACKNOWLEDGE);
+    virtio_set_status(io_base, VIRTIO_STATUS_DRIVER);
+}
+
+u32 virtio_negotiate(u16 io_base, u32 wanted) {
+    u32 accepted = inl(io_base + VIRTIO_DEVICE_FEATURES) & wanted;
+    
+    outl(io_base + VIRTIO_GUEST_FEATURES, accepted);
+    
+    return accepted;
+}
+
+void virtio_set_status(u16 io_base, u8 status) {
+    outb(io_base + VIRTIO_DEVICE_STATUS, inb(io_base + VIRTIO_DEVICE_STATUS) | status);
+}
+
+u8 virtq_init(Virtq* q, u16 io_base, u16 index) {
+    memset(q, 0, sizeof(Virtq));
+    
+    outw(io_base + VIRTIO_QUEUE_SELECT, index);
+    
+    u16 size = inw(io_base + VIRTIO_QUEUE_SIZE);
+    
+    if (size == 0 || size > VIRTQ_MAX_SIZE) {
+        printf("virtq %d: unusable size %d\n", index, size);
+        return 0;
+    }
+    
+    u32 used_offset = virtq_align(sizeof(VirtqDesc) * size + sizeof(u16) * (3 + size));
+    u32 bytes = used_offset + virtq_align(sizeof(u16) * 3 + sizeof(VirtqUsedElem) * size);
+    
+    // DMA buffers are aligned to their class size, so this is page aligned too
+    if (!dma_alloc(&q->ring, bytes, DMA_ZERO | DMA_ANY_BOUNDARY)) {
+        printf("virtq %d: no DMA memory for %d bytes\n", index, bytes);
+        return 0;
+    }
+    
+    q->tokens = (void**)kzalloc(sizeof(void*) * size);
+    
+    if (!q->tokens) {
+        dma_free(&q->ring);
+        return 0;
+    }
+    
+    q->io_base = io_base;
+    q->index = index;
+    q->size = size;
+    
+    q->desc = (VirtqDesc*)q->ring.virt;
+    q->avail = (VirtqAvail*)((u8*)q->ring.virt + sizeof(VirtqDesc) * size);
+    q->used = (VirtqUsed*)((u8*)q->ring.virt + used_offset);
+    
+    for (u16 i = 0; i < size; i++)
+        q->desc[i].next = i + 1;
+    
+    q->free_head = 0;
+    q->num_free = size;
+    
+    outl(io_base + VIRTIO_QUEUE_ADDRESS, q->ring.phys / VIRTIO_QUEUE_ALIGN);
+    
+    return 1;
+}
+
+u8 virtq_add(Virtq* q, const VirtqBuffer* buffers, u32 count, void* token) {
+    if (count == 0 || count > q->num_free)
+        return 0;
+    
+    u16 head = q->free_head;
+    u16 last = head;
+    u16 index = head;
+    
+    for (u32 i = 0; i < count; i++) {
+        volatile VirtqDesc* desc = &q->desc[index];
+        
+        desc->addr = buffers[i].phys;
+        desc->len = buffers[i].len;
+        desc->flags = (buffers[i].write ? VIRTQ_DESC_F_WRITE : 0) |
+                      (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+        
+        last = index;
+        index = desc->next;
+    }
+    
+    q->free_head = q->desc[last].next;
+    q->num_free -= count;
+    
+    q->tokens[head] = token;
+    q->avail->ring[q->avail_idx % q->size] = head;
+    q->avail_idx++;
+    
+    return 1;
+}
+
+void virtq_kick(Virtq* q) {
+    if (q->avail->idx == q->avail_idx)
+        return;
+    
+    // The ring entries have to be there before the device can see the new index
+    virtio_wmb();
+    q->avail->idx = q->avail_idx;
+    virtio_mb();
+    
+    if (q->used->flags & VIRTQ_USED_F_NO_NOTIFY) {
+        q->kicks_skipped++;
+        return;
+    }
+    
+    outw(q->io_base + VIRTIO_QUEUE_NOTIFY, q->index);
+    q->kicks++;
+}
+
+u8 virtq_has_used(Virtq* q) {
+    return q->used->idx != q->last_used;
+}
+
+void* virtq_get_used(Virtq* q, u32* len) {
+    if (!virtq_has_used(q))
+        return nullptr;
+    
+    // The element is only valid once the index says so
+    virtio_mb();
+    
+    volatile VirtqUsedElem* elem = &q->used->ring[q->last_used % q->size];
+    u16 head = elem->id;
+    
+    if (len)
+        *len = elem->len;
+    
+    q->last_used++;
+    
+    // Give the whole chain back
+    u16 index = head;
+    u16 freed = 1;
+    
+    while (q->desc[index].flags & VIRTQ_DESC_F_NEXT) {
+        index = q->desc[index].next;
+        freed++;
+    }
+    
+    q->desc[index].next = q->free_head;
+    q->free_head = head;
+    q->num_free += freed;
+    
+    void* token = q->tokens[head];
+    q->tokens[head] = nullptr;
+    
+    return token;
+}
+
+void virtq_disable_irq(Virtq* q) {
+    q->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+void virtq_enable_irq(Virtq* q) {
+    q->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    virtio_mb();
+}
@@ -0,0 +1,141 @@
+﻿#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "../io.h"
+#include "../memory/dma.h"
+
+/**
+ * Legacy virtio-pci transport and split virtqueues.
+ *
+ * Legacy (and transitional) devices have all of their registers in
+ * the I/O BAR0, the queue is one physically contiguous, page aligned
+ * block: descriptors, the available ring, and (on the next page)
+ * the used ring.
+ *
+ * Buffers are added as descriptor chains and only published (and the
+ * device notified) by virtq_kick, so several chains go out with a
+ * single notify. The device can say it doesn't need notifies
+ * (VIRTQ_USED_F_NO_NOTIFY), and the driver turns completion IRQs off
+ * while it's already draining the used ring.
+ *
+ * https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.html
+ */
+
+#define VIRTIO_VENDOR           0x1AF4
+#define VIRTIO_DEVICE_MIN       0x1000 // Transitional devices, 0x1000 - 0x103F
+#define VIRTIO_DEVICE_MODERN    0x1040 // Modern only devices, 0x1040 + device type
+
+// Legacy registers, offsets from BAR0
+#define VIRTIO_DEVICE_FEATURES  0x00
+#define VIRTIO_GUEST_FEATURES   0x04
+#define VIRTIO_QUEUE_ADDRESS    0x08 // Page frame number of the queue
+#define VIRTIO_QUEUE_SIZE       0x0C
+#define VIRTIO_QUEUE_SELECT     0x0E
+#define VIRTIO_QUEUE_NOTIFY     0x10
+#define VIRTIO_DEVICE_STATUS    0x12
+#define VIRTIO_ISR_STATUS       0x13 // Reading it acknowledges the IRQ
+#define VIRTIO_DEVICE_CONFIG    0x14 // Without MSI-X
+
+#define VIRTIO_QUEUE_ALIGN      4096
+
+// Device status
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_ISR_QUEUE        0x01
+
+#define VIRTQ_DESC_F_NEXT       0x1
+#define VIRTQ_DESC_F_WRITE      0x2 // Device writes to the buffer
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 0x1
+#define VIRTQ_USED_F_NO_NOTIFY     0x1
+
+#define VIRTQ_MAX_SIZE          1024
+
+typedef struct {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+} __attribute__((packed)) VirtqDesc;
+
+typedef struct {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+} __attribute__((packed)) VirtqAvail;
+
+typedef struct {
+    u32 id;     // Head of the chain
+    u32 len;    // Bytes the device wrote
+} __attribute__((packed)) VirtqUsedElem;
+
+typedef struct {
+    u16 flags;
+    u16 idx;
+    VirtqUsedElem ring[];
+} __attribute__((packed)) VirtqUsed;
+
+// One buffer of a chain
+typedef struct {
+    u32 phys;
+    u32 len;
+    u8 write;   // Device writable, these have to come after the read only ones
+} VirtqBuffer;
+
+typedef struct {
+    u16 io_base;
+    u16 index;
+    u16 size;
+    
+    volatile VirtqDesc* desc;
+    volatile VirtqAvail* avail;
+    volatile VirtqUsed* used;
+    
+    u16 free_head;      // Free descriptors, linked through "next"
+    u16 num_free;
+    
+    u16 avail_idx;      // Not published until virtq_kick
+    u16 last_used;
+    
+    void** tokens;      // Per chain head
+    DmaBuffer ring;
+    
+    u32 kicks;
+    u32 kicks_skipped;  // The device said it didn't need them
+} Virtq;
+
+// Resets the device and goes through ACKNOWLEDGE and DRIVER
+void virtio_reset(u16 io_base);
+
+/**
+ * Offers the wanted features the device has, returns the accepted set.
+ * Legacy devices don't have FEATURES_OK, whatever is written is used.
+ */
+u32 virtio_negotiate(u16 io_base, u32 wanted);
+
+void virtio_set_status(u16 io_base, u8 status);
+
+// Sets up and hands queue "index" to the device, returns 0 on failure
+u8 virtq_init(Virtq* q, u16 io_base, u16 index);
+
+/**
+ * Adds a chain of "count" buffers, returns 0 if there aren't enough free descriptors.
+ * "token" comes back out of virtq_get_used once the device is done.
+ */
+u8 virtq_add(Virtq* q, const VirtqBuffer* buffers, u32 count, void* token);
+
+// Publishes everything added since the last kick and notifies the device if it wants it
+void virtq_kick(Virtq* q);
+
+// Next finished chain (freeing its descriptors), nullptr if there's none
+void* virtq_get_used(Virtq* q, u32* len);
+
+u8 virtq_has_used(Virtq* q);
+
+void virtq_disable_irq(Virtq* q);
+void virtq_enable_irq(Virtq* q);
+
+#endif // VIRTIO_H
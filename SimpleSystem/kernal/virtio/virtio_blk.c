@@ -0,0 +1,454 @@
+﻿#include "virtio_blk.h"
+
+#include "../memory/paging.h"
+#include "../pci/pci.h"
+#include "../pic/pic.h"
+#include "../serial/serial.h"
+
+static PciDevice* device = nullptr;
+static u16 io_base = 0;
+static u8 irq = 0xFF;
+
+static u32 features = 0;
+static u32 capacity = 0;
+static u32 max_sectors = VIRTIO_BLK_MAX_SECTORS;
+
+static Virtq queue;
+
+static DmaBuffer command_buffer;
+static VirtioBlkCommand* commands = nullptr;
+static u32 busy = 0;
+
+// Requests not fully issued yet, the head may be partly issued
+static BlockRequest* queue_head = nullptr;
+static BlockRequest* queue_tail = nullptr;
+static u32 head_issued = 0;
+
+static VirtioBlkStats stats;
+
+static u8 virtio_blk_probe(PciDevice* dev) {
+    if (dev->device == VIRTIO_BLK_DEVICE_MODERN) {
+        printf("virtio-blk %d:%d.%d is modern only, no legacy I/O BAR\n", dev->bus, dev->slot, dev->func);
+        return 0;
+    }
+    
+    if (dev->device != VIRTIO_BLK_DEVICE_LEGACY || device)
+        return 0;
+    
+    if (!dev->bars[0].size || !(dev->bars[0].flags & PCI_BAR_IO))
+        return 0;
+    
+    device = dev;
+    io_base = dev->bars[0].base;
+    
+    pci_enable(dev);
+    
+    return 1;
+}
+
+static PciDriver virtio_blk_driver = {
+    .name = "virtio-blk",
+    .vendor = VIRTIO_VENDOR,
+    .device = PCI_ANY,
+    .class = PCI_ANY,
+    .subclass = PCI_ANY,
+    .prog_if = PCI_ANY,
+    .probe = virtio_blk_probe,
+};
+
+static inline u32 command_phys(void* field) {
+    return command_buffer.phys + ((u8*)field - (u8*)command_buffer.virt);
+}
+
+// One buffer per physically contiguous run, returns how many (0 if a page isn't mapped)
+static u32 virtio_blk_segments(VirtqBuffer* buffers, u8* data, u32 bytes, u8 write) {
+    u32 count = 0;
+    u32 virt = (u32)data;
+    u32 end = virt + bytes;
+    
+    while (virt < end) {
+        u32 phys = dma_phys((void*)virt);
+        u32 length = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        
+        if (!phys)
+            return 0;
+        
+        if (length > end - virt)
+            length = end - virt;
+        
+        if (count && buffers[count - 1].phys + buffers[count - 1].len == phys) {
+            buffers[count - 1].len += length;
+        } else {
+            buffers[count].phys = phys;
+            buffers[count].len = length;
+            buffers[count].write = write;
+            count++;
+        }
+        
+        virt += length;
+    }
+    
+    return count;
+}
+
+static s32 virtio_blk_free_command(void) {
+    for (u32 i = 0; i < VIRTIO_BLK_SLOTS; i++) {
+        if (!(busy & (1u << i)))
+            return i;
+    }
+    
+    return -1;
+}
+
+static void virtio_blk_pop(void) {
+    queue_head = queue_head->next;
+    head_issued = 0;
+    
+    if (!queue_head)
+        queue_tail = nullptr;
+}
+
+static void virtio_blk_finish(BlockRequest* request) {
+    u8 failed = request->error != 0;
+    
+    if (failed) {
+        stats.errors++;
+        printf("virtio-blk error: lba=%x %d sectors status=%x\n", request->lba, request->count, request->error);
+    }
+    
+    request->status = failed ? BLOCK_FAILED : BLOCK_DONE;
+    
+    if (request->callback)
+        request->callback(request);
+}
+
+// Adds the chain for "command", returns 0 if the queue is out of descriptors
+static u8 virtio_blk_add(VirtioBlkCommand* command, u8* data, u32 bytes, u8 write) {
+    VirtqBuffer buffers[VIRTIO_BLK_MAX_SEGMENTS + 2];
+    u32 count = 0;
+    
+    buffers[count].phys = command_phys(&command->header);
+    buffers[count].len = sizeof(VirtioBlkHeader);
+    buffers[count].write = 0;
+    count++;
+    
+    if (bytes) {
+        u32 segments = virtio_blk_segments(&buffers[count], data, bytes, !write);
+        
+        if (!segments)
+            return 0;
+        
+        count += segments;
+    }
+    
+    buffers[count].phys = command_phys((void*)&command->status);
+    buffers[count].len = 1;
+    buffers[count].write = 1;
+    count++;
+    
+    command->status = 0xFF;
+    
+    return virtq_add(&queue, buffers, count, command);
+}
+
+// Fills free commands from the queue, then kicks once for all of them
+static void virtio_blk_issue(void) {
+    while (queue_head) {
+        s32 slot = virtio_blk_free_command();
+        
+        if (slot < 0)
+            break;
+        
+        BlockRequest* request = queue_head;
+        VirtioBlkCommand* command = &commands[slot];
+        
+        if (request->flags & BLOCK_FLUSH) {
+            command->header.type = VIRTIO_BLK_T_FLUSH;
+            command->header.reserved = 0;
+            command->header.sector = 0;
+            command->flush = 1;
+            command->sectors = 0;
+            command->request = request;
+            
+            if (!virtio_blk_add(command, nullptr, 0, 0))
+                break;
+            
+            busy |= 1u << slot;
+            stats.commands++;
+            stats.flushes++;
+            
+            request->status = BLOCK_ACTIVE;
+            virtio_blk_pop();
+            
+            continue;
+        }
+        
+        u32 offset = head_issued;
+        u32 count = request->count - offset;
+        
+        if (count > max_sectors)
+            count = max_sectors;
+        
+        command->header.type = request->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        command->header.reserved = 0;
+        command->header.sector = request->lba + offset;
+        command->flush = 0;
+        command->sectors = count;
+        command->request = request;
+        
+        if (!virtio_blk_add(command, (u8*)request->buffer + offset * BLOCK_SECTOR_SIZE,
+                            count * BLOCK_SECTOR_SIZE, request->write))
+            break;
+        
+        busy |= 1u << slot;
+        stats.commands++;
+        
+        request->status = BLOCK_ACTIVE;
+        head_issued += count;
+        
+        if (head_issued == request->count)
+            virtio_blk_pop();
+    }
+    
+    u32 in_flight = 0;
+    
+    for (u32 b = busy; b; b &= b - 1)
+        in_flight++;
+    
+    if (in_flight > stats.max_in_flight)
+        stats.max_in_flight = in_flight;
+    
+    virtq_kick(&queue);
+}
+
+static void virtio_blk_command_done(VirtioBlkCommand* command) {
+    BlockRequest* request = command->request;
+    
+    busy &= ~(1u << (command - commands));
+    
+    if (command->status != VIRTIO_BLK_S_OK) {
+        request->error = command->status;
+        
+        // Nothing more of it goes out, what wasn't issued counts as done
+        if (queue_head == request) {
+            request->done += request->count - head_issued;
+            virtio_blk_pop();
+        }
+    }
+    
+    if (command->flush) {
+        virtio_blk_finish(request);
+        return;
+    }
+    
+    request->done += command->sectors;
+    stats.sectors += command->sectors;
+    
+    if (request->done < request->count)
+        return;
+    
+    // FUA writes only count once they're out of the device's cache
+    if (request->write && (request->flags & BLOCK_FUA) && !request->error && (features & VIRTIO_BLK_F_FLUSH)) {
+        command->header.type = VIRTIO_BLK_T_FLUSH;
+        command->header.sector = 0;
+        command->flush = 1;
+        command->sectors = 0;
+        
+        // The chain that just finished freed enough descriptors
+        if (virtio_blk_add(command, nullptr, 0, 0)) {
+            busy |= 1u << (command - commands);
+            stats.commands++;
+            stats.flushes++;
+            
+            return;
+        }
+    }
+    
+    virtio_blk_finish(request);
+}
+
+static void virtio_blk_complete(void) {
+    VirtioBlkCommand* command;
+    
+    for (;;) {
+        // No IRQs for chains that finish while the ring is being drained anyway
+        virtq_disable_irq(&queue);
+        
+        while ((command = (VirtioBlkCommand*)virtq_get_used(&queue, nullptr)))
+            virtio_blk_command_done(command);
+        
+        virtq_enable_irq(&queue);
+        
+        // Something may have finished in between
+        if (!virtq_has_used(&queue))
+            break;
+    }
+    
+    virtio_blk_issue();
+}
+
+static void virtio_blk_irq(void) {
+    // Reading the ISR status acknowledges it
+    if (!(inb(io_base + VIRTIO_ISR_STATUS) & VIRTIO_ISR_QUEUE))
+        return;
+    
+    stats.irqs++;
+    virtio_blk_complete();
+}
+
+// Only one device is driven, the driver state is global
+static void virtio_blk_block_submit(BlockDevice* dev, BlockRequest* request) {
+    (void)dev;
+    virtio_blk_submit(request);
+}
+
+static u8 virtio_blk_block_wait(BlockDevice* dev, BlockRequest* request) {
+    (void)dev;
+    return virtio_blk_wait(request);
+}
+
+static const BlockOps virtio_blk_ops = {
+    .submit = virtio_blk_block_submit,
+    .wait = virtio_blk_block_wait,
+};
+
+void virtio_blk_init(void) {
+    memset(&stats, 0, sizeof(stats));
+    
+    pci_register_driver(&virtio_blk_driver);
+    
+    if (!device)
+        return;
+    
+    virtio_reset(io_base);
+    features = virtio_negotiate(io_base, VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH);
+    
+    // TODO; Anything past 2 TiB needs 64 bit LBAs everywhere
+    u32 capacity_high = inl(io_base + VIRTIO_DEVICE_CONFIG + VIRTIO_BLK_CAPACITY + 4);
+    capacity = capacity_high ? 0xFFFFFFFF : inl(io_base + VIRTIO_DEVICE_CONFIG + VIRTIO_BLK_CAPACITY);
+    
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        u32 seg_max = inl(io_base + VIRTIO_DEVICE_CONFIG + VIRTIO_BLK_SEG_MAX);
+        
+        // Worst case every page of a command is its own segment
+        if (seg_max && seg_max < VIRTIO_BLK_MAX_SEGMENTS)
+            max_sectors = (seg_max - 1) * (PAGE_SIZE / BLOCK_SECTOR_SIZE);
+    }
+    
+    if (!dma_alloc(&command_buffer, sizeof(VirtioBlkCommand) * VIRTIO_BLK_SLOTS, DMA_ZERO) ||
+        !virtq_init(&queue, io_base, 0)) {
+        printf("virtio-blk: setup failed\n");
+        
+        dma_free(&command_buffer);
+        virtio_set_status(io_base, VIRTIO_STATUS_FAILED);
+        device = nullptr;
+        
+        return;
+    }
+    
+    commands = (VirtioBlkCommand*)command_buffer.virt;
+    
+    if (device->irq_line < 16) {
+        irq = device->irq_line;
+        
+        irq_install_handler(irq, virtio_blk_irq);
+        IRQ_clear_mask(irq);
+    }
+    
+    virtio_set_status(io_base, VIRTIO_STATUS_DRIVER_OK);
+    
+    printf("virtio-blk: %d MB, queue %d, irq %d%s%s\n", capacity / 2048, queue.size, irq,
+           (features & VIRTIO_BLK_F_FLUSH) ? ", flush" : "", (features & VIRTIO_BLK_F_RO) ? ", read only" : "");
+    
+    BlockDevice* dev = block_register("vda", &virtio_blk_ops, nullptr, capacity, VIRTIO_BLK_SLOTS);
+    
+    if (dev)
+        dev->read_only = (features & VIRTIO_BLK_F_RO) != 0;
+}
+
+u8 virtio_blk_present(void) {
+    return device != nullptr;
+}
+
+void virtio_blk_submit(BlockRequest* request) {
+    request->status = BLOCK_PENDING;
+    request->error = 0;
+    request->done = 0;
+    request->next = nullptr;
+    
+    // Without VIRTIO_BLK_F_FLUSH there's no write cache to empty
+    u8 flush = (request->flags & BLOCK_FLUSH) && (features & VIRTIO_BLK_F_FLUSH);
+    
+    if (request->count == 0 && !flush) {
+        virtio_blk_finish(request);
+        return;
+    }
+    
+    if (!device || (!flush && (request->lba + request->count > capacity ||
+                               (request->write && (features & VIRTIO_BLK_F_RO)) ||
+                               !dma_reachable(request->buffer, request->count * BLOCK_SECTOR_SIZE)))) {
+        request->error = BLOCK_ERR_REJECTED;
+        virtio_blk_finish(request);
+        
+        return;
+    }
+    
+    if (request->write)
+        stats.writes++;
+    else if (!flush)
+        stats.reads++;
+    
+    if (queue_tail)
+        queue_tail->next = request;
+    else
+        queue_head = request;
+    
+    queue_tail = request;
+    
+    virtio_blk_issue();
+}
+
+u8 virtio_blk_wait(BlockRequest* request) {
+    u32 idle = 0;
+    u32 total = 0;
+    
+    while (request->status == BLOCK_PENDING || request->status == BLOCK_ACTIVE) {
+        u32 irqs = stats.irqs;
+        
+        handleIrqs();
+        
+        if (stats.irqs != irqs)
+            idle = 0;
+        
+        // The IRQ never showed up (or there isn't one), look at the used ring directly
+        if (++idle > VIRTIO_BLK_IRQ_TIMEOUT || irq == 0xFF) {
+            if (virtq_has_used(&queue)) {
+                stats.polled++;
+                virtio_blk_complete();
+            }
+            
+            idle = 0;
+        }
+        
+        // The device still owns the buffers, so there's no giving up on it
+        if (++total > VIRTIO_BLK_TIMEOUT) {
+            printf("virtio-blk: lba=%x still isn't done\n", request->lba);
+            total = 0;
+        }
+        
+        asm volatile ("pause");
+    }
+    
+    return request->status == BLOCK_DONE;
+}
+
+void virtio_blk_dump(void) {
+    if (!device)
+        return;
+    
+    printf("virtio-blk: reads=%d writes=%d commands=%d sectors=%d flushes=%d irqs=%d polled=%d errors=%d max_in_flight=%d\n",
+           stats.reads, stats.writes, stats.commands, stats.sectors, stats.flushes, stats.irqs,
+           stats.polled, stats.errors, stats.max_in_flight);
+    printf("  kicks=%d skipped=%d free descriptors=%d/%d\n",
+           queue.kicks, queue.kicks_skipped, queue.num_free, queue.size);
+}
@@ -0,0 +1,85 @@
+﻿#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "../io.h"
+#include "../block/block.h"
+#include "virtio.h"
+
+/**
+ * virtio-blk on the legacy virtio-pci transport.
+ *
+ * The disk is registered as block device "vda". Requests are split into
+ * commands of up to VIRTIO_BLK_MAX_SECTORS, every command is one
+ * descriptor chain (header, data pages, status byte), and all of the
+ * commands that fit are added before a single kick.
+ *
+ * There's no FUA in virtio-blk, BLOCK_FUA writes are followed by a
+ * VIRTIO_BLK_T_FLUSH, and so are BLOCK_FLUSH requests. Both only if the
+ * device offers VIRTIO_BLK_F_FLUSH, without it there's no write cache.
+ */
+
+#define VIRTIO_BLK_DEVICE_LEGACY 0x1001
+#define VIRTIO_BLK_DEVICE_MODERN 0x1042
+
+// Features
+#define VIRTIO_BLK_F_SEG_MAX     (1 << 2)
+#define VIRTIO_BLK_F_RO          (1 << 5)
+#define VIRTIO_BLK_F_FLUSH       (1 << 9)
+
+// Device config, offsets from VIRTIO_DEVICE_CONFIG
+#define VIRTIO_BLK_CAPACITY      0x00 // 64 bit, in 512 byte sectors
+#define VIRTIO_BLK_SEG_MAX       0x0C
+
+// Request types and status
+#define VIRTIO_BLK_T_IN          0
+#define VIRTIO_BLK_T_OUT         1
+#define VIRTIO_BLK_T_FLUSH       4
+#define VIRTIO_BLK_S_OK          0
+
+#define VIRTIO_BLK_SLOTS         32   // Commands in flight
+#define VIRTIO_BLK_MAX_SECTORS   128  // Per command, 64 KiB
+#define VIRTIO_BLK_MAX_SEGMENTS  (VIRTIO_BLK_MAX_SECTORS * BLOCK_SECTOR_SIZE / 4096 + 1)
+
+#define VIRTIO_BLK_IRQ_TIMEOUT   100000
+#define VIRTIO_BLK_TIMEOUT       10000000
+
+typedef struct {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+} __attribute__((packed)) VirtioBlkHeader;
+
+// Lives in DMA memory, the device reads the header and writes the status
+typedef struct {
+    VirtioBlkHeader header;
+    volatile u8 status;
+    u8 flush;
+    u16 reserved;
+    
+    u32 sectors;
+    BlockRequest* request;
+    u32 padding;
+} VirtioBlkCommand;
+
+typedef struct {
+    u32 reads;
+    u32 writes;
+    u32 commands;
+    u32 sectors;
+    u32 flushes;
+    u32 irqs;
+    u32 polled;
+    u32 errors;
+    u32 max_in_flight;
+} VirtioBlkStats;
+
+void virtio_blk_init(void);
+
+u8 virtio_blk_present(void);
+
+void virtio_blk_submit(BlockRequest* request);
+u8 virtio_blk_wait(BlockRequest* request);
+
+void virtio_blk_dump(void);
+
+#endif // VIRTIO_BLK_H
@@ -0,0 +1,57 @@
+import bisect
+import re
+import sys
+
+# === Configuration ===
+SYMBOLS_FILE = "symbols.txt"   # nm -n kernel.elf output (build.sh writes it to build/)
+
+# Usage: python3 resolve_allocs.py [serial log or -] [symbols.txt]
+# Without a log the allocation profile is read from stdin, i.e.
+#   qemu-system-i386 ... -serial stdio | python3 ../assets/py_scripts/resolve_allocs.py
+
+ADDRESS_PATTERN = re.compile(r"site (0x[0-9A-Fa-f]+)")
+
+def load_symbols(path):
+    """Reads "address type name" lines, only code symbols are kept."""
+    addresses = []
+    names = []
+
+    with open(path, "r") as f:
+        for line in f:
+            parts = line.split()
+
+            if len(parts) != 3 or parts[1] not in "TtWw":
+                continue
+
+            addresses.append(int(parts[0], 16))
+            names.append(parts[2])
+
+    return addresses, names
+
+def resolve(address, addresses, names):
+    index = bisect.bisect_right(addresses, address) - 1
+
+    if index < 0:
+        return "???"
+
+    return f"{names[index]}+{address - addresses[index]:#x}"
+
+def main():
+    log = open(sys.argv[1], "r") if len(sys.argv) > 1 and sys.argv[1] != "-" else sys.stdin
+    symbols = sys.argv[2] if len(sys.argv) > 2 else SYMBOLS_FILE
+
+    addresses, names = load_symbols(symbols)
+
+    for line in log:
+        line = line.rstrip("\r\n")
+        match = ADDRESS_PATTERN.search(line)
+
+        if match:
+            address = int(match.group(1), 16)
+            line = line.replace(match.group(1), f"{match.group(1)} {resolve(address, addresses, names)}", 1)
+
+        print(line, flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -19,34 +19,10 @@ _start:
     call print_newline
     call load_kernal
     
-    ; I forgot what this even does XD
-   mov ax, 0x1000
-   mov es, ax
-   mov bx, 0x0000
-    mov ax, [es:bx]            ; Load from address into EAX
-    movzx eax, word [es:bx]
-   mov eax, [es:bx]
-    
-    call print_hex
-    call print_newline
-    
     mov si, msg_loaded
     call print
     call print_newline
     
-    mov ax, 0x1000
-    mov es, ax
-    xor bx, bx
-    mov cx, 16
-    .debug_loop:
-        mov al, [es:bx]
-        call print_hex
-        mov al, ' '
-        int 0x10
-        inc bx
-        loop .debug_loop
-    call print_newline
-    
     ; Switch to protected mode
     mov si, msg_gdt_load
     call print
@@ -64,6 +40,9 @@ _start:
     ; Setup framebuffer
     call set_vesa_mode
     
+    ; Memory map for the kernel (ES is still 0 from set_vesa_mode)
+    call detect_memory
+    
     ; Set CR0.PE (Protection Enable)
     mov eax, cr0
     or eax, 1
@@ -72,7 +51,15 @@ _start:
     ; Far jump to protected mode
     jmp CODE_SEG:protected_mode
 
+; Has to match KERNEL_MAX_SECTORS in make_image.py
+KERNEL_SECTORS equ 512          ; 256 KiB, 0x10000 - 0x50000
+LOAD_CHUNK     equ 64           ; Sectors per read, 32 KiB never crosses a segment
+
 load_kernal:
+    mov cx, KERNEL_SECTORS / LOAD_CHUNK
+    
+.next:
+    push cx
     mov si, DAPACK              ; Load Disk Address Packet
     mov ah, 0x42                ; Extended Read Sectors
     mov dl, 0x80                ; Drive number (hard disk)
@@ -80,6 +67,13 @@ load_kernal:
     
     jc disk_error
     
+    ; Next chunk goes right after this one
+    add word [DAPACK + 6], LOAD_CHUNK * 512 / 16
+    add dword [DAPACK + 8], LOAD_CHUNK
+    
+    pop cx
+    loop .next
+    
     ret
 
 ; Needed to convert to 
@@ -126,10 +120,10 @@ enable_a20:
 DAPACK:
     db 0x10        ; Packet size (16 bytes)
     db 0           ; Always 0
-    dw 128         ; Number of sectors to read - 128
+    dw LOAD_CHUNK  ; Number of sectors to read
     dw 0x0000      ; Offset
-    dw 0x1000      ; Segment -> 0x1000 << 4 = 0x1000 (64KBs)
-    dq 1           ; Starting sector
+    dw 0x1000      ; Segment -> 0x1000 << 4 = 0x10000 (64KBs), moved up after every chunk
+    dq 1           ; Starting sector, moved up after every chunk
 
 disk_error:
     mov si, msg_disk_error
@@ -195,6 +189,43 @@ set_vesa_mode:
     hlt
     ret
 
+; BIOS memory map (INT 0x15, EAX=0xE820)
+; Stored at E820_MAP: dword entry count, followed by 24 byte entries
+; (u64 base, u64 length, u32 type, u32 ACPI 3.0 attributes)
+E820_MAP         equ 0x8000
+E820_MAX_ENTRIES equ 32
+SMAP             equ 0x534D4150  ; 'SMAP'
+
+detect_memory:
+    xor ebx, ebx                 ; Continuation value, 0 = first entry
+    xor ebp, ebp                 ; Entries stored
+    mov di, E820_MAP + 4
+    
+.next:
+    mov eax, 0xE820
+    mov ecx, 24
+    mov edx, SMAP
+    mov dword [es:di + 20], 1    ; Mark as valid in case the BIOS only writes 20 bytes
+    int 0x15
+    
+    jc .done                     ; Carry means end of list (or unsupported)
+    cmp eax, SMAP
+    jne .done
+    
+    jcxz .skip                   ; Ignore empty entries
+    inc bp
+    add di, 24
+    
+.skip:
+    test ebx, ebx                ; EBX = 0 after the last entry
+    jz .done
+    cmp bp, E820_MAX_ENTRIES
+    jb .next
+    
+.done:
+    mov [E820_MAP], ebp
+    ret
+
 print:
     mov ah, 0x0E         ; BIOS teletype function
 
@@ -295,7 +326,6 @@ DATA_SEG equ (gdt_data - gdt_start) | 0x10
 msg_loading    db "Loading...",0
 msg_vesa_fail  db "VESA fail!",0
 msg_disk_error db "Disk error!", 0
-msg_sectors_read db " Sectors read: ", 0
 
 times 510 - ($ - $$) db 0
 
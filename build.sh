@@ -19,17 +19,35 @@ nasm ../isr_stubs.asm -g -f elf -o isr_stubs.o || exit 1
 echo "Compiling kernel..."
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/kernel.c -o kernel.o || exit 1
 
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/cpu/cpu.c -o cpu.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/ahci/ahci.c -o ahci.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/ata/ata.c -o ata.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/block/bcache.c -o bcache.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/block/block.c -o block.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/block/ramdisk.c -o ramdisk.o || exit 1
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/decoding/pictures/bmp.c -o bmp.o || exit 1
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/idt/idt.c -o idt.o || exit 1
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/serial/serial.c -o serial.o || exit 1
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/keyboard/keyboard.c -o keyboard.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/filesystem/filesystem.c -o filesystem.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/dma.c -o dma.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/e820.c -o e820.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/frame.c -o frame.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/lazy.c -o lazy.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/mem.c -o mem.o || exit 1
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/paging.c -o paging.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/pat.c -o pat.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/slab.c -o slab.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/memory/trace.c -o trace.o || exit 1
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/mouse/mouse.c -o mouse.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/pci/pci.c -o pci.o || exit 1
 i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/pic/pic.c -o pic.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/virtio/virtio.c -o virtio.o || exit 1
+i686-elf-gcc -m32 -ffreestanding -nostdlib -g -c ../SimpleSystem/kernal/virtio/virtio_blk.c -o virtio_blk.o || exit 1
 
 # Link kernel as ELF
 echo "Linking kernel as ELF..."
-i686-elf-ld -g -T ../linker.ld -o kernel.elf kernel.o bmp.o idt.o serial.o keyboard.o paging.o mouse.o pic.o isr_stubs.o || exit 1
+i686-elf-ld -g -T ../linker.ld -o kernel.elf kernel.o cpu.o ahci.o ata.o bcache.o block.o ramdisk.o bmp.o idt.o serial.o keyboard.o filesystem.o dma.o e820.o frame.o lazy.o mem.o paging.o pat.o slab.o trace.o mouse.o pci.o pic.o virtio.o virtio_blk.o isr_stubs.o || exit 1
 
 # Convert ELF to binary for booting
 echo "Converting ELF to binary..."
@@ -54,6 +54,7 @@ ISR_NOERR 31
 ; Common ISR handler stub
 global isr_common_stub
 extern isr_handler_c
+extern cpu_fxsave
 
 isr_common_stub:
     cli
@@ -79,12 +80,31 @@ isr_common_stub:
     ; int_no, err_code
     ; eip, cs, eflags (already on stack pushed by CPU)
     
-    mov eax, esp           ; pointer to registers_t struct
-    push eax               ; Push the pointer to registers_t for C handler
+    mov ebx, esp           ; pointer to registers_t struct (ebx survives the C call)
+    
+    ; The handler can clobber xmm registers (lazy faults clear frames with SSE2 stores)
+    ; while the faulting instruction still needs them, so once SSE is on they're saved
+    cmp byte [cpu_fxsave], 0
+    je .no_fxsave
+    
+    sub esp, 512           ; FXSAVE area, has to be 16 byte aligned
+    and esp, ~15
+    fxsave [esp]
+    
+.no_fxsave:
+    push ebx               ; Push the pointer to registers_t for C handler
     call isr_handler_c     ; Call the C handler to process the exception
     
     add esp, 4             ; Clean up argument from stack (removes pointer to registers_t)
     
+    cmp byte [cpu_fxsave], 0
+    je .no_fxrstor
+    
+    fxrstor [esp]
+    
+.no_fxrstor:
+    mov esp, ebx           ; Drop the FXSAVE area
+    
     pop gs                 ; Restore segment registers
     pop fs
     pop es
@@ -94,7 +114,8 @@ isr_common_stub:
     
     add esp, 8             ; Remove int_no and err_code from stack (2 dwords)
     
-    sti                    ; Re-enable interrupts
+    ; No sti here, iret restores IF from the saved EFLAGS.
+    ; Page faults return here now and IRQs are polled, so they must stay off
     iret                   ; Return from interrupt
 
 ; --- IDT loader ---
@@ -32,8 +32,12 @@ FLOPPY_SECTORS = 2880
 IMAGE_SIZE = SECTOR_SIZE * FLOPPY_SECTORS
 
 BOOT_SECTORS = 1
-KERNEL_SECTORS = (len(open("kernel.bin", "rb").read()) + SECTOR_SIZE - 1) // SECTOR_SIZE
-FAT16_START_SECTOR = BOOT_SECTORS + KERNEL_SECTORS  # after boot + kernel
+
+# boot.asm always loads this many sectors (KERNEL_SECTORS there)
+KERNEL_MAX_SECTORS = 512
+
+# Fixed, so the kernel doesn't need to know how big it is to find it (BLOCK_BOOT_FS_LBA in block.h)
+FAT16_START_SECTOR = 2048
 
 with open("boot.bin", "rb") as f:
     boot = f.read()
@@ -42,8 +46,9 @@ with open("kernel.bin", "rb") as f:
     kernel = f.read()
 
 KERNEL_SECTORS = (len(kernel) + SECTOR_SIZE - 1) // SECTOR_SIZE
-if KERNEL_SECTORS > 128:
-    print(f"WARNING: Kernel too big! {KERNEL_SECTORS} sectors")
+if KERNEL_SECTORS > KERNEL_MAX_SECTORS:
+    print(f"ERROR: Kernel too big! {KERNEL_SECTORS} sectors, the boot loader only loads {KERNEL_MAX_SECTORS}")
+    exit(1)
 
 with open("test.img", "rb") as f:
     fat16 = f.read()
@@ -66,4 +71,4 @@ image[fat16_offset:fat16_offset + len(fat16)] = fat16
 with open("os-image.bin", "wb") as f:
     f.write(image)
 
-print(f"os-image.bin created successfully.\nKernel at sectors 1-{FAT16_START_SECTOR - 1}\nFAT16 at sector {FAT16_START_SECTOR}")
+print(f"os-image.bin created successfully.\nKernel at sectors 1-{KERNEL_SECTORS}\nFAT16 at sector {FAT16_START_SECTOR}")